@@ -0,0 +1,42 @@
+#!/usr/bin/env python3
+""" Microbenchmark for the cost of dispatching a tiny Python command.
+
+Runs a no-op command many times through shell_core.run, once writing to the
+shell's own stdout and once redirected to a file, and prints calls per second.
+
+Usage: PYTHONPATH=src python3 benchmarks/bench_python_command.py [calls]
+"""
+import os
+import sys
+import time
+
+import shell_core
+
+
+def noop(cmd_name, *args):
+  return 0
+
+
+def calls_per_second(line, calls):
+  script = "\n".join([line] * calls)
+  start = time.perf_counter()
+  shell_core.run(script)
+  return calls / (time.perf_counter() - start)
+
+
+def main():
+  calls = int(sys.argv[1]) if len(sys.argv) > 1 else 50000
+  shell_core.register("noop", noop)
+
+  cases = [
+    ("stdout", "noop a b c"),
+    ("redirected", "noop a b c > " + os.devnull),
+  ]
+  for name, line in cases:
+    calls_per_second(line, calls // 10) # Warm up the parse cache and allocator
+    rate = calls_per_second(line, calls)
+    print(f"{name:<12} {rate:>12,.0f} calls/s")
+
+
+if __name__ == "__main__":
+  main()
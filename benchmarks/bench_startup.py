@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+""" Benchmark for how quickly a fresh interpreter gets shellhost ready.
+
+Starts a new Python process per run that imports shellhost and, for the
+larger cases, sets up a few hundred commands the way a CLI wrapper would:
+once with @Command.auto_command in an imported module, once with
+Command.lazy so only the names are registered. Prints starts per second.
+
+Usage: PYTHONPATH=src python3 benchmarks/bench_startup.py [commands] [runs]
+"""
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+
+COMMAND_SOURCE = '''
+def cmd_{i}(path: str, count: int = 1, verbose: bool = False, *rest):
+  """ Generated command {i}. """
+  return 0
+'''
+
+
+def write_modules(directory, commands):
+  """ Writes the modules the startup cases import: plain functions, and the same decorated. """
+  body = "".join(COMMAND_SOURCE.format(i=i) for i in range(commands))
+  with open(os.path.join(directory, "bench_plain_commands.py"), "w") as out:
+    out.write(body)
+  with open(os.path.join(directory, "bench_auto_commands.py"), "w") as out:
+    out.write("from shellhost import Command\n" + body.replace("\ndef ", "\n@Command.auto_command\ndef "))
+
+
+def startup_cases(commands):
+  return [
+    ("import", "import shellhost"),
+    (f"auto_command_{commands}", "import shellhost, bench_auto_commands"),
+    (f"lazy_{commands}", f"from shellhost import Command\nfor i in range({commands}): Command.lazy(f'cmd_{{i}}', f'bench_plain_commands:cmd_{{i}}')"),
+  ]
+
+
+def starts_per_second(code, directory, runs):
+  """ Runs `code` in `runs` fresh interpreters and returns how many start per second. """
+  env = dict(os.environ)
+  env["PYTHONPATH"] = os.pathsep.join(path for path in (directory, env.get("PYTHONPATH")) if path)
+  command = [sys.executable, "-c", code]
+  subprocess.run(command, env=env, check=True) # Warm up the page cache and write the .pyc files
+  start = time.perf_counter()
+  for _ in range(runs):
+    subprocess.run(command, env=env, check=True)
+  return runs / (time.perf_counter() - start)
+
+
+def main():
+  commands = int(sys.argv[1]) if len(sys.argv) > 1 else 300
+  runs = int(sys.argv[2]) if len(sys.argv) > 2 else 20
+  with tempfile.TemporaryDirectory() as directory:
+    write_modules(directory, commands)
+    for name, code in startup_cases(commands):
+      rate = starts_per_second(code, directory, runs)
+      print(f"{name:<18} {rate:>8,.1f} starts/s  ({1000 / rate:.1f} ms)")
+
+
+if __name__ == "__main__":
+  main()
@@ -0,0 +1,211 @@
+#!/usr/bin/env python3
+""" Benchmark suite for the shell's hot paths.
+
+Covers tokenizing, variable and subshell expansion, registry lookup and tab
+completion with a growing number of commands, the round trip through a
+Python command, throughput of mixed Python/external pipelines and the startup
+time of a fresh interpreter with hundreds of commands. Internals are timed in a C
+loop through shell_core._benchmark; everything else goes through
+shell_core.run like a script would.
+
+Results are printed as JSON (and written to --output), one entry per case,
+so runs can be compared across releases. Higher values are always better.
+
+Usage: PYTHONPATH=src python3 benchmarks/run_benchmarks.py [--quick] [--repeat N] [--output FILE]
+"""
+import argparse
+import datetime
+import json
+import os
+import platform
+import shutil
+import sys
+import tempfile
+import time
+
+import shell_core
+from shellhost.shellhost_command import Command
+
+from bench_python_command import calls_per_second, noop
+from bench_startup import startup_cases, starts_per_second, write_modules
+
+
+TOKENIZE_LINES = {
+  "simple": "ls -la /tmp",
+  "pipeline": "cat data.txt | grep -v '#' | sort | uniq -c | sort -rn | head -n 10",
+  "quoted": "echo \"a b c\" 'd e f' \"g \\\"h\\\" i\" plain words 'and more'",
+  "redirections": "sort < in.txt > out.txt && wc -l out.txt >> log.txt || echo failed",
+  "long": " ".join(f"argument{i}" for i in range(200)),
+}
+
+VARIABLE_LINES = {
+  "none": "echo plain text without any variables in it at all",
+  "ten_vars": " ".join(f"${name}" for name in "ABCDEFGHIJ"),
+}
+
+SUBSHELL_LINES = {
+  "none": "echo no substitutions here",
+  "builtin": "echo $(echo hi) $(true)",
+}
+
+
+def best_rate(measure, repeat):
+  """ Runs measure() (which returns a rate) `repeat` times and keeps the best. """
+  return max(measure() for _ in range(repeat))
+
+
+def internal_rate(kind, line, iterations):
+  return iterations / shell_core._benchmark(kind, line, iterations)
+
+
+def bench_internals(results, scale, repeat):
+  for case, line in TOKENIZE_LINES.items():
+    results.append(("tokenize", case, best_rate(lambda: internal_rate("tokenize", line, 200000 // scale), repeat), "ops/s"))
+
+  for name in "ABCDEFGHIJ":
+    shell_core.set_var(name, "value-of-" + name)
+  for case, line in VARIABLE_LINES.items():
+    results.append(("expand_variables", case, best_rate(lambda: internal_rate("expand_variables", line, 200000 // scale), repeat), "ops/s"))
+
+  for case, line in SUBSHELL_LINES.items():
+    results.append(("expand_subshells", case, best_rate(lambda: internal_rate("expand_subshells", line, 20000 // scale), repeat), "ops/s"))
+
+
+def bench_lookup(results, scale, repeat):
+  for count in (10, 1000, 100000 // scale):
+    names = [f"bench_cmd_{i}" for i in range(count)]
+    for name in names:
+      shell_core.register(name, noop)
+
+    hit = names[count // 2]
+    results.append(("registry_lookup", f"hit_{count}", best_rate(lambda: internal_rate("lookup", hit, 1000000 // scale), repeat), "ops/s"))
+    results.append(("registry_lookup", f"miss_{count}", best_rate(lambda: internal_rate("lookup", "no_such_command", 1000000 // scale), repeat), "ops/s"))
+    results.append(("completion", f"command_{count}", best_rate(lambda: internal_rate("complete", hit[:-1], 100000 // scale), repeat), "ops/s"))
+
+    for name in names:
+      shell_core.unregister(name)
+
+
+def bench_python_calls(results, scale, repeat):
+  shell_core.register("noop", noop)
+  calls = 50000 // scale
+  cases = [
+    ("stdout", "noop a b c"),
+    ("redirected", "noop a b c > " + os.devnull),
+  ]
+  for case, line in cases:
+    calls_per_second(line, calls // 10) # Warm up the parse cache and allocator
+    results.append(("python_call", case, best_rate(lambda: calls_per_second(line, calls), repeat), "calls/s"))
+  shell_core.unregister("noop")
+
+
+def py_copy(cmd_name, *args):
+  """ Copies stdin to stdout in large chunks. """
+  while True:
+    chunk = sys.stdin.read(1 << 16)
+    if not chunk:
+      return 0
+    sys.stdout.write(chunk)
+
+
+def py_copy_fd(cmd_name, *args):
+  """ Same as py_copy, but lets the kernel move the data. """
+  shell_core.copy_fd(sys.stdin, sys.stdout)
+  return 0
+
+
+@Command.auto_command(stream=True)
+def py_lines(lines):
+  """ Yields every line it reads. """
+  yield from lines
+
+
+def bench_pipelines(results, scale, repeat):
+  cat = shutil.which("cat")
+  if cat is None:
+    print("cat not found, skipping pipeline benchmarks", file=sys.stderr)
+    return
+
+  shell_core.register("py_copy", py_copy)
+  shell_core.register("py_copy_fd", py_copy_fd)
+  size_mb = max(1, 64 // scale)
+  line = "x" * 79 + "\n"
+  with tempfile.NamedTemporaryFile("w", suffix=".txt", delete=False) as data:
+    data.write(line * (size_mb * (1 << 20) // len(line)))
+  size = os.path.getsize(data.name) / (1 << 20)
+
+  cases = [
+    ("external", f"{cat} {data.name} | {cat} > {os.devnull}"),
+    ("builtin_cat", f"cat {data.name} | {cat} > {os.devnull}"),
+    ("python_copy", f"{cat} {data.name} | py_copy | {cat} > {os.devnull}"),
+    ("python_copy_fd", f"{cat} {data.name} | py_copy_fd | {cat} > {os.devnull}"),
+    ("python_lines", f"{cat} {data.name} | py_lines | {cat} > {os.devnull}"),
+  ]
+
+  def throughput(command):
+    start = time.perf_counter()
+    shell_core.run(command)
+    return size / (time.perf_counter() - start)
+
+  batch = shell_core.get_option("stream_batch")
+  shell_core.set_option("stream_batch", 0) # Measure throughput, not per-line latency
+  try:
+    for case, command in cases:
+      results.append(("pipeline", case, best_rate(lambda: throughput(command), repeat), "MB/s"))
+  finally:
+    shell_core.set_option("stream_batch", batch)
+    shell_core.unregister("py_copy")
+    shell_core.unregister("py_copy_fd")
+    os.unlink(data.name)
+
+
+def bench_startup(results, scale, repeat):
+  commands = 300
+  with tempfile.TemporaryDirectory() as directory:
+    write_modules(directory, commands)
+    for case, code in startup_cases(commands):
+      results.append(("startup", case, best_rate(lambda: starts_per_second(code, directory, max(1, 20 // scale)), repeat), "starts/s"))
+
+
+def shellhost_version():
+  try:
+    from importlib.metadata import version
+    return version("shellhost")
+  except Exception:
+    return None
+
+
+def main():
+  parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+  parser.add_argument("--quick", action="store_true", help="Use a tenth of the iterations (for smoke testing).")
+  parser.add_argument("--repeat", type=int, default=3, help="Runs per case; the best one is reported.")
+  parser.add_argument("--output", help="Also write the JSON results to this file.")
+  options = parser.parse_args()
+  scale = 10 if options.quick else 1
+
+  results = []
+  bench_internals(results, scale, options.repeat)
+  bench_lookup(results, scale, options.repeat)
+  bench_python_calls(results, scale, options.repeat)
+  bench_pipelines(results, scale, options.repeat)
+  bench_startup(results, scale, options.repeat)
+
+  report = {
+    "schema": 1,
+    "shellhost_version": shellhost_version(),
+    "python": platform.python_version(),
+    "platform": platform.platform(),
+    "timestamp": datetime.datetime.now(datetime.timezone.utc).isoformat(timespec="seconds"),
+    "repeat": options.repeat,
+    "quick": options.quick,
+    "results": [{"group": group, "case": case, "value": round(value, 3), "unit": unit} for group, case, value, unit in results],
+  }
+  text = json.dumps(report, indent=2)
+  print(text)
+  if options.output:
+    with open(options.output, "w") as out:
+      out.write(text + "\n")
+
+
+if __name__ == "__main__":
+  main()
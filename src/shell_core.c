@@ -12,9 +12,10 @@
   #include <process.h>
   #include <io.h>
   #include <conio.h> // Fixes "warning C4013: '_getch' undefined"
+  #include <direct.h> // _chdir / _getcwd
 
   // Map POSIX names to Windows CRT functions
-  #define pipe(fds) _pipe(fds, 4096, _O_BINARY)
+  #define pipe(fds) _pipe(fds, 4096, _O_BINARY | _O_NOINHERIT)
   #define close _close
   #define read _read
   #define write _write
@@ -25,11 +26,21 @@
   #define unlink _unlink
   #define strdup _strdup // Fixes "warning C4996: strdup deprecated"
   #define open _open
+  #define chdir _chdir
+  #define getcwd _getcwd
+  #define S_ISDIR(m) (((m) & _S_IFMT) == _S_IFDIR)
+  #define S_ISREG(m) (((m) & _S_IFMT) == _S_IFREG)
+  #define S_ISFIFO(m) (((m) & _S_IFMT) == _S_IFIFO)
+  #define S_ISSOCK(m) 0 // Sockets aren't fds here
+  #define R_OK 4
+  #define W_OK 2
+  #define X_OK 0 // _access can't test for execute permission; existence is the best we get
 
   #define STDIN_FILENO 0
   #define STDOUT_FILENO 1
   #define STDERR_FILENO 2
   #define FILE_MODE (_S_IREAD | _S_IWRITE)
+  #define O_CLOEXEC _O_NOINHERIT // Children only inherit the fds we dup2 onto stdin/stdout
 
 
   // Windows setenv replacement
@@ -46,7 +57,29 @@
   #include <sys/wait.h>
   #include <unistd.h>
   #include <termios.h>
+  #include <spawn.h>
+  #include <signal.h>
+  #include <sys/mman.h>
+  #include <sys/resource.h>
+  #include <poll.h>
+  #include <sys/socket.h>
+  #include <sys/un.h>
+  #include <netdb.h>
+  #include <dirent.h>
   #define FILE_MODE 0644
+
+  #ifdef __linux__
+    #include <sys/sendfile.h>
+    #include <sys/syscall.h> // copy_file_range, which older C libraries don't wrap
+  #endif
+
+  #ifdef __APPLE__
+    // Shared libraries can't use environ directly on macOS
+    #include <crt_externs.h>
+    #define environ (*_NSGetEnviron())
+  #else
+    extern char **environ;
+  #endif
 #endif
 
 #include <stdio.h>
@@ -56,31 +89,447 @@
 #include <stdbool.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
 
-#define MAX_HISTORY 50
-#define MAX_ARGS 64
-#define MAX_CMD_LEN 1024
 #define PY_SSIZE_T_CLEAN
 
 // -- GLOBAL HISTORY STORAGE --
-static char history[MAX_HISTORY][MAX_CMD_LEN];
-static int history_count = 0;
-static int history_view_idx = 0; // Where the user is currently looking
-
-// A simple linked list to store Python callbacks
+// A ring of variable-length lines. Once full, each new line overwrites the
+// oldest one, so adding never shifts entries around.
+typedef struct History {
+  char **entries;    // Ring slots, oldest at `start`
+  size_t capacity;   // The history_size option
+  size_t start;
+  size_t count;
+  size_t base;       // Sequence number of the oldest entry; entries keep their number for life
+  int loaded;        // Has history_file been read in yet?
+  int append_fd;     // history_file opened for appending, -1 until first use
+  int in_memory;     // Never read or written to history_file (server sessions)
+  char *read_file;   // The history_file that was read in, NULL if none
+  size_t read_size;  // How many of its bytes are already in the ring
+} History;
+
+static History history = {NULL, 0, 0, 0, 0, 0, -1, 0, NULL, 0};
+static size_t history_view_idx = 0; // Where the user is currently looking
+
+// -- COMMAND REGISTRY --
+// Python callbacks live in an open-addressed hash table keyed by command name,
+// so lookups stay O(1) no matter how many plugins register commands.
 typedef struct PyCommand {
   char *name;
+  PyObject *name_obj; // `name` as a str, passed as the first argument of every call
   PyObject *func;
-  struct PyCommand *next;
+  uint32_t hash;
+  int is_async;       // func (or the function a Command wraps) is "async def"
 } PyCommand;
 
-static PyCommand *py_cmd_head = NULL;
+#define REGISTRY_MIN_CAPACITY 64
+#define REGISTRY_TOMBSTONE ((PyCommand*)&registry_tombstone)
+
+static char registry_tombstone;            // Marks a deleted slot so probe chains stay intact
+static PyCommand **registry_slots = NULL;  // NULL = never used, REGISTRY_TOMBSTONE = deleted
+static size_t registry_capacity = 0;       // Always a power of two
+static size_t registry_count = 0;          // Live entries
+static size_t registry_used = 0;           // Live entries + tombstones
+
+// FNV-1a string hash used by the command registry and the parse cache.
+static uint32_t hash_name(const char *name) {
+  uint32_t h = 2166136261u;
+  for (const unsigned char *p = (const unsigned char*)name; *p; p++) {
+    h ^= *p;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// -- SHELL OPTIONS --
+// Tunables set from Python with shell_core.set_option(name, value).
+static int opt_parallel_subshells = 0; // Evaluate sibling $(...) substitutions concurrently
+static int opt_history_size = 1000;    // Lines kept in memory (and loaded from history_file)
+static char *opt_history_file = NULL;  // Optional file history is loaded from and appended to
+static int opt_stream_batch = 1;       // Items a returned iterator yields between flushes (0 = buffer)
+static int opt_object_pipes = 0;       // Hand return values between adjacent Python stages
+
+// -- EXECUTABLE PATH CACHE --
+// Like bash's `hash`: remembers where each external command was found on PATH
+// so repeated spawns skip the directory search. Cleared whenever PATH changes;
+// an entry whose file is gone (the spawn fails) is dropped and searched again.
+typedef struct PathEntry {
+  char *name;
+  char *path;
+  uint32_t hash;
+} PathEntry;
+
+#define PATH_CACHE_MIN_CAPACITY 64
+
+static PathEntry *path_cache = NULL;  // Open addressing, name == NULL marks an empty slot
+static size_t path_cache_capacity = 0; // Always a power of two
+static size_t path_cache_count = 0;
+static int path_index_stale = 1;       // PATH changed since tab completion last scanned it
+
+void clear_path_cache(void) {
+  for (size_t i = 0; i < path_cache_capacity; i++) {
+    free(path_cache[i].name);
+    free(path_cache[i].path);
+  }
+  free(path_cache);
+  path_cache = NULL;
+  path_cache_capacity = 0;
+  path_cache_count = 0;
+}
+
+static PathEntry* path_cache_slot(PathEntry *table, size_t capacity, const char *name, uint32_t hash) {
+  size_t mask = capacity - 1;
+  size_t idx = hash & mask;
+  while (table[idx].name != NULL) {
+    if (table[idx].hash == hash && strcmp(table[idx].name, name) == 0) break;
+    idx = (idx + 1) & mask;
+  }
+  return &table[idx];
+}
+
+static void path_cache_insert(const char *name, uint32_t hash, const char *path) {
+  // Keep the load factor under 1/2
+  if ((path_cache_count + 1) * 2 > path_cache_capacity) {
+    size_t new_capacity = path_cache_capacity ? path_cache_capacity * 2 : PATH_CACHE_MIN_CAPACITY;
+    PathEntry *grown = calloc(new_capacity, sizeof(PathEntry));
+    if (!grown) return; // Caching is best effort
+
+    for (size_t i = 0; i < path_cache_capacity; i++) {
+      if (path_cache[i].name == NULL) continue;
+      *path_cache_slot(grown, new_capacity, path_cache[i].name, path_cache[i].hash) = path_cache[i];
+    }
+    free(path_cache);
+    path_cache = grown;
+    path_cache_capacity = new_capacity;
+  }
+
+  PathEntry *slot = path_cache_slot(path_cache, path_cache_capacity, name, hash);
+  slot->name = strdup(name);
+  slot->path = strdup(path);
+  slot->hash = hash;
+  path_cache_count++;
+}
+
+// Drops the cached location of `name`. Returns 1 if there was one.
+static int path_cache_forget(const char *name) {
+  if (path_cache_count == 0) return 0;
+  PathEntry *slot = path_cache_slot(path_cache, path_cache_capacity, name, hash_name(name));
+  if (!slot->name) return 0;
+
+  free(slot->name);
+  free(slot->path);
+  slot->name = NULL;
+  slot->path = NULL;
+  path_cache_count--;
+
+  // Shift the rest of the probe run back so lookups don't stop at the hole
+  size_t mask = path_cache_capacity - 1;
+  size_t hole = (size_t)(slot - path_cache);
+  for (size_t idx = (hole + 1) & mask; path_cache[idx].name != NULL; idx = (idx + 1) & mask) {
+    size_t home = path_cache[idx].hash & mask;
+    if (((idx - home) & mask) >= ((idx - hole) & mask)) {
+      path_cache[hole] = path_cache[idx];
+      path_cache[idx].name = NULL;
+      path_cache[idx].path = NULL; // clear_path_cache frees every slot's path
+      hole = idx;
+    }
+  }
+  return 1;
+}
+
+// -- SHELL VARIABLES --
+// VAR=VAL assignments live in this table instead of the process environment,
+// so a lookup is one hash probe and children only see what was exported.
+// The environment the shell started with is imported (as exported) on first
+// use, and the envp handed to spawned commands is rebuilt only after an
+// exported variable changes. Exported variables are also mirrored into
+// os.environ, since Python commands run in this process. Like the registry,
+// it relies on the GIL.
+typedef struct ShellVar {
+  char *name;
+  char *value;
+  uint32_t hash;
+  int exported;
+} ShellVar;
+
+#define VAR_TABLE_MIN_CAPACITY 64
+
+static ShellVar *var_table = NULL;  // Open addressing, name == NULL marks an empty slot
+static size_t var_capacity = 0;     // Always a power of two
+static size_t var_count = 0;
+static int vars_loaded = 0;
+static char **var_envp = NULL;      // Cached NAME=value list of exported variables (NULL = stale)
+static PyObject *os_environ = NULL; // os.environ, once an exported variable changes
+static int shell_serving = 0;       // Inside shell_core.serve(): the process's environment
+                                    // and terminal aren't any one session's
+
+static ShellVar* var_slot(ShellVar *table, size_t capacity, const char *name, uint32_t hash) {
+  size_t mask = capacity - 1;
+  size_t idx = hash & mask;
+  while (table[idx].name != NULL) {
+    if (table[idx].hash == hash && strcmp(table[idx].name, name) == 0) break;
+    idx = (idx + 1) & mask;
+  }
+  return &table[idx];
+}
+
+static int var_table_grow(void) {
+  size_t new_capacity = var_capacity ? var_capacity * 2 : VAR_TABLE_MIN_CAPACITY;
+  ShellVar *grown = calloc(new_capacity, sizeof(ShellVar));
+  if (!grown) return -1;
+
+  for (size_t i = 0; i < var_capacity; i++) {
+    if (var_table[i].name == NULL) continue;
+    *var_slot(grown, new_capacity, var_table[i].name, var_table[i].hash) = var_table[i];
+  }
+  free(var_table);
+  var_table = grown;
+  var_capacity = new_capacity;
+  return 0;
+}
+
+static void vars_changed(const ShellVar *var) {
+  if (var->exported) {
+    free(var_envp);
+    var_envp = NULL;
+  }
+  // Cached command locations are only valid for the PATH they were found on
+  if (strcmp(var->name, "PATH") == 0) {
+    clear_path_cache();
+    path_index_stale = 1;
+#ifdef _WIN32
+    setenv("PATH", var->value ? var->value : "", 1); // _spawnvpe searches the process PATH
+#endif
+  }
+}
+
+// Sets (or with a NULL value, removes) `name` in os.environ, which passes it
+// on to the C environment. Sessions of a server keep their exports to
+// themselves, since the process is shared.
+static void environ_mirror(const char *name, const char *value) {
+  if (shell_serving) return;
+  if (!os_environ) {
+    PyObject *os = PyImport_ImportModule("os");
+    if (os) {
+      os_environ = PyObject_GetAttrString(os, "environ");
+      Py_DECREF(os);
+    }
+  }
+  PyObject *key = os_environ ? PyUnicode_DecodeFSDefault(name) : NULL;
+  if (key && value) {
+    PyObject *text = PyUnicode_DecodeFSDefault(value);
+    if (text) PyObject_SetItem(os_environ, key, text);
+    Py_XDECREF(text);
+  } else if (key && PyMapping_HasKey(os_environ, key)) {
+    PyObject_DelItem(os_environ, key);
+  }
+  Py_XDECREF(key);
+  PyErr_Clear(); // Best effort: spawned commands get the variable either way
+}
+
+static int var_store(const char *name, size_t name_len, const char *value, int export);
+
+static void vars_load(void) {
+  if (vars_loaded) return;
+
+#ifdef _WIN32
+  char **env = _environ;
+#else
+  char **env = environ;
+#endif
+  for (; env && *env; env++) {
+    const char *equals = strchr(*env, '=');
+    if (equals && equals != *env) var_store(*env, (size_t)(equals - *env), equals + 1, 1);
+  }
+  vars_loaded = 1;
+}
+
+// Returns the variable `name`, NULL if it isn't set.
+static ShellVar* var_find(const char *name) {
+  vars_load();
+  if (var_count == 0) return NULL;
+  ShellVar *slot = var_slot(var_table, var_capacity, name, hash_name(name));
+  return slot->name ? slot : NULL;
+}
+
+// Value of `name`, or NULL if it isn't set.
+const char* var_get(const char *name) {
+  ShellVar *var = var_find(name);
+  return var ? var->value : NULL;
+}
+
+// Sets the first `name_len` bytes of `name` to `value` (NULL keeps the current
+// value and does nothing if unset). `export` is 1 to export the variable, 0 to
+// stop exporting it and -1 to leave that as it is. Returns 0, or -1 if out of memory.
+static int var_store(const char *name, size_t name_len, const char *value, int export) {
+  char *key = malloc(name_len + 1);
+  if (!key) return -1;
+  memcpy(key, name, name_len);
+  key[name_len] = '\0';
+
+  uint32_t hash = hash_name(key);
+  ShellVar *slot = var_count ? var_slot(var_table, var_capacity, key, hash) : NULL;
+
+  if (!slot || !slot->name) {
+    if (!value) {
+      free(key);
+      return 0;
+    }
+    // Keep the load factor under 1/2
+    if ((var_count + 1) * 2 > var_capacity && var_table_grow() != 0) {
+      free(key);
+      return -1;
+    }
+    slot = var_slot(var_table, var_capacity, key, hash);
+    slot->name = key;
+    slot->value = NULL;
+    slot->hash = hash;
+    slot->exported = 0;
+    var_count++;
+  } else {
+    free(key);
+  }
+
+  if (value) {
+    char *copy = strdup(value);
+    if (!copy) return -1;
+    free(slot->value);
+    slot->value = copy;
+  }
+
+  int was_exported = slot->exported;
+  if (export >= 0) slot->exported = export;
+  if (was_exported && !slot->exported) {
+    free(var_envp);
+    var_envp = NULL;
+    environ_mirror(slot->name, NULL);
+  } else if (slot->exported && vars_loaded) { // Not while importing the environment
+    environ_mirror(slot->name, slot->value);
+  }
+  vars_changed(slot);
+  return 0;
+}
+
+int var_set(const char *name, const char *value, int export) {
+  vars_load();
+  return var_store(name, strlen(name), value, export);
+}
+
+// Removes `name`. Returns 1 if it was set.
+int var_unset(const char *name) {
+  ShellVar *slot = var_find(name);
+  if (!slot) return 0;
+
+  ShellVar removed = *slot;
+  slot->name = NULL;
+  var_count--;
+
+  // Shift the rest of the probe run back so lookups don't stop at the hole
+  size_t mask = var_capacity - 1;
+  size_t hole = (size_t)(slot - var_table);
+  for (size_t idx = (hole + 1) & mask; var_table[idx].name != NULL; idx = (idx + 1) & mask) {
+    size_t home = var_table[idx].hash & mask;
+    // Can the entry at idx move into the hole without passing its home slot?
+    if (((idx - home) & mask) >= ((idx - hole) & mask)) {
+      var_table[hole] = var_table[idx];
+      var_table[idx].name = NULL;
+      hole = idx;
+    }
+  }
+
+  free(removed.value);
+  removed.value = NULL;
+  if (removed.exported) environ_mirror(removed.name, NULL);
+  vars_changed(&removed);
+  free(removed.name);
+  return 1;
+}
+
+// NAME=value list of the exported variables, for spawned commands.
+char** exported_envp(void) {
+  vars_load();
+  if (var_envp) return var_envp;
+
+  size_t count = 0, text_size = 0;
+  for (size_t i = 0; i < var_capacity; i++) {
+    if (!var_table[i].name || !var_table[i].exported) continue;
+    count++;
+    text_size += strlen(var_table[i].name) + strlen(var_table[i].value) + 2;
+  }
+
+  // One block: the pointer array, then the strings
+  char **envp = malloc(sizeof(char*) * (count + 1) + text_size);
+  if (!envp) return NULL;
+  char *text = (char*)(envp + count + 1);
+  size_t n = 0;
+  for (size_t i = 0; i < var_capacity; i++) {
+    if (!var_table[i].name || !var_table[i].exported) continue;
+    envp[n++] = text;
+    text += sprintf(text, "%s=%s", var_table[i].name, var_table[i].value) + 1;
+  }
+  envp[n] = NULL;
+
+  var_envp = envp;
+  return envp;
+}
+
+#ifndef _WIN32
+// Returns the full path of the executable `name` (cached), or NULL if it isn't on PATH.
+// Names containing a slash are used as given, like execvp does.
+const char* resolve_executable(const char *name) {
+  if (strchr(name, '/')) return name;
+
+  uint32_t hash = hash_name(name);
+  if (path_cache_count > 0) {
+    PathEntry *slot = path_cache_slot(path_cache, path_cache_capacity, name, hash);
+    if (slot->name) return slot->path;
+  }
 
+  const char *path_env = var_get("PATH");
+  if (path_env == NULL) path_env = "/usr/bin:/bin";
+
+  size_t name_len = strlen(name);
+  const char *dir = path_env;
+  while (1) {
+    const char *end = strchr(dir, ':');
+    size_t dir_len = end ? (size_t)(end - dir) : strlen(dir);
+
+    // An empty PATH entry means the current directory
+    char *candidate = malloc(dir_len + name_len + 3);
+    if (!candidate) return NULL; // Out of memory: reported like a missing command
+    if (dir_len == 0) {
+      sprintf(candidate, "./%s", name);
+    } else {
+      memcpy(candidate, dir, dir_len);
+      candidate[dir_len] = '/';
+      memcpy(candidate + dir_len + 1, name, name_len + 1);
+    }
+
+    struct stat st;
+    if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+      path_cache_insert(name, hash, candidate);
+      free(candidate);
+      PathEntry *slot = path_cache_slot(path_cache, path_cache_capacity, name, hash);
+      return slot->name ? slot->path : NULL;
+    }
+    free(candidate);
+
+    if (!end) break;
+    dir = end + 1;
+  }
+  return NULL;
+}
+#endif
 
 
 
 // Cross-platform Spawner
-pid_t spawn_command(char **argv, int input_fd, int output_fd) {
+// `pgroup` is -1 to stay in the shell's process group, 0 to lead a new one,
+// or the id of the group to join (ignored on Windows).
+pid_t spawn_command(char **argv, int input_fd, int output_fd, pid_t pgroup) {
 #ifdef _WIN32
     int orig_stdin = dup(STDIN_FILENO);
     int orig_stdout = dup(STDOUT_FILENO);
@@ -88,7 +537,9 @@ pid_t spawn_command(char **argv, int input_fd, int output_fd) {
     if (input_fd != STDIN_FILENO) dup2(input_fd, STDIN_FILENO);
     if (output_fd != STDOUT_FILENO) dup2(output_fd, STDOUT_FILENO);
 
-    pid_t pid = _spawnvp(_P_NOWAIT, argv[0], argv);
+    (void)pgroup;
+    char **envp = exported_envp();
+    pid_t pid = envp ? _spawnvpe(_P_NOWAIT, argv[0], argv, envp) : _spawnvp(_P_NOWAIT, argv[0], argv);
 
     dup2(orig_stdin, STDIN_FILENO);
     dup2(orig_stdout, STDOUT_FILENO);
@@ -97,13 +548,71 @@ pid_t spawn_command(char **argv, int input_fd, int output_fd) {
 
     return pid;
 #else
-    pid_t pid = fork();
-    if (pid == 0) {
-        if (input_fd != STDIN_FILENO) dup2(input_fd, STDIN_FILENO);
-        if (output_fd != STDOUT_FILENO) dup2(output_fd, STDOUT_FILENO);
-        execvp(argv[0], argv);
-        perror("execvp failed");
-        exit(1);
+    // posix_spawn avoids duplicating the page tables of a (possibly huge)
+    // Python heap the way fork() does, and the path comes from the cache.
+    const char *path = resolve_executable(argv[0]);
+    if (path == NULL) {
+        fprintf(stderr, "%s: command not found\n", argv[0]);
+        return -1;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (input_fd != STDIN_FILENO) posix_spawn_file_actions_adddup2(&actions, input_fd, STDIN_FILENO);
+    if (output_fd != STDOUT_FILENO) posix_spawn_file_actions_adddup2(&actions, output_fd, STDOUT_FILENO);
+
+    // Python ignores SIGPIPE; give children the default so "yes | head" terminates
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t default_signals;
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGPIPE);
+    sigaddset(&default_signals, SIGXFSZ);
+    posix_spawnattr_setsigdefault(&attr, &default_signals);
+    short flags = POSIX_SPAWN_SETSIGDEF;
+    if (pgroup >= 0) {
+      // Background jobs get their own group so Ctrl-C at the prompt doesn't reach them
+      posix_spawnattr_setpgroup(&attr, pgroup);
+      flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    pid_t pid;
+    char **envp = exported_envp();
+    int err = posix_spawn(&pid, path, &actions, &attr, argv, envp ? envp : environ);
+
+    // The cached location may be stale: the binary was removed or moved
+    // since. Forget it and search PATH once more.
+    if ((err == ENOENT || err == EACCES) && !strchr(argv[0], '/') && path_cache_forget(argv[0])) {
+      path = resolve_executable(argv[0]);
+      if (path) err = posix_spawn(&pid, path, &actions, &attr, argv, envp ? envp : environ);
+    }
+
+    // Like execvp, run an executable the kernel doesn't recognize (a script
+    // without a #! line) with /bin/sh
+    if (path && err == ENOEXEC) {
+      int argc = 0;
+      while (argv[argc]) argc++;
+      char **sh_argv = malloc(sizeof(char*) * (argc + 2));
+      if (sh_argv) {
+        sh_argv[0] = "sh";
+        sh_argv[1] = (char*)path;
+        for (int i = 1; i <= argc; i++) sh_argv[i + 1] = argv[i]; // Including the NULL
+        err = posix_spawn(&pid, "/bin/sh", &actions, &attr, sh_argv, envp ? envp : environ);
+        free(sh_argv);
+      }
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (!path) {
+        fprintf(stderr, "%s: command not found\n", argv[0]);
+        return -1;
+    }
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(err));
+        return -1;
     }
     return pid;
 #endif
@@ -111,37 +620,299 @@ pid_t spawn_command(char **argv, int input_fd, int output_fd) {
 
 
 
+// Creates a pipe whose ends are not inherited by spawned children.
+// Pipeline stages run concurrently, so a stray copy of a write end in a
+// sibling process would keep its reader from ever seeing EOF.
+int make_pipe(int fds[2]) {
+#if defined(_WIN32)
+  return pipe(fds); // _O_NOINHERIT is part of the pipe() macro
+#elif defined(__linux__)
+  return pipe2(fds, O_CLOEXEC);
+#else
+  if (pipe(fds) == -1) return -1;
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  return 0;
+#endif
+}
+
+// dup() whose copy, like make_pipe's ends, is not inherited by spawned children.
+int dup_cloexec(int fd) {
+#ifdef _WIN32
+  return dup(fd); // CRT descriptors from dup are not inherited by _spawnvp unless dup2'd onto 0-2
+#else
+  return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+#endif
+}
+
+#define COPY_CHUNK (1 << 20) // Bytes per system call in copy_fd, and its fallback buffer size
+
+#ifdef __linux__
+enum { COPY_RANGE, COPY_SENDFILE, COPY_SPLICE, COPY_READ_WRITE };
+
+// One step of copy_fd with `method`: > 0 bytes moved, 0 at EOF, -1 on error.
+static ssize_t copy_fd_step(int method, int in_fd, int out_fd) {
+  switch (method) {
+#ifdef SYS_copy_file_range
+    case COPY_RANGE: return syscall(SYS_copy_file_range, in_fd, NULL, out_fd, NULL, (size_t)COPY_CHUNK, 0u);
+#else
+    case COPY_RANGE: errno = ENOSYS; return -1;
+#endif
+    case COPY_SENDFILE: return sendfile(out_fd, in_fd, NULL, COPY_CHUNK);
+    case COPY_SPLICE: return splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+  }
+  errno = EINVAL;
+  return -1;
+}
+#endif
+
+// Moves everything left in in_fd to out_fd, adding the byte count to *copied.
+// On Linux the bytes stay in the kernel where it allows it: copy_file_range
+// between regular files, sendfile from a file to anything else, splice when
+// either end is a pipe. Other platforms, and any pair the kernel turns down,
+// get large read/write copies. Blocks without touching Python, so call it
+// with the GIL released. Returns 0 at EOF, or -1 with errno set; EINTR means
+// a signal arrived, and calling again carries on where it stopped.
+int copy_fd(int in_fd, int out_fd, long long *copied) {
+#ifdef __linux__
+  struct stat in_st, out_st;
+  if (fstat(in_fd, &in_st) == 0 && fstat(out_fd, &out_st) == 0) {
+    int methods[3];
+    int method_count = 0;
+    if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) methods[method_count++] = COPY_RANGE;
+    if (S_ISREG(in_st.st_mode)) methods[method_count++] = COPY_SENDFILE;
+    if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)) methods[method_count++] = COPY_SPLICE;
+
+    for (int m = 0; m < method_count; m++) {
+      int moved = 0;
+      while (1) {
+        ssize_t n = copy_fd_step(methods[m], in_fd, out_fd);
+        if (n > 0) {
+          *copied += n;
+          moved = 1;
+          continue;
+        }
+        if (n == 0 && moved) return 0; // EOF
+        if (n < 0 && (moved || errno == EINTR)) return -1;
+        // Turned down on the first call (unsupported fd pair, O_APPEND output,
+        // or a /proc style file that claims to be empty): try the next way
+        break;
+      }
+    }
+  }
+#endif
+
+  char *buffer = malloc(COPY_CHUNK);
+  if (!buffer) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  int rc = 0;
+  while (rc == 0) {
+    ssize_t n = read(in_fd, buffer, COPY_CHUNK);
+    if (n <= 0) {
+      if (n < 0) rc = -1;
+      break;
+    }
+    for (ssize_t done = 0; done < n;) {
+      ssize_t w = write(out_fd, buffer + done, (size_t)(n - done));
+      if (w < 0 && errno == EINTR) continue; // Already read: the rest has to go out
+      if (w <= 0) {
+        if (w == 0) errno = EIO;
+        rc = -1;
+        break;
+      }
+      done += w;
+      *copied += w;
+    }
+  }
+
+  int err = errno;
+  free(buffer);
+  errno = err;
+  return rc;
+}
+
+
 // --- PYTHON MODULE METHODS (Exposed to Python) ---
 
-void register_python_command(const char *name, PyObject *func) {
+// Returns the slot holding `name`, or the slot where it should be inserted.
+// The table must have been allocated and must contain at least one NULL slot.
+static size_t registry_probe(const char *name, uint32_t hash) {
+  size_t mask = registry_capacity - 1;
+  size_t idx = hash & mask;
+  size_t first_free = (size_t)-1;
+
+  while (registry_slots[idx] != NULL) {
+    PyCommand *slot = registry_slots[idx];
+    if (slot == REGISTRY_TOMBSTONE) {
+      if (first_free == (size_t)-1) first_free = idx;
+    } else if (slot->hash == hash && strcmp(slot->name, name) == 0) {
+      return idx;
+    }
+    idx = (idx + 1) & mask;
+  }
+  return (first_free != (size_t)-1) ? first_free : idx;
+}
+
+// Re-inserts every live entry into a table of `new_capacity` slots, dropping tombstones.
+static int registry_resize(size_t new_capacity) {
+  PyCommand **old_slots = registry_slots;
+  size_t old_capacity = registry_capacity;
+
+  PyCommand **new_slots = calloc(new_capacity, sizeof(PyCommand*));
+  if (!new_slots) return -1;
+
+  registry_slots = new_slots;
+  registry_capacity = new_capacity;
+  registry_used = registry_count;
+
+  for (size_t i = 0; i < old_capacity; i++) {
+    PyCommand *cmd = old_slots[i];
+    if (cmd == NULL || cmd == REGISTRY_TOMBSTONE) continue;
+    registry_slots[registry_probe(cmd->name, cmd->hash)] = cmd;
+  }
+  free(old_slots);
+  return 0;
+}
+
+// Is `func`, or the function a Command object wraps, an "async def"?
+// Plain functions are decided from their code flags, so registering commands
+// at startup doesn't have to import inspect.
+static int is_coroutine_function(PyObject *func) {
+  static PyObject *iscoroutinefunction = NULL; // inspect.iscoroutinefunction
+
+  PyObject *target = PyObject_GetAttrString(func, "func");
+  if (!target) {
+    PyErr_Clear();
+    target = func;
+    Py_INCREF(target);
+  }
+  if (target == Py_None) { // A lazy Command that hasn't loaded its function yet
+    Py_DECREF(target);
+    return 0;
+  }
+  if (PyMethod_Check(target)) {
+    PyObject *inner = PyMethod_GET_FUNCTION(target);
+    Py_INCREF(inner);
+    Py_SETREF(target, inner);
+  }
+  if (PyFunction_Check(target)) {
+    int is_async = (((PyCodeObject*)PyFunction_GET_CODE(target))->co_flags & CO_COROUTINE) != 0;
+    Py_DECREF(target);
+    return is_async;
+  }
+
+  if (!iscoroutinefunction) {
+    PyObject *inspect = PyImport_ImportModule("inspect");
+    if (inspect) {
+      iscoroutinefunction = PyObject_GetAttrString(inspect, "iscoroutinefunction");
+      Py_DECREF(inspect);
+    }
+    if (!iscoroutinefunction) {
+      PyErr_Clear();
+      Py_DECREF(target);
+      return 0;
+    }
+  }
+
+  PyObject *answer = PyObject_CallFunctionObjArgs(iscoroutinefunction, target, NULL);
+  Py_DECREF(target);
+  int is_async = answer ? PyObject_IsTrue(answer) == 1 : 0;
+  Py_XDECREF(answer);
+  PyErr_Clear();
+  return is_async;
+}
+
+static void completion_command_added(const char *name);
+static int is_builtin_name(const char *name);
+static void completion_command_removed(const char *name);
+
+// Registers (or replaces) a command. Returns 0 on success, -1 if out of memory.
+int register_python_command(const char *name, PyObject *func) {
+  // Keep the load factor (including tombstones) under 3/4
+  if (registry_capacity == 0 || (registry_used + 1) * 4 > registry_capacity * 3) {
+    size_t new_capacity = REGISTRY_MIN_CAPACITY;
+    while (new_capacity < (registry_count + 1) * 2) new_capacity *= 2;
+    if (registry_resize(new_capacity) != 0) return -1;
+  }
+
+  uint32_t hash = hash_name(name);
+  size_t idx = registry_probe(name, hash);
+  PyCommand *existing = registry_slots[idx];
+
+  // Re-registering a name swaps the callback in place and drops the old reference
+  if (existing != NULL && existing != REGISTRY_TOMBSTONE) {
+    Py_INCREF(func);
+    Py_SETREF(existing->func, func);
+    existing->is_async = is_coroutine_function(func);
+    return 0;
+  }
+
   PyCommand *new_cmd = malloc(sizeof(PyCommand));
+  if (!new_cmd) return -1;
+  new_cmd->name_obj = PyUnicode_FromString(name);
+  if (!new_cmd->name_obj) {
+    free(new_cmd);
+    return -1;
+  }
   new_cmd->name = strdup(name);
   new_cmd->func = func;
+  new_cmd->hash = hash;
+  new_cmd->is_async = is_coroutine_function(func);
   Py_INCREF(func); // Keep function alive
-  new_cmd->next = py_cmd_head;
-  py_cmd_head = new_cmd;
+
+  if (existing == NULL) registry_used++; // Reusing a tombstone doesn't grow the chain
+  registry_slots[idx] = new_cmd;
+  registry_count++;
+  completion_command_added(name);
+  return 0;
+}
+
+// Removes a command. Returns 1 if it was registered, 0 otherwise.
+int unregister_python_command(const char *name) {
+  if (registry_count == 0) return 0;
+
+  size_t idx = registry_probe(name, hash_name(name));
+  PyCommand *cmd = registry_slots[idx];
+  if (cmd == NULL || cmd == REGISTRY_TOMBSTONE) return 0;
+
+  registry_slots[idx] = REGISTRY_TOMBSTONE;
+  registry_count--;
+  completion_command_removed(cmd->name);
+
+  free(cmd->name);
+  Py_DECREF(cmd->name_obj);
+  Py_DECREF(cmd->func);
+  free(cmd);
+  return 1;
 }
 
 PyCommand* find_python_command(const char *name) {
-  PyCommand *current = py_cmd_head;
-  while (current != NULL) {
-    if (strcmp(current->name, name) == 0) {
-      return current;
-    }
-    current = current->next;
-  }
-  return NULL;
+  if (registry_count == 0) return NULL;
+
+  PyCommand *cmd = registry_slots[registry_probe(name, hash_name(name))];
+  if (cmd == NULL || cmd == REGISTRY_TOMBSTONE) return NULL;
+  return cmd;
 }
 
 //  Return a list of all registered command names
 static PyObject* shell_get_registry(PyObject *self, PyObject *args) {
   PyObject *list = PyList_New(0);
-  PyCommand *curr = py_cmd_head;
-  while (curr) {
+  if (!list) return NULL;
+
+  for (size_t i = 0; i < registry_capacity; i++) {
+    PyCommand *curr = registry_slots[i];
+    if (curr == NULL || curr == REGISTRY_TOMBSTONE) continue;
+
     PyObject *str = PyUnicode_FromString(curr->name);
-    PyList_Append(list, str);
+    if (!str || PyList_Append(list, str) != 0) {
+      Py_XDECREF(str);
+      Py_DECREF(list);
+      return NULL;
+    }
     Py_DECREF(str);
-    curr = curr->next;
   }
   return list;
 }
@@ -176,957 +947,5954 @@ static PyObject* shell_register(PyObject *self, PyObject *args) {
     return NULL;
   }
 
-  register_python_command(name, func);
+  // Builtins are found first, so the command could never run
+  if (is_builtin_name(name)) {
+    PyErr_Format(PyExc_ValueError, "'%s' is a builtin and can't be replaced by a registered command", name);
+    return NULL;
+  }
+
+  if (register_python_command(name, func) != 0) {
+    return PyErr_NoMemory();
+  }
   Py_RETURN_NONE;
 }
 
-// --- C HELPER FUNCTIONS ---
-
+// Python calls this: shell_core.unregister("my_cmd") -> True if it was registered
+static PyObject* shell_unregister(PyObject *self, PyObject *args) {
+  const char *name;
 
-// WINDOWS IMPLEMENTATION FOR KEYBOARD INPUT
-#ifdef _WIN32
-  // Windows doesn't need "enableRawMode" the same way,
-  // but we might need to disable line buffering.
-  void enableRawMode() {
-    HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
-    DWORD mode;
-    GetConsoleMode(hStdin, &mode);
-    // Disable Line Input and Echo
-    SetConsoleMode(hStdin, mode & ~(ENABLE_LINE_INPUT | ENABLE_ECHO_INPUT));
+  if (!PyArg_ParseTuple(args, "s", &name)) {
+    return NULL;
   }
 
-  void disableRawMode() {
-    HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
-    DWORD mode;
-    GetConsoleMode(hStdin, &mode);
-    // Re-enable Line Input and Echo
-    SetConsoleMode(hStdin, mode | (ENABLE_LINE_INPUT | ENABLE_ECHO_INPUT));
-  }
+  return PyBool_FromLong(unregister_python_command(name));
+}
 
-  // Windows has _getch() which reads a char without echo (Raw by default)
-  int read_char() {
-    return _getch();
-  }
+// Python calls this: shell_core.get_path_cache() -> {"ls": "/usr/bin/ls", ...}
+static PyObject* shell_get_path_cache(PyObject *self, PyObject *args) {
+  PyObject *dict = PyDict_New();
+  if (!dict) return NULL;
 
-// LINUX / MACOS IMPLEMENTATION FOR KEYBOARD INPUT
-#else
-  struct termios orig_termios;
+  for (size_t i = 0; i < path_cache_capacity; i++) {
+    if (path_cache[i].name == NULL) continue;
 
-  void enableRawMode() {
-    tcgetattr(STDIN_FILENO, &orig_termios);
-    struct termios raw = orig_termios;
-    raw.c_lflag &= ~(ICANON | ECHO);
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+    PyObject *path = PyUnicode_DecodeFSDefault(path_cache[i].path);
+    if (!path || PyDict_SetItemString(dict, path_cache[i].name, path) != 0) {
+      Py_XDECREF(path);
+      Py_DECREF(dict);
+      return NULL;
+    }
+    Py_DECREF(path);
   }
+  return dict;
+}
 
-  void disableRawMode() {
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+// Python calls this: shell_core.clear_path_cache() (like bash's "hash -r")
+static PyObject* shell_clear_path_cache(PyObject *self, PyObject *args) {
+  clear_path_cache();
+  Py_RETURN_NONE;
+}
+
+// Variable names are what $NAME expansion can reach: letters, digits and '_'
+static int valid_var_name(const char *name) {
+  if (!*name || isdigit((unsigned char)*name)) return 0;
+  for (const char *p = name; *p; p++) {
+    if (!isalnum((unsigned char)*p) && *p != '_') return 0;
   }
+  return 1;
+}
+
+// Python calls this: shell_core.get_var("HOME") -> "/home/me" (None if unset)
+static PyObject* shell_get_var(PyObject *self, PyObject *args) {
+  const char *name;
 
-  int read_char() {
-    char c;
-    if (read(STDIN_FILENO, &c, 1) == 1) return c;
-    return -1; // Error
+  if (!PyArg_ParseTuple(args, "s", &name)) {
+    return NULL;
   }
-#endif
 
-// Helper to add an argument to the dynamic argv list
-void add_arg(char ***argv, int *argc, const char *buffer) {
-  *argv = realloc(*argv, sizeof(char*) * (*argc + 2)); // Resize array
-  (*argv)[*argc] = strdup(buffer); // Copy string
-  (*argc)++;
-  (*argv)[*argc] = NULL; // Null terminate list
+  const char *value = var_get(name);
+  if (!value) Py_RETURN_NONE;
+  return PyUnicode_DecodeFSDefault(value);
 }
 
-// Save a command line to the shell history buffer.
-void add_history(const char* cmd) {
-  if (strlen(cmd) == 0) return;
+// Python calls this: shell_core.set_var(name, value, export=None)
+// value None only changes the export flag; export None leaves it as it is.
+static PyObject* shell_set_var(PyObject *self, PyObject *args, PyObject *kwargs) {
+  static char *kwlist[] = {"name", "value", "export", NULL};
+  const char *name;
+  PyObject *value;
+  PyObject *export = Py_None;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sO|O", kwlist, &name, &value, &export)) {
+    return NULL;
+  }
+  if (!valid_var_name(name)) {
+    PyErr_Format(PyExc_ValueError, "'%s': not a valid variable name", name);
+    return NULL;
+  }
 
-  // Shift everything down if full (Simple implementation)
-  if (history_count == MAX_HISTORY) {
-    for (int i = 0; i < MAX_HISTORY - 1; i++) {
-      strcpy(history[i], history[i+1]);
+  const char *text = NULL;
+  PyObject *encoded = NULL;
+  if (value != Py_None) {
+    if (!PyUnicode_Check(value)) {
+      PyErr_SetString(PyExc_TypeError, "variable values must be str or None");
+      return NULL;
     }
-    history_count--;
+    encoded = PyUnicode_EncodeFSDefault(value);
+    if (!encoded) return NULL;
+    text = PyBytes_AS_STRING(encoded);
   }
 
-  // Add to end
-  strncpy(history[history_count], cmd, MAX_CMD_LEN - 1);
-  history[history_count][MAX_CMD_LEN - 1] = '\0';
-  history_count++;
+  int flag = -1;
+  if (export != Py_None) {
+    flag = PyObject_IsTrue(export);
+    if (flag < 0) {
+      Py_XDECREF(encoded);
+      return NULL;
+    }
+  }
 
-  // Reset view index to the NEW end (so pressing UP goes to the latest)
-  history_view_idx = history_count;
+  int rc = var_set(name, text, flag);
+  Py_XDECREF(encoded);
+  if (rc != 0) return PyErr_NoMemory();
+  Py_RETURN_NONE;
 }
 
+// Python calls this: shell_core.unset_var("NAME") -> True if it was set
+static PyObject* shell_unset_var(PyObject *self, PyObject *args) {
+  const char *name;
 
-void replace_line(char* buffer, size_t* length, size_t* cursor_idx, const char* new_text, const char* term_prompt) {
-  // Fix visuals
-  printf("\r");               // Move to line start
-  printf("\x1b[K");           // Print ANSI code to clear the line
-  printf("%s", term_prompt);  // Print prompt
-  printf("%s", new_text);     // Print buffer content
-
-  // Update Buffer Memory
-  strcpy(buffer, new_text);
-  *length = strlen(buffer);
-  *cursor_idx = *length; // Set cursor to end of line
-
-  fflush(stdout);
+  if (!PyArg_ParseTuple(args, "s", &name)) {
+    return NULL;
+  }
+  return PyBool_FromLong(var_unset(name));
 }
 
-// --- EXECUTION ENGINE ---
+// Python calls this: shell_core.variables(exported=False) -> {name: value}
+static PyObject* shell_variables(PyObject *self, PyObject *args, PyObject *kwargs) {
+  static char *kwlist[] = {"exported", NULL};
+  int exported_only = 0;
 
-int execute_python_command(const char *name, char **args, int input_fd, int output_fd) {
-  PyCommand *cmd = find_python_command(name);
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|p", kwlist, &exported_only)) {
+    return NULL;
+  }
+
+  vars_load();
+  PyObject *dict = PyDict_New();
+  if (!dict) return NULL;
+
+  for (size_t i = 0; i < var_capacity; i++) {
+    if (var_table[i].name == NULL) continue;
+    if (exported_only && !var_table[i].exported) continue;
+
+    PyObject *value = PyUnicode_DecodeFSDefault(var_table[i].value);
+    if (!value || PyDict_SetItemString(dict, var_table[i].name, value) != 0) {
+      Py_XDECREF(value);
+      Py_DECREF(dict);
+      return NULL;
+    }
+    Py_DECREF(value);
+  }
+  return dict;
+}
+
+typedef enum { OPTION_BOOL, OPTION_INT, OPTION_STRING } OptionType;
+
+typedef struct ShellOption {
+  const char *name;
+  OptionType type;
+  int *value;              // OPTION_BOOL / OPTION_INT
+  char **text;             // OPTION_STRING (NULL = unset)
+  void (*changed)(void);   // Called after a successful set, may be NULL
+} ShellOption;
+
+static void history_size_changed(void);
+static void history_file_changed(void);
+
+static ShellOption shell_options[] = {
+  {"parallel_subshells", OPTION_BOOL,   &opt_parallel_subshells, NULL, NULL},
+  {"history_size",       OPTION_INT,    &opt_history_size,       NULL, history_size_changed},
+  {"history_file",       OPTION_STRING, NULL,                    &opt_history_file, history_file_changed},
+  {"stream_batch",       OPTION_INT,    &opt_stream_batch,       NULL, NULL},
+  {"object_pipes",       OPTION_BOOL,   &opt_object_pipes,       NULL, NULL},
+  {NULL, 0, NULL, NULL, NULL}
+};
+
+static ShellOption* find_option(const char *name) {
+  for (ShellOption *opt = shell_options; opt->name; opt++) {
+    if (strcmp(opt->name, name) == 0) return opt;
+  }
+  PyErr_Format(PyExc_KeyError, "unknown shell option '%s'", name);
+  return NULL;
+}
+
+// Python calls this: shell_core.set_option("parallel_subshells", True)
+static PyObject* shell_set_option(PyObject *self, PyObject *args) {
+  const char *name;
+  PyObject *value;
+
+  if (!PyArg_ParseTuple(args, "sO", &name, &value)) {
+    return NULL;
+  }
+
+  ShellOption *opt = find_option(name);
+  if (!opt) return NULL;
+
+  if (opt->type == OPTION_BOOL) {
+    int truth = PyObject_IsTrue(value);
+    if (truth < 0) return NULL;
+    *opt->value = truth;
+  } else if (opt->type == OPTION_INT) {
+    long number = PyLong_AsLong(value);
+    if (number == -1 && PyErr_Occurred()) return NULL;
+    if (number < 0 || number > INT_MAX) {
+      PyErr_Format(PyExc_ValueError, "shell option '%s' must be between 0 and %d", name, INT_MAX);
+      return NULL;
+    }
+    *opt->value = (int)number;
+  } else {
+    char *copy = NULL;
+    if (value != Py_None) {
+      const char *text = PyUnicode_AsUTF8(value);
+      if (!text) return NULL;
+      copy = strdup(text);
+      if (!copy) return PyErr_NoMemory();
+    }
+    free(*opt->text);
+    *opt->text = copy;
+  }
+
+  if (opt->changed) opt->changed();
+  Py_RETURN_NONE;
+}
+
+// Python calls this: shell_core.get_option("parallel_subshells") -> False
+static PyObject* shell_get_option(PyObject *self, PyObject *args) {
+  const char *name;
+
+  if (!PyArg_ParseTuple(args, "s", &name)) {
+    return NULL;
+  }
+
+  ShellOption *opt = find_option(name);
+  if (!opt) return NULL;
+
+  if (opt->type == OPTION_BOOL) return PyBool_FromLong(*opt->value);
+  if (opt->type == OPTION_INT) return PyLong_FromLong(*opt->value);
+  if (*opt->text) return PyUnicode_FromString(*opt->text);
+  Py_RETURN_NONE;
+}
+
+// Python calls this: shell_core.parse_args(plan, cli_args) -> (positional, optional)
+// `plan` is what Command._compile_plan() builds from a command's arguments:
+//   (converters, has_star, options) where
+//   converters: one dtype (or None) per fixed positional argument, in order
+//   has_star:   True if a *args parameter takes everything after them
+//   options:    {flag: (name, nargs)}, nargs 0 = boolean, -1 = the rest of the line
+// The plan is only read, so every call parses the same way.
+static PyObject* shell_parse_args(PyObject *self, PyObject *args) {
+  PyObject *converters, *options;
+  int has_star;
+  PyObject *cli_args;
+
+  if (!PyArg_ParseTuple(args, "(O!pO!)O!", &PyTuple_Type, &converters, &has_star,
+                        &PyDict_Type, &options, &PyList_Type, &cli_args)) {
+    return NULL;
+  }
+
+  Py_ssize_t n = PyList_GET_SIZE(cli_args);
+  Py_ssize_t expected = PyTuple_GET_SIZE(converters);
+  if (n < expected) {
+    PyErr_Format(PyExc_ValueError, "Expected %zd positional arguments, got %zd.", expected, n);
+    return NULL;
+  }
+
+  PyObject *positional = PyList_New(0);
+  if (!positional) return NULL;
+  PyObject *optional = NULL;
+  Py_ssize_t pos = 0;
+
+  // Fixed slots first
+  for (; pos < expected; pos++) {
+    PyObject *convert = PyTuple_GET_ITEM(converters, pos);
+    PyObject *value = PyList_GET_ITEM(cli_args, pos);
+    if (convert == Py_None) Py_INCREF(value);
+    else value = PyObject_CallFunctionObjArgs(convert, value, NULL);
+    if (!value || PyList_Append(positional, value) < 0) {
+      Py_XDECREF(value);
+      goto error;
+    }
+    Py_DECREF(value);
+  }
+
+  if (has_star) {
+    PyObject *rest = PyList_GetSlice(cli_args, pos, n);
+    if (!rest) goto error;
+    int rc = PyList_SetSlice(positional, expected, expected, rest);
+    Py_DECREF(rest);
+    if (rc < 0) goto error;
+    pos = n;
+  }
+
+  if (pos == n) return Py_BuildValue("(NO)", positional, Py_None);
+
+  // Everything left is options
+  optional = PyDict_New();
+  if (!optional) goto error;
+  while (pos < n) {
+    PyObject *flag = PyList_GET_ITEM(cli_args, pos);
+    PyObject *spec = PyDict_GetItemWithError(options, flag); // Borrowed
+    if (!spec) {
+      if (!PyErr_Occurred()) PyErr_Format(PyExc_ValueError, "Got unexpected optional argument: %S", flag);
+      goto error;
+    }
+
+    PyObject *name;
+    Py_ssize_t nargs;
+    if (!PyArg_ParseTuple(spec, "Un", &name, &nargs)) goto error;
+
+    PyObject *value;
+    if (nargs == 0) {
+      value = Py_True;
+      Py_INCREF(value);
+      pos += 1;
+    } else if (nargs == 1) {
+      if (pos + 1 >= n) {
+        PyErr_Format(PyExc_ValueError, "Option %S expects a value.", flag);
+        goto error;
+      }
+      value = PyList_GET_ITEM(cli_args, pos + 1);
+      Py_INCREF(value);
+      pos += 2;
+    } else {
+      Py_ssize_t end = nargs < 0 ? n : pos + 1 + nargs;
+      value = PyList_GetSlice(cli_args, pos + 1, end);
+      pos = end;
+    }
+
+    if (!value || PyDict_SetItem(optional, name, value) < 0) {
+      Py_XDECREF(value);
+      goto error;
+    }
+    Py_DECREF(value);
+  }
+
+  return Py_BuildValue("(NN)", positional, optional);
+
+error:
+  Py_DECREF(positional);
+  Py_XDECREF(optional);
+  return NULL;
+}
+
+// --- C HELPER FUNCTIONS ---
+
+// --- PER-LINE ARENA ---
+// Everything one command line needs (tokens, argv arrays, expansion buffers)
+// is bump-allocated from an arena and released in one step when the line is
+// done. Arenas are pooled, and after a reset an arena keeps a single block big
+// enough for what the last line used, so steady-state lines don't malloc at all.
+
+#define ARENA_MIN_BLOCK 8192
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + (ARENA_ALIGN - 1)) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t size;  // Usable bytes after the (rounded) header
+  size_t used;
+} ArenaBlock;
+
+#define ARENA_BLOCK_DATA(block) ((char*)(block) + ARENA_ROUND(sizeof(ArenaBlock)))
+
+typedef struct Arena {
+  ArenaBlock *head;        // Block currently being filled; older blocks follow
+  size_t total;            // Sum of all block sizes
+  char *last;              // Most recent allocation, which can still grow in place
+  struct Arena *next_free; // Pool link
+} Arena;
+
+static Arena *arena_pool = NULL; // Protected by the GIL
+
+static ArenaBlock* arena_new_block(Arena *arena, size_t min_size) {
+  size_t size = ARENA_MIN_BLOCK;
+  while (size < min_size) size *= 2;
+
+  ArenaBlock *block = malloc(ARENA_ROUND(sizeof(ArenaBlock)) + size);
+  if (!block) return NULL;
+  block->size = size;
+  block->used = 0;
+  block->next = arena->head;
+  arena->head = block;
+  arena->total += size;
+  return block;
+}
+
+void* arena_alloc(Arena *arena, size_t n) {
+  n = ARENA_ROUND(n ? n : 1);
+
+  ArenaBlock *block = arena->head;
+  if (!block || block->size - block->used < n) {
+    block = arena_new_block(arena, n);
+    if (!block) return NULL;
+  }
+
+  char *ptr = ARENA_BLOCK_DATA(block) + block->used;
+  block->used += n;
+  arena->last = ptr;
+  return ptr;
+}
+
+// Grows `ptr` (of `old_n` bytes) to `new_n`. The latest allocation grows in
+// place when its block has room; anything else is copied to a fresh slot.
+void* arena_realloc(Arena *arena, void *ptr, size_t old_n, size_t new_n) {
+  if (ptr == NULL) return arena_alloc(arena, new_n);
+
+  ArenaBlock *block = arena->head;
+  if (ptr == arena->last && block) {
+    size_t offset = (size_t)((char*)ptr - ARENA_BLOCK_DATA(block));
+    if (offset + ARENA_ROUND(new_n) <= block->size) {
+      block->used = offset + ARENA_ROUND(new_n);
+      return ptr;
+    }
+  }
+
+  void *grown = arena_alloc(arena, new_n);
+  if (grown) memcpy(grown, ptr, old_n < new_n ? old_n : new_n);
+  return grown;
+}
+
+char* arena_strndup(Arena *arena, const char *text, size_t n) {
+  char *copy = arena_alloc(arena, n + 1);
+  if (!copy) return NULL;
+  memcpy(copy, text, n);
+  copy[n] = '\0';
+  return copy;
+}
+
+// Releases everything allocated from the arena in one step.
+void arena_reset(Arena *arena) {
+  ArenaBlock *block = arena->head;
+  if (block && block->next) {
+    // The last line needed several blocks: replace them with one that fits it all
+    size_t total = arena->total;
+    while (block) {
+      ArenaBlock *next = block->next;
+      free(block);
+      block = next;
+    }
+    arena->head = NULL;
+    arena->total = 0;
+    arena_new_block(arena, total);
+  } else if (block) {
+    block->used = 0;
+  }
+  arena->last = NULL;
+}
+
+Arena* acquire_arena(void) {
+  Arena *arena = arena_pool;
+  if (arena) {
+    arena_pool = arena->next_free;
+  } else {
+    arena = calloc(1, sizeof(Arena));
+  }
+  return arena;
+}
+
+void release_arena(Arena *arena) {
+  arena_reset(arena);
+  arena->next_free = arena_pool;
+  arena_pool = arena;
+}
+
+// Growable, always NUL-terminated string buffer.
+// With an arena, the memory comes from (and stays owned by) that arena.
+typedef struct StrBuf {
+  char *data;
+  size_t len;
+  size_t cap;
+  Arena *arena;
+} StrBuf;
+
+void sb_init(StrBuf *sb) {
+  sb->data = NULL;
+  sb->len = 0;
+  sb->cap = 0;
+  sb->arena = NULL;
+}
+
+void sb_init_arena(StrBuf *sb, Arena *arena) {
+  sb_init(sb);
+  sb->arena = arena;
+}
+
+// Makes room for `extra` more bytes plus the terminator. Returns 0 on success.
+int sb_reserve(StrBuf *sb, size_t extra) {
+  size_t needed = sb->len + extra + 1;
+  if (needed <= sb->cap) return 0;
+
+  size_t new_cap = sb->cap ? sb->cap : 256;
+  while (new_cap < needed) new_cap *= 2; // Geometric growth keeps appends amortized O(1)
+
+  char *grown = sb->arena ? arena_realloc(sb->arena, sb->data, sb->cap, new_cap)
+                          : realloc(sb->data, new_cap);
+  if (!grown) return -1;
+  sb->data = grown;
+  sb->cap = new_cap;
+  return 0;
+}
+
+void sb_append(StrBuf *sb, const char *text, size_t n) {
+  if (sb_reserve(sb, n) != 0) return;
+  memcpy(sb->data + sb->len, text, n);
+  sb->len += n;
+  sb->data[sb->len] = '\0';
+}
+
+// Hands the (NUL-terminated) contents to the caller. Without an arena the
+// caller must free() them; with one they live until the arena is reset.
+char* sb_detach(StrBuf *sb) {
+  Arena *arena = sb->arena;
+  if (sb_reserve(sb, 0) != 0) {
+    if (!arena) free(sb->data);
+    sb_init_arena(sb, arena);
+    return arena ? arena_strndup(arena, "", 0) : strdup("");
+  }
+  sb->data[sb->len] = '\0';
+  char *data = sb->data;
+  sb_init_arena(sb, arena);
+  return data;
+}
+
+// The line editor only gives up the GIL while it is blocked waiting for a key
+// (see read_input). Everything else in get_input, including the history and
+// terminal bookkeeping below, runs with the GIL held, so background Python
+// threads can keep running at the prompt without racing the editor's state.
+static int raw_mode_active = 0;
+static int raw_mode_atexit_registered = 0;
+
+// WINDOWS IMPLEMENTATION FOR KEYBOARD INPUT
+#ifdef _WIN32
+  static DWORD orig_console_mode;
+
+  // Windows doesn't need "enableRawMode" the same way,
+  // but we might need to disable line buffering.
+  void enableRawMode() {
+    if (raw_mode_active) return; // Don't save our own raw mode as the original
+    HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
+    GetConsoleMode(hStdin, &orig_console_mode);
+    // Disable Line Input and Echo
+    SetConsoleMode(hStdin, orig_console_mode & ~(ENABLE_LINE_INPUT | ENABLE_ECHO_INPUT));
+    raw_mode_active = 1;
+  }
+
+  void disableRawMode() {
+    if (!raw_mode_active) return;
+    HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
+    // Re-enable Line Input and Echo
+    SetConsoleMode(hStdin, orig_console_mode | (ENABLE_LINE_INPUT | ENABLE_ECHO_INPUT));
+    raw_mode_active = 0;
+  }
+
+  // Windows has _getch() which reads a char without echo (Raw by default).
+  // Blocks for the first key, then takes whatever else is already waiting.
+  int read_input(int fd, unsigned char *buf, size_t n) {
+    size_t got = 0;
+    (void)fd; // The console, always
+    Py_BEGIN_ALLOW_THREADS
+    buf[got++] = (unsigned char)_getch();
+    while (got < n && _kbhit()) buf[got++] = (unsigned char)_getch();
+    Py_END_ALLOW_THREADS
+    return (int)got;
+  }
+
+// LINUX / MACOS IMPLEMENTATION FOR KEYBOARD INPUT
+#else
+  struct termios orig_termios;
+
+  void enableRawMode() {
+    if (raw_mode_active) return; // Don't save our own raw mode as the original
+    if (tcgetattr(STDIN_FILENO, &orig_termios) == -1) return; // Not a TTY
+    struct termios raw = orig_termios;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+    raw_mode_active = 1;
+  }
+
+  void disableRawMode() {
+    if (!raw_mode_active) return;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+    raw_mode_active = 0;
+  }
+
+  // Blocks until input is available, then takes all of it (up to n bytes).
+  // Returns 0 at EOF and -1 on error (including EINTR).
+  int read_input(int fd, unsigned char *buf, size_t n) {
+    ssize_t got;
+    Py_BEGIN_ALLOW_THREADS
+    got = read(fd, buf, n);
+    Py_END_ALLOW_THREADS
+    return (int)got;
+  }
+#endif
+
+// If a background thread ends the process while we sit at the prompt,
+// don't leave the user's terminal in raw mode.
+void enable_raw_mode_guarded() {
+  if (!raw_mode_atexit_registered) {
+    atexit(disableRawMode);
+    raw_mode_atexit_registered = 1;
+  }
+  enableRawMode();
+}
+
+// --- HISTORY ---
+
+static const char* history_entry(size_t i) {
+  return history.entries[(history.start + i) % history.capacity];
+}
+
+static void search_index_add(size_t seq, const char *line);
+static void search_index_clear(void);
+
+// Appends to the ring, taking ownership of `line` (and freeing it if the
+// history is disabled).
+static void history_push(char *line) {
+  if (history.capacity == 0) {
+    free(line);
+    return;
+  }
+
+  if (history.count == history.capacity) {
+    // Full: the newest line takes the oldest line's slot
+    free(history.entries[history.start]);
+    history.entries[history.start] = line;
+    history.start = (history.start + 1) % history.capacity;
+    history.base++;
+  } else {
+    history.entries[(history.start + history.count) % history.capacity] = line;
+    history.count++;
+  }
+
+  search_index_add(history.base + history.count - 1, line);
+}
+
+// Rebuilds the ring with a new capacity, keeping the newest entries.
+static void history_resize(size_t capacity) {
+  char **entries = capacity ? calloc(capacity, sizeof(char*)) : NULL;
+  if (capacity && !entries) return;
+
+  size_t keep = history.count < capacity ? history.count : capacity;
+  size_t drop = history.count - keep;
+  for (size_t i = 0; i < history.count; i++) {
+    if (i < drop) free(history.entries[(history.start + i) % history.capacity]);
+    else entries[i - drop] = history.entries[(history.start + i) % history.capacity];
+  }
+
+  free(history.entries);
+  history.entries = entries;
+  history.capacity = capacity;
+  history.start = 0;
+  history.count = keep;
+  history.base += drop;
+  history_view_idx = keep;
+}
+
+// Pushes the last `history.capacity` lines of a history file image. Only the
+// tail is scanned, so startup cost depends on history_size, not the file size.
+static void history_load_buffer(const char *data, size_t size) {
+  size_t start = size;
+  size_t lines = 0;
+  if (start > 0 && data[start - 1] == '\n') start--; // Final terminator
+  while (start > 0) {
+    if (data[start - 1] == '\n' && ++lines == history.capacity) break;
+    start--;
+  }
+
+  const char *p = data + start;
+  const char *end = data + size;
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    size_t len = (nl ? nl : end) - p;
+    if (len > 0 && p[len - 1] == '\r') len--;
+    if (len > 0) {
+      char *line = malloc(len + 1);
+      if (!line) break;
+      memcpy(line, p, len);
+      line[len] = '\0';
+      history_push(line);
+    }
+    if (!nl) break;
+    p = nl + 1;
+  }
+}
+
+// Pushes the lines another shell appended to the file read in last, past the
+// `read_size` bytes already in the ring. Returns 0 if that file can't be
+// read this way (it's a different file now, or it shrank).
+static int history_load_tail(void) {
+  if (!history.read_file || strcmp(history.read_file, opt_history_file) != 0) return 0;
+
+  int fd = open(opt_history_file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 1; // Gone; nothing new to read
+  struct stat st;
+  int ok = fstat(fd, &st) == 0 && (size_t)st.st_size >= history.read_size;
+  if (ok && (size_t)st.st_size > history.read_size) {
+    size_t size = (size_t)st.st_size;
+    size_t skip = history.read_size;
+#ifdef _WIN32
+    char *data = malloc(size - skip);
+    if (data && _lseeki64(fd, (__int64)skip, SEEK_SET) == (__int64)skip) {
+      size_t got = 0;
+      int n;
+      while (got < size - skip && (n = read(fd, data + got, (unsigned)(size - skip - got))) > 0) got += n;
+      history_load_buffer(data, got);
+      history.read_size = skip + got;
+    }
+    free(data);
+#else
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      history_load_buffer(data + skip, size - skip);
+      history.read_size = size;
+      munmap(data, size);
+    }
+#endif
+    history_view_idx = history.count;
+  }
+  close(fd);
+  return ok;
+}
+
+// Reads history_file the first time history is needed. Lines added before
+// that (or before the option was set) stay newest. Pointing history_file at
+// the file already read again only picks up what was appended since.
+static void history_load(void) {
+  if (history.loaded) return;
+  history.loaded = 1;
+
+  if (history.entries == NULL && opt_history_size > 0) history_resize((size_t)opt_history_size);
+  if (!opt_history_file || history.capacity == 0 || history.in_memory) return;
+  if (history_load_tail()) return;
+
+  free(history.read_file);
+  history.read_file = strdup(opt_history_file);
+  history.read_size = 0;
+
+  // Take the current session's lines out of the ring
+  size_t session_count = history.count;
+  char **session = malloc(sizeof(char*) * (session_count ? session_count : 1));
+  if (!session) return;
+  for (size_t i = 0; i < session_count; i++) {
+    session[i] = history.entries[(history.start + i) % history.capacity];
+  }
+  history.start = 0;
+  history.count = 0;
+  search_index_clear(); // Every line is about to get a new sequence number
+
+  int fd = open(opt_history_file, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      size_t size = (size_t)st.st_size;
+#ifdef _WIN32
+      char *data = malloc(size);
+      if (data) {
+        size_t got = 0;
+        int n;
+        while (got < size && (n = read(fd, data + got, (unsigned)(size - got))) > 0) got += n;
+        history_load_buffer(data, got);
+        history.read_size = got;
+        free(data);
+      }
+#else
+      void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        history_load_buffer(data, size);
+        history.read_size = size;
+        munmap(data, size);
+      }
+#endif
+    }
+    close(fd);
+  }
+
+  for (size_t i = 0; i < session_count; i++) history_push(session[i]);
+  free(session);
+  history_view_idx = history.count;
+}
+
+// Appends one line to history_file, opening it on first use.
+static void history_append_file(const char *cmd, size_t len) {
+  if (!opt_history_file || history.in_memory) return;
+
+  if (history.append_fd < 0) {
+    history.append_fd = open(opt_history_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, FILE_MODE);
+    if (history.append_fd < 0) return;
+  }
+
+  // One write per line, so concurrent shells appending to the same file don't interleave
+  char *record = malloc(len + 1);
+  if (!record) return;
+  memcpy(record, cmd, len);
+  record[len] = '\n';
+  if (write(history.append_fd, record, (unsigned)(len + 1)) < 0) {
+    // History is best effort; don't disturb the prompt
+  } else if (history.read_file && strcmp(history.read_file, opt_history_file) == 0) {
+    // The line is in the ring already; if nobody else wrote in between,
+    // don't read it back in as new
+    struct stat st;
+    if (fstat(history.append_fd, &st) == 0 && (size_t)st.st_size == history.read_size + len + 1) {
+      history.read_size = (size_t)st.st_size;
+    }
+  }
+  free(record);
+}
+
+static void history_size_changed(void) {
+  history_resize((size_t)opt_history_size);
+}
+
+static void history_file_changed(void) {
+  if (history.append_fd >= 0) {
+    close(history.append_fd);
+    history.append_fd = -1;
+  }
+  history.loaded = 0; // Read the new file (or what was added to it) before the next prompt
+}
+
+// Save a command line to the shell history buffer.
+void add_history(const char* cmd) {
+  size_t len = strlen(cmd);
+  if (len == 0) return;
+
+  history_load();
+  history_append_file(cmd, len);
+  history_push(strdup(cmd));
+
+  // Reset view index to the NEW end (so pressing UP goes to the latest)
+  history_view_idx = history.count;
+}
+
+
+// --- HISTORY SEARCH INDEX ---
+// Ctrl-R needs to find the newest entry containing a pattern without running
+// strstr over every line. Each trigram maps to the ascending list of sequence
+// numbers of the entries containing it; a search walks the list of the
+// pattern's rarest trigram from the newest end and verifies candidates with
+// strstr. The index is built on the first search and then kept current by
+// history_push. Entries that fell out of the ring are dropped lazily.
+
+typedef struct TrigramPostings {
+  uint32_t key;     // The three bytes; 0 = empty slot (trigrams never contain NUL)
+  size_t count;
+  size_t capacity;
+  size_t *seqs;     // Ascending sequence numbers
+} TrigramPostings;
+
+static TrigramPostings *search_index = NULL;
+static size_t search_index_capacity = 0; // Always a power of two
+static size_t search_index_used = 0;
+static int search_index_built = 0;
+
+static uint32_t trigram_key(const char *p) {
+  return ((uint32_t)(unsigned char)p[0] << 16) | ((uint32_t)(unsigned char)p[1] << 8) | (unsigned char)p[2];
+}
+
+static TrigramPostings* search_index_slot(uint32_t key) {
+  size_t mask = search_index_capacity - 1;
+  size_t i = (key * 2654435761u) & mask;
+  while (search_index[i].key != 0 && search_index[i].key != key) i = (i + 1) & mask;
+  return &search_index[i];
+}
+
+static int search_index_grow(void) {
+  size_t new_capacity = search_index_capacity ? search_index_capacity * 2 : 4096;
+  TrigramPostings *old = search_index;
+  size_t old_capacity = search_index_capacity;
+
+  search_index = calloc(new_capacity, sizeof(TrigramPostings));
+  if (!search_index) {
+    search_index = old;
+    return -1;
+  }
+  search_index_capacity = new_capacity;
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].key) *search_index_slot(old[i].key) = old[i];
+  }
+  free(old);
+  return 0;
+}
+
+static void search_index_clear(void) {
+  for (size_t i = 0; i < search_index_capacity; i++) free(search_index[i].seqs);
+  free(search_index);
+  search_index = NULL;
+  search_index_capacity = 0;
+  search_index_used = 0;
+  search_index_built = 0;
+}
+
+static void search_index_add(size_t seq, const char *line) {
+  if (!search_index_built) return;
+
+  size_t len = strlen(line);
+  for (size_t i = 0; i + 3 <= len; i++) {
+    if (search_index_used * 2 >= search_index_capacity && search_index_grow() < 0) return;
+
+    uint32_t key = trigram_key(line + i);
+    TrigramPostings *post = search_index_slot(key);
+    if (post->key == 0) {
+      post->key = key;
+      search_index_used++;
+    }
+    if (post->count > 0 && post->seqs[post->count - 1] == seq) continue; // Repeated in this line
+
+    if (post->count == post->capacity) {
+      // Make room by dropping evicted entries before growing
+      size_t stale = 0;
+      while (stale < post->count && post->seqs[stale] < history.base) stale++;
+      if (stale > post->count / 2) {
+        memmove(post->seqs, post->seqs + stale, sizeof(size_t) * (post->count - stale));
+        post->count -= stale;
+      } else {
+        size_t new_capacity = post->capacity ? post->capacity * 2 : 4;
+        size_t *seqs = realloc(post->seqs, sizeof(size_t) * new_capacity);
+        if (!seqs) return;
+        post->seqs = seqs;
+        post->capacity = new_capacity;
+      }
+    }
+    post->seqs[post->count++] = seq;
+  }
+}
+
+static void search_index_build(void) {
+  if (search_index_built) return;
+  search_index_built = 1;
+  for (size_t i = 0; i < history.count; i++) {
+    search_index_add(history.base + i, history_entry(i));
+  }
+}
+
+// Finds the newest entry strictly older than `before` (a ring index) that
+// contains `pattern`. Returns its ring index, or -1.
+static long history_search(const char *pattern, size_t before) {
+  size_t pattern_len = strlen(pattern);
+  if (before > history.count) before = history.count;
+
+  if (pattern_len < 3) {
+    // Too short to index, but short patterns also match almost anything
+    for (size_t i = before; i-- > 0;) {
+      if (strstr(history_entry(i), pattern)) return (long)i;
+    }
+    return -1;
+  }
+
+  search_index_build();
+  if (!search_index) return -1;
+
+  // The rarest trigram gives the fewest candidates
+  TrigramPostings *best = NULL;
+  for (size_t i = 0; i + 3 <= pattern_len; i++) {
+    TrigramPostings *post = search_index_slot(trigram_key(pattern + i));
+    if (post->key == 0) return -1; // Some trigram appears nowhere
+    if (!best || post->count < best->count) best = post;
+  }
+
+  size_t limit = history.base + before;
+  for (size_t k = best->count; k-- > 0;) {
+    size_t seq = best->seqs[k];
+    if (seq >= limit) continue;
+    if (seq < history.base) break; // Everything older has been evicted
+    if (strstr(history_entry(seq - history.base), pattern)) return (long)(seq - history.base);
+  }
+  return -1;
+}
+
+// --- STREAM ROUTING ---
+// Python stages of one pipeline can run at the same time on different threads,
+// but sys.stdin / sys.stdout are process-wide. While any such pipeline is
+// running, both are replaced by a StreamRouter that forwards every attribute
+// lookup to the stream bound in the calling context (a ContextVar), falling
+// back to whatever stream was installed before the router.
+
+typedef struct {
+  PyObject_HEAD
+  PyObject *route;     // ContextVar holding the stream bound for the current context
+  PyObject *fallback;  // Stream to use when nothing is bound (the original sys.<name>)
+  const char *name;    // "stdin" or "stdout"
+} StreamRouter;
+
+static StreamRouter *stdin_router = NULL;
+static StreamRouter *stdout_router = NULL;
+static int stream_router_depth = 0; // Number of pipelines currently relying on the routers
+
+// Returns a new reference to the stream this context should use.
+static PyObject* router_target(StreamRouter *router) {
+  PyObject *target = NULL;
+  if (PyContextVar_Get(router->route, NULL, &target) < 0) return NULL;
+  if (target == NULL) {
+    target = router->fallback;
+    if (target == NULL) {
+      PyErr_Format(PyExc_RuntimeError, "sys.%s is not available", router->name);
+      return NULL;
+    }
+    Py_INCREF(target);
+  }
+  return target;
+}
+
+static PyObject* router_getattro(PyObject *self, PyObject *attr) {
+  PyObject *target = router_target((StreamRouter*)self);
+  if (!target) return NULL;
+  PyObject *value = PyObject_GetAttr(target, attr);
+  Py_DECREF(target);
+  return value;
+}
+
+static int router_setattro(PyObject *self, PyObject *attr, PyObject *value) {
+  PyObject *target = router_target((StreamRouter*)self);
+  if (!target) return -1;
+  int rc = PyObject_SetAttr(target, attr, value);
+  Py_DECREF(target);
+  return rc;
+}
+
+// Lets "for line in sys.stdin" iterate the routed stream
+static PyObject* router_iter(PyObject *self) {
+  PyObject *target = router_target((StreamRouter*)self);
+  if (!target) return NULL;
+  PyObject *iter = PyObject_GetIter(target);
+  Py_DECREF(target);
+  return iter;
+}
+
+static void router_dealloc(PyObject *self) {
+  StreamRouter *router = (StreamRouter*)self;
+  Py_XDECREF(router->route);
+  Py_XDECREF(router->fallback);
+  Py_TYPE(self)->tp_free(self);
+}
+
+static PyTypeObject StreamRouterType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "shell_core.StreamRouter",
+  .tp_basicsize = sizeof(StreamRouter),
+  .tp_dealloc = router_dealloc,
+  .tp_getattro = router_getattro,
+  .tp_setattro = router_setattro,
+  .tp_iter = router_iter,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "Forwards sys.stdin/sys.stdout to the stream bound for the current pipeline stage.",
+};
+
+static StreamRouter* new_stream_router(const char *name, const char *var_name) {
+  StreamRouter *router = PyObject_New(StreamRouter, &StreamRouterType);
+  if (!router) return NULL;
+  router->name = name;
+  router->fallback = NULL;
+  router->route = PyContextVar_New(var_name, NULL);
+  if (!router->route) {
+    Py_DECREF(router);
+    return NULL;
+  }
+  return router;
+}
+
+// Swaps the routers into sys. Nested pipelines just bump the depth counter.
+void install_stream_routers(void) {
+  if (stream_router_depth++ > 0) return;
+
+  StreamRouter *routers[2] = {stdin_router, stdout_router};
+  for (int i = 0; i < 2; i++) {
+    PyObject *current = PySys_GetObject(routers[i]->name); // Borrowed
+    Py_XINCREF(current);
+    Py_XSETREF(routers[i]->fallback, current);
+    PySys_SetObject(routers[i]->name, (PyObject*)routers[i]);
+  }
+}
+
+void uninstall_stream_routers(void) {
+  if (--stream_router_depth > 0) return;
+
+  StreamRouter *routers[2] = {stdin_router, stdout_router};
+  for (int i = 0; i < 2; i++) {
+    // Only put the old stream back if nobody replaced the router in the meantime
+    if (PySys_GetObject(routers[i]->name) == (PyObject*)routers[i]) {
+      PySys_SetObject(routers[i]->name, routers[i]->fallback);
+    }
+    Py_CLEAR(routers[i]->fallback);
+  }
+}
+
+// Binding of one sys stream for the duration of a Python command
+typedef struct {
+  StreamRouter *router;
+  PyObject *token;     // ContextVar token when routed
+  PyObject *previous;  // What sys.<name> was when it was set directly (may be NULL)
+  int active;
+} StreamBinding;
+
+// Points sys.<name> at `stream` for the current context only (when routed) or globally.
+void bind_stream(StreamBinding *binding, StreamRouter *router, PyObject *stream) {
+  binding->router = router;
+  binding->token = NULL;
+  binding->previous = NULL;
+  binding->active = 1;
+
+  if (stream_router_depth > 0) {
+    binding->token = PyContextVar_Set(router->route, stream);
+  } else {
+    binding->previous = PySys_GetObject(router->name); // Borrowed
+    Py_XINCREF(binding->previous);
+    PySys_SetObject(router->name, stream);
+  }
+}
+
+void unbind_stream(StreamBinding *binding) {
+  if (!binding->active) return;
+  binding->active = 0;
+
+  if (binding->token) {
+    PyContextVar_Reset(binding->router->route, binding->token);
+    Py_CLEAR(binding->token);
+  } else {
+    // Put back whatever the enclosing command (if any) had bound, or the
+    // standard stream, so we don't keep pointing at our pipe
+    PyObject *restore = binding->previous;
+    if (restore == NULL) {
+      char dunder[16];
+      snprintf(dunder, sizeof(dunder), "__%s__", binding->router->name);
+      restore = PySys_GetObject(dunder);
+    }
+    PySys_SetObject(binding->router->name, restore);
+    Py_CLEAR(binding->previous);
+  }
+}
+
+// --- ASYNC COMMANDS ---
+// A command defined with "async def" returns a coroutine. The shell runs it
+// on one asyncio loop, kept running by a daemon thread, while the calling
+// stage waits for the result with the GIL released. Stages on other threads
+// (pipelines, background jobs, parallel substitutions) share that loop, so
+// their requests overlap instead of going out one after another. A task
+// starts in a copy of the caller's context, so print() and pipe_input()
+// inside the coroutine see the stage's streams.
+
+static PyObject *async_loop = NULL;      // The shell's event loop
+static PyObject *async_submit = NULL;    // asyncio.run_coroutine_threadsafe
+static unsigned long async_thread = 0;   // Ident of the thread running the loop
+static long async_loop_pid = 0;          // Forked pmap workers start a loop of their own
+
+static int start_async_loop(void) {
+  if (async_loop && async_loop_pid == (long)getpid()) return 0;
+
+  PyObject *asyncio = PyImport_ImportModule("asyncio");
+  PyObject *threading = PyImport_ImportModule("threading");
+  PyObject *loop = asyncio ? PyObject_CallMethod(asyncio, "new_event_loop", NULL) : NULL;
+  PyObject *submit = asyncio ? PyObject_GetAttrString(asyncio, "run_coroutine_threadsafe") : NULL;
+  PyObject *run_forever = loop ? PyObject_GetAttrString(loop, "run_forever") : NULL;
+  PyObject *thread = NULL;
+  if (threading && run_forever && submit) {
+    PyObject *thread_type = PyObject_GetAttrString(threading, "Thread");
+    PyObject *kwargs = Py_BuildValue("{s:O,s:s,s:O}", "target", run_forever, "name", "shell-async", "daemon", Py_True);
+    PyObject *no_args = PyTuple_New(0);
+    if (thread_type && kwargs && no_args) thread = PyObject_Call(thread_type, no_args, kwargs);
+    Py_XDECREF(thread_type);
+    Py_XDECREF(kwargs);
+    Py_XDECREF(no_args);
+  }
+
+  PyObject *started = thread ? PyObject_CallMethod(thread, "start", NULL) : NULL;
+  PyObject *ident = started ? PyObject_GetAttrString(thread, "ident") : NULL;
+  int ok = ident != NULL;
+  if (ok) {
+    Py_XSETREF(async_loop, loop);
+    Py_XSETREF(async_submit, submit);
+    loop = submit = NULL;
+    async_thread = PyLong_AsUnsignedLong(ident);
+    async_loop_pid = (long)getpid();
+  }
+
+  Py_XDECREF(ident);
+  Py_XDECREF(started);
+  Py_XDECREF(thread);
+  Py_XDECREF(run_forever);
+  Py_XDECREF(submit);
+  Py_XDECREF(loop);
+  Py_XDECREF(threading);
+  Py_XDECREF(asyncio);
+  return ok ? 0 : -1;
+}
+
+// Runs `coro` on the shell's loop and waits for it. Returns its result, or
+// NULL with its exception set.
+static PyObject* await_on_loop(PyObject *coro) {
+  if (start_async_loop() < 0) return NULL;
+  if (PyThread_get_thread_ident() == async_thread) {
+    // Blocking here would wait for ourselves
+    PyObject *closed = PyObject_CallMethod(coro, "close", NULL); // It will never run
+    Py_XDECREF(closed);
+    PyErr_Clear();
+    PyErr_SetString(PyExc_RuntimeError, "an async command can't be run from a coroutine on the shell's loop; await it instead");
+    return NULL;
+  }
+
+  PyObject *future = PyObject_CallFunctionObjArgs(async_submit, coro, async_loop, NULL);
+  if (!future) return NULL;
+
+  PyObject *value = PyObject_CallMethod(future, "result", NULL); // Waits with the GIL released
+  if (!value) {
+    // Interrupted (e.g. Ctrl-C): don't leave the coroutine running behind the prompt
+    PyObject *exc_type, *exc_value, *exc_tb;
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    PyObject *cancelled = PyObject_CallMethod(future, "cancel", NULL);
+    if (cancelled) Py_DECREF(cancelled);
+    else PyErr_Clear();
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+  }
+  Py_DECREF(future);
+  return value;
+}
+
+// --- EXECUTION ENGINE ---
+// Python commands are often tiny, so the fixed cost of a call matters: the
+// io.open function and method names are looked up once, the command name is
+// a ready-made str, arguments go through vectorcall, and output wrappers are
+// kept per fd. A wrapper for a file is reused while the fd still refers to
+// that file. Pipes and sockets have no position for the wrapper to get wrong,
+// and every pipeline makes new ones, so their wrapper is reused for whichever
+// pipe the fd refers to next.
+
+#define OUTPUT_CACHE_SIZE 64  // Output fds below this get a reusable wrapper
+#define CALL_STACK_ARGS 16    // Calls with more arguments allocate their argument array
+
+typedef struct OutputWrapper {
+  PyObject *stream;  // Text wrapper around the fd (closefd=False)
+  dev_t dev;         // Identity of the file it was created for
+  ino_t ino;
+  int is_stream;     // Created for a pipe or socket; any other one will do
+  int in_use;        // Bound to a running command; others get their own wrapper
+} OutputWrapper;
+
+static OutputWrapper output_cache[OUTPUT_CACHE_SIZE];
+static PyObject *io_open = NULL;        // io.open
+static PyObject *io_stringio = NULL;    // io.StringIO
+static PyObject *str_flush = NULL;      // Interned method and attribute names
+static PyObject *str_closed = NULL;
+
+static int init_call_cache(void) {
+  if (io_open) return 0;
+  PyObject *io = PyImport_ImportModule("io");
+  if (!io) return -1;
+  io_open = PyObject_GetAttrString(io, "open");
+  io_stringio = PyObject_GetAttrString(io, "StringIO");
+  Py_DECREF(io);
+  str_flush = PyUnicode_InternFromString("flush");
+  str_closed = PyUnicode_InternFromString("closed");
+  if (!io_open || !io_stringio || !str_flush || !str_closed) {
+    Py_CLEAR(io_open);
+    return -1;
+  }
+  return 0;
+}
+
+// io.open(fd, mode, closefd=False): the fd stays ours.
+static PyObject* wrap_fd(int fd, const char *mode) {
+  if (init_call_cache() < 0) return NULL;
+  return PyObject_CallFunction(io_open, "isiOOOO", fd, mode, -1, Py_None, Py_None, Py_None, Py_False);
+}
+
+// Returns a new reference to a text stream writing to `fd`, and the cache
+// entry it came from (NULL if it isn't cached).
+static PyObject* acquire_output_stream(int fd, OutputWrapper **entry) {
+  *entry = NULL;
+  if (fd < 0 || fd >= OUTPUT_CACHE_SIZE) return wrap_fd(fd, "w");
+
+  OutputWrapper *slot = &output_cache[fd];
+  if (slot->in_use) return wrap_fd(fd, "w");
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) return wrap_fd(fd, "w");
+  int is_stream = S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode);
+
+  if (slot->stream) {
+    // Same file (or still a pipe) behind the fd, and the command didn't
+    // close it on us last time?
+    int reusable = slot->is_stream ? is_stream : (!is_stream && slot->dev == st.st_dev && slot->ino == st.st_ino);
+    if (reusable) {
+      PyObject *closed = PyObject_GetAttr(slot->stream, str_closed);
+      reusable = (closed == Py_False);
+      Py_XDECREF(closed);
+      PyErr_Clear();
+    }
+    if (!reusable) Py_CLEAR(slot->stream);
+  }
+
+  if (!slot->stream) {
+    slot->stream = wrap_fd(fd, "w");
+    if (!slot->stream) return NULL;
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->is_stream = is_stream;
+  }
+
+  slot->in_use = 1;
+  *entry = slot;
+  Py_INCREF(slot->stream);
+  return slot->stream;
+}
+
+// With the object_pipes option, a Python stage that feeds another Python
+// stage doesn't get a pipe: its return value is handed over as is (read with
+// shell_core.pipe_input()), and whatever it printed becomes the next stage's
+// stdin. A returned generator is handed over unconsumed, so it runs as the
+// next stage iterates it.
+typedef struct StageIO {
+  PyObject *input;     // Bound as sys.stdin instead of a wrapper around input_fd
+  PyObject *output;    // Bound as sys.stdout instead of a wrapper around output_fd
+  PyObject *upstream;  // Previous stage's return value, for pipe_input()
+  int keep_result;     // Store the return value in `result` rather than streaming it
+  PyObject *result;    // New reference (None on failure) when keep_result is set
+} StageIO;
+
+static PyObject *pipe_input_var = NULL; // ContextVar behind pipe_input()
+static int pipe_input_depth = 0;        // Calls currently running with an upstream object
+
+// A command that returns an iterator (e.g. a generator) has each item
+// printed to `out` as it is produced, while its streams are still bound.
+// Output is flushed every `stream_batch` items; 0 leaves it to the buffer.
+// A reader that has gone away (head, grep -q) just ends the stream.
+static int stream_result(PyObject *iterator, PyObject *out) {
+  PyObject *item;
+  int pending = 0;
+
+  while ((item = PyIter_Next(iterator)) != NULL) {
+    int rc = PyFile_WriteObject(item, out, Py_PRINT_RAW);
+    Py_DECREF(item);
+    if (rc == 0) rc = PyFile_WriteString("\n", out);
+    if (rc == 0 && opt_stream_batch > 0 && ++pending >= opt_stream_batch) {
+      pending = 0;
+      PyObject *flushed = PyObject_CallMethodObjArgs(out, str_flush, NULL);
+      if (flushed) Py_DECREF(flushed);
+      else rc = -1;
+    }
+    if (rc < 0) break;
+  }
+
+  if (!PyErr_Occurred()) return 0;
+  if (PyErr_ExceptionMatches(PyExc_BrokenPipeError)) {
+    PyErr_Clear();
+    return 0;
+  }
+  return -1;
+}
+
+// Commands often return results (add_five returns the sum), so a return value
+// only becomes the exit status when it's a shell_core.ExitStatus: an int
+// subclass, cut to its low 8 bits like a process's status. Anything else,
+// plain ints included, means success.
+static PyTypeObject ExitStatusType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "shell_core.ExitStatus",
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "An int that a command returns to set its exit status.",
+};
+
+static int exit_status_of(PyObject *result) {
+  if (!PyObject_TypeCheck(result, &ExitStatusType)) return 0;
+
+  int overflow = 0;
+  long value = PyLong_AsLongAndOverflow(result, &overflow);
+  if (overflow) {
+    PyObject *mask = PyLong_FromLong(0xff);
+    PyObject *low = mask ? PyNumber_And(result, mask) : NULL;
+    value = low ? PyLong_AsLong(low) : 0;
+    Py_XDECREF(low);
+    Py_XDECREF(mask);
+  }
+  PyErr_Clear();
+  return (int)((unsigned long)value & 0xff);
+}
+
+static int run_python_command(PyCommand *cmd, char **args, int input_fd, int output_fd, StageIO *io) {
   if (!cmd) return -1;
 
-  // Construct Argument Tuple
-  int argc = 0;
-  while(args[argc] != NULL) argc++;
-  PyObject *pArgs = PyTuple_New(argc);
-  for (int i = 0; i < argc; i++) {
-    PyTuple_SetItem(pArgs, i, PyUnicode_FromString(args[i]));
+  // Hold our own reference: the command may re-register or unregister itself mid-call
+  PyObject *func = cmd->func;
+  Py_INCREF(func);
+
+  // Construct the argument vector; args[0] is the command name
+  int argc = 0;
+  while(args[argc] != NULL) argc++;
+  PyObject *stack_args[CALL_STACK_ARGS];
+  PyObject **call_args = argc <= CALL_STACK_ARGS ? stack_args : PyMem_Malloc(sizeof(PyObject*) * argc);
+  int built = 0;
+  if (call_args) {
+    call_args[0] = cmd->name_obj;
+    Py_INCREF(call_args[0]);
+    for (built = 1; built < argc; built++) {
+      call_args[built] = PyUnicode_FromString(args[built]);
+      if (!call_args[built]) break;
+    }
+  } else {
+    PyErr_NoMemory();
+  }
+
+  PyObject *py_in = NULL;
+  PyObject *py_out = NULL;
+  OutputWrapper *out_entry = NULL;
+  StreamBinding in_binding = {0};
+  StreamBinding out_binding = {0};
+  PyObject *result = NULL;
+  PyObject *upstream_token = NULL;
+
+  if (call_args && built == argc) {
+    // Redirect STDIN (if needed). Input wrappers aren't reused: their
+    // read-ahead buffer belongs to the file they were opened for.
+    if (io && io->input) {
+      py_in = io->input;
+      Py_INCREF(py_in);
+      bind_stream(&in_binding, stdin_router, py_in);
+    } else if (input_fd != STDIN_FILENO) {
+      py_in = wrap_fd(input_fd, "r");
+      if (py_in) bind_stream(&in_binding, stdin_router, py_in);
+      else PyErr_Clear();
+    }
+
+    // Redirect STDOUT (if needed)
+    if (io && io->output) {
+      py_out = io->output;
+      Py_INCREF(py_out);
+      bind_stream(&out_binding, stdout_router, py_out);
+    } else if (output_fd != STDOUT_FILENO) {
+      py_out = acquire_output_stream(output_fd, &out_entry);
+      if (py_out) bind_stream(&out_binding, stdout_router, py_out);
+      else PyErr_Clear();
+    }
+
+    // Hand over the upstream object. While any stage has one, every call
+    // sets the variable, so commands run from inside it don't inherit it.
+    PyObject *upstream = io ? io->upstream : NULL;
+    if (upstream || pipe_input_depth > 0) {
+      upstream_token = PyContextVar_Set(pipe_input_var, upstream ? upstream : Py_None);
+      if (upstream_token) pipe_input_depth++;
+      else PyErr_Clear();
+    }
+
+    // CALL THE FUNCTION
+#if PY_VERSION_HEX >= 0x03090000
+    result = PyObject_Vectorcall(func, call_args, argc, NULL);
+#else
+    PyObject *tuple = PyTuple_New(argc);
+    if (tuple) {
+      for (int i = 0; i < argc; i++) {
+        Py_INCREF(call_args[i]);
+        PyTuple_SET_ITEM(tuple, i, call_args[i]);
+      }
+      result = PyObject_Call(func, tuple, NULL);
+      Py_DECREF(tuple);
+    }
+#endif
+
+    // AWAIT A COROUTINE RESULT
+    if (result && PyCoro_CheckExact(result)) {
+      Py_SETREF(result, await_on_loop(result));
+    }
+
+    // STREAM AN ITERATOR RESULT
+    if (result && io && io->keep_result) {
+      io->result = result;
+      Py_INCREF(result);
+    } else if (result && PyIter_Check(result) && init_call_cache() == 0) {
+      PyObject *out = py_out ? py_out : PySys_GetObject("stdout"); // The iterator may rebind sys.stdout
+      Py_XINCREF(out);
+      if (out && stream_result(result, out) < 0) Py_CLEAR(result);
+      Py_XDECREF(out);
+    }
+  }
+
+  // FLUSH STDOUT
+  // Even though we manage the FD, Python has its own buffer we must empty.
+  if (py_out) {
+    // Keep the command's exception (if any) intact while flushing
+    PyObject *exc_type, *exc_value, *exc_tb;
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    PyObject *flushed = PyObject_CallMethodObjArgs(py_out, str_flush, NULL);
+    if (flushed) {
+      Py_DECREF(flushed);
+    } else {
+      PyErr_Clear(); // e.g. EPIPE when the reader already exited
+      // Its buffer still holds what didn't get out; don't let that leak
+      // into whatever this fd number is reused for next
+      if (out_entry) Py_CLEAR(out_entry->stream);
+    }
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+  }
+
+  // RESTORE STREAMS & CLEANUP
+  if (upstream_token) {
+    PyContextVar_Reset(pipe_input_var, upstream_token);
+    Py_DECREF(upstream_token);
+    pipe_input_depth--;
+  }
+  unbind_stream(&in_binding);
+  unbind_stream(&out_binding);
+
+  // Cleanup our wrapper objects
+  if (py_in) Py_DECREF(py_in);
+  if (py_out) Py_DECREF(py_out);
+  if (out_entry) out_entry->in_use = 0;
+  for (int i = 0; i < built; i++) Py_DECREF(call_args[i]);
+  if (call_args != stack_args) PyMem_Free(call_args);
+  Py_DECREF(func);
+
+  // Handle Errors
+  if (result == NULL) {
+    PyErr_Print(); // Print traceback if Python crashed
+    if (io && io->keep_result) {
+      io->result = Py_None;
+      Py_INCREF(Py_None);
+    }
+    return 1;
+  }
+  int status = exit_status_of(result);
+  Py_DECREF(result);
+
+  return status;
+}
+
+int execute_python_command(PyCommand *cmd, char **args, int input_fd, int output_fd) {
+  return run_python_command(cmd, args, input_fd, output_fd, NULL);
+}
+
+// Python calls this: shell_core.pipe_input() -> what the previous stage returned
+static PyObject* shell_pipe_input(PyObject *self, PyObject *args) {
+  PyObject *value = NULL;
+  if (PyContextVar_Get(pipe_input_var, Py_None, &value) < 0) return NULL;
+  return value;
+}
+
+// Python Usage: shell_core.call_with_stdout(stream, func, *args, **kwargs) -> func's result
+// Calls func with sys.stdout bound to `stream` for the current context only,
+// so stages running on other threads keep printing to their own streams.
+static PyObject* shell_call_with_stdout(PyObject *self, PyObject *args, PyObject *kwargs) {
+  if (PyTuple_GET_SIZE(args) < 2) {
+    PyErr_SetString(PyExc_TypeError, "call_with_stdout() needs a stream and a function to call");
+    return NULL;
+  }
+  PyObject *stream = PyTuple_GET_ITEM(args, 0);
+  PyObject *func = PyTuple_GET_ITEM(args, 1);
+  PyObject *call_args = PyTuple_GetSlice(args, 2, PyTuple_GET_SIZE(args));
+  if (!call_args) return NULL;
+
+  StreamBinding binding;
+  bind_stream(&binding, stdout_router, stream);
+  PyObject *result = PyObject_Call(func, call_args, kwargs);
+  unbind_stream(&binding);
+
+  Py_DECREF(call_args);
+  return result;
+}
+
+// Python Usage: shell_core.copy_fd(src, dst) -> number of bytes copied
+// Moves everything left in src to dst (fds, or objects with fileno()) with
+// copy_fd, without the GIL. A file object given as dst is flushed first.
+// For a stage that just passes its input on: copy_fd(sys.stdin, sys.stdout).
+static PyObject* shell_copy_fd(PyObject *self, PyObject *args) {
+  PyObject *src, *dst;
+  if (!PyArg_ParseTuple(args, "OO", &src, &dst)) {
+    return NULL;
+  }
+
+  int in_fd = PyObject_AsFileDescriptor(src);
+  if (in_fd < 0) return NULL;
+  int out_fd = PyObject_AsFileDescriptor(dst);
+  if (out_fd < 0) return NULL;
+  if (!PyLong_Check(dst) && PyObject_HasAttrString(dst, "flush")) {
+    PyObject *flushed = PyObject_CallMethod(dst, "flush", NULL);
+    if (!flushed) return NULL;
+    Py_DECREF(flushed);
+  }
+
+  long long copied = 0;
+  while (1) {
+    int rc;
+    Py_BEGIN_ALLOW_THREADS
+    rc = copy_fd(in_fd, out_fd, &copied);
+    Py_END_ALLOW_THREADS
+    if (rc == 0) break;
+    if (errno == EINTR && PyErr_CheckSignals() == 0) continue;
+    if (!PyErr_Occurred()) PyErr_SetFromErrno(PyExc_OSError);
+    return NULL;
+  }
+  return PyLong_FromLongLong(copied);
+}
+
+// --- TOKENIZER ---
+// tokenize_command turns a line into a compact array of typed tokens. Word
+// text is stored unquoted and NUL-terminated in one backing buffer, so the
+// stages downstream dispatch on `kind` instead of comparing strings, and a
+// quoted "|" stays an ordinary word.
+
+typedef enum TokenKind {
+  TOK_WORD,
+  TOK_PIPE,          // |
+  TOK_AND,           // &&
+  TOK_OR,            // ||
+  TOK_REDIR_IN,      // <
+  TOK_REDIR_OUT,     // >
+  TOK_REDIR_APPEND,  // >>
+  TOK_BACKGROUND,    // &
+  TOK_LPAREN,        // (
+  TOK_RPAREN,        // )
+} TokenKind;
+
+typedef struct Token {
+  uint32_t kind;
+  uint32_t offset;   // Start of the token's text in the backing buffer
+  uint32_t length;   // Not counting the NUL terminator
+} Token;
+
+typedef struct TokenList {
+  Token *tokens;
+  int count;
+  int capacity;
+  char *text;        // Backing buffer for every token's text
+  size_t text_len;
+} TokenList;
+
+static void emit_token(TokenList *list, Arena *arena, TokenKind kind, size_t offset) {
+  if (list->count == list->capacity) {
+    int new_capacity = list->capacity ? list->capacity * 2 : 16;
+    list->tokens = arena_realloc(arena, list->tokens, sizeof(Token) * list->capacity, sizeof(Token) * new_capacity);
+    list->capacity = new_capacity;
+  }
+
+  list->text[list->text_len] = '\0';
+  Token *token = &list->tokens[list->count++];
+  token->kind = kind;
+  token->offset = (uint32_t)offset;
+  token->length = (uint32_t)(list->text_len - offset);
+  list->text_len++; // Keep the terminator
+}
+
+static void emit_operator(TokenList *list, Arena *arena, TokenKind kind, const char *op) {
+  size_t offset = list->text_len;
+  size_t n = strlen(op);
+  memcpy(list->text + offset, op, n);
+  list->text_len += n;
+  emit_token(list, arena, kind, offset);
+}
+
+static TokenKind operator_kind(char c) {
+  switch (c) {
+    case '|': return TOK_PIPE;
+    case '<': return TOK_REDIR_IN;
+    case '>': return TOK_REDIR_OUT;
+    case '&': return TOK_BACKGROUND;
+    case '(': return TOK_LPAREN;
+    default:  return TOK_RPAREN;
+  }
+}
+
+// Returns the number of tokens, or -1 on error.
+int tokenize_command(const char *input_str, TokenList *list, Arena *arena) {
+  const size_t input_size = strlen(input_str);
+
+  // Initialize output. Unquoting never makes text longer and every token adds
+  // at most one terminator, so twice the input always fits.
+  list->tokens = NULL;
+  list->count = 0;
+  list->capacity = 0;
+  list->text = arena_alloc(arena, input_size * 2 + 2);
+  list->text_len = 0;
+  if (!list->text) return -1;
+
+  char *text = list->text;
+  size_t word_start = 0; // Where the word being built starts in `text`
+  bool word_quoted = false; // The word had quotes, so it's a word even if empty ("" or '')
+  int subshell_depth = 0;
+  char current_char;
+
+  // Boolean values for tracking state.
+  bool single_quote = false;
+  bool double_quote = false;
+  bool char_escaped = false;
+
+  for (size_t i = 0; i < input_size; i++) {
+    current_char = input_str[i];
+
+    // [#1] Escaped Character
+    if (char_escaped) {
+      text[list->text_len++] = current_char;
+      char_escaped = false;
+    }
+
+    // [#2] Unquoted Operators (|, <, >, (, ), &)
+    else if (!single_quote && !double_quote && !char_escaped &&
+         (current_char == '|' || current_char == '<' ||
+          current_char == '>' || current_char == '(' || current_char == ')' ||
+          current_char == '&')) {
+
+      // A. Substitution Start "$("
+      if (current_char == '(' && list->text_len > word_start && text[list->text_len-1] == '$') {
+        subshell_depth++;
+        text[list->text_len++] = current_char;
+        continue;
+      }
+
+      // B. Substitution End ")"
+      if (current_char == ')' && subshell_depth > 0) {
+        subshell_depth--;
+        text[list->text_len++] = current_char;
+        continue;
+      }
+
+      // C. Inside Substitution -> Literal
+      if (subshell_depth > 0) {
+        text[list->text_len++] = current_char;
+        continue;
+      }
+
+      // --- Delimiter Logic ---
+
+      // 1. Flush current word if exists
+      if (list->text_len > word_start || word_quoted) {
+        emit_token(list, arena, TOK_WORD, word_start);
+        word_quoted = false;
+      }
+
+      // 2. Handle Operators as separate tokens
+      if (current_char == '&' && input_str[i+1] == '&') {
+        emit_operator(list, arena, TOK_AND, "&&");
+        i++; // Skip the second '&'
+      } else if (current_char == '|' && input_str[i+1] == '|') {
+        emit_operator(list, arena, TOK_OR, "||");
+        i++; // Skip the second '|'
+      } else if (current_char == '>' && input_str[i+1] == '>') {
+        emit_operator(list, arena, TOK_REDIR_APPEND, ">>");
+        i++; // Skip the second '>'
+      } else {
+        // Catch-all for single operators: >, <, |, &, (, )
+        char op_str[2] = {current_char, '\0'};
+        emit_operator(list, arena, operator_kind(current_char), op_str);
+      }
+      word_start = list->text_len;
+    }
+    // [#3] Whitespace
+    else if (current_char == ' ' || current_char == '\n') {
+      if (single_quote || double_quote || subshell_depth > 0) {
+        text[list->text_len++] = current_char;
+      } else {
+        if (list->text_len > word_start || word_quoted) {
+          emit_token(list, arena, TOK_WORD, word_start);
+          word_start = list->text_len;
+          word_quoted = false;
+        }
+      }
+    }
+
+    // [#4] Quotes
+    // Note: We generally DO NOT want to include the quote characters themselves
+    // in the final arg, unless you want the python script to see them.
+    else if (current_char == '\'' && !double_quote) {
+      single_quote = !single_quote;
+      word_quoted = true;
+    }
+    else if (current_char == '\"' && !single_quote) {
+      double_quote = !double_quote;
+      word_quoted = true;
+    }
+
+    // [#5] Backslash Start
+    else if (current_char == '\\' && !double_quote && !single_quote) {
+      char_escaped = true;
+    }
+
+    // [Final] Regular Char
+    else {
+      text[list->text_len++] = current_char;
+    }
+  }
+
+  // [CLEAN UP] Flush remaining buffer
+  if (list->text_len > word_start || word_quoted) {
+    emit_token(list, arena, TOK_WORD, word_start);
+  }
+
+  return list->count;
+}
+
+
+// --- STAGE TRACING ---
+// While a trace hook is set (shell_core.set_trace_hook) or a pipeline is
+// prefixed with `time`, every stage of a foreground pipeline records its wall
+// time and CPU time: external commands through wait4's rusage (which also
+// gives their peak RSS, except on Linux), in-process stages through their
+// thread's CPU clock. A stage's end is when it exited; on systems other than
+// Linux and Windows it's when the shell reaped it, in pipeline order.
+// Otherwise none of this runs, so untraced pipelines pay nothing for it.
+
+typedef enum { STAGE_EXTERNAL, STAGE_PYTHON, STAGE_BUILTIN } StageKind;
+
+static const char *stage_kind_names[] = {"external", "python", "builtin"};
+
+typedef struct StageStats {
+  char *command;     // The stage's words joined by spaces (arena)
+  StageKind kind;
+  pid_t pid;         // External stages only
+  double start;      // Monotonic seconds
+  double end;
+  double user;       // CPU seconds
+  double sys;
+  long max_rss_kb;   // -1 when not known: in-process stages share the shell's heap, and
+                     // on Linux a posix_spawn'd child's high-water mark includes the
+                     // shell's own RSS from before the exec
+  int exit_code;
+} StageStats;
+
+static PyObject *trace_hook = NULL;
+static int in_trace_hook = 0; // Pipelines the hook itself runs aren't traced
+
+static double monotonic_seconds(void) {
+#ifdef _WIN32
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+// CPU time used so far by the calling thread.
+static void thread_cpu_seconds(double *user, double *sys) {
+#ifdef _WIN32
+  FILETIME created, exited, kernel, usr;
+  *user = *sys = 0;
+  if (GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &usr)) {
+    *user = (((uint64_t)usr.dwHighDateTime << 32) | usr.dwLowDateTime) / 1e7;
+    *sys = (((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) / 1e7;
+  }
+#elif defined(RUSAGE_THREAD)
+  struct rusage ru;
+  getrusage(RUSAGE_THREAD, &ru);
+  *user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+  *sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  *user = ts.tv_sec + ts.tv_nsec / 1e9; // No user/system split available
+  *sys = 0;
+#endif
+}
+
+// Turns the start of an in-process stage's CPU counters into its usage.
+static void stage_stats_finish(StageStats *st, double user0, double sys0, int exit_code) {
+  double user, sys;
+  thread_cpu_seconds(&user, &sys);
+  st->end = monotonic_seconds();
+  st->user = user - user0;
+  st->sys = sys - sys0;
+  st->exit_code = exit_code;
+}
+
+// --- BUILTINS ---
+// Small glue commands implemented here, so scripts don't pay for a Python
+// call or a process spawn just to print a line or test a file. They are
+// found before the Python registry and PATH, take the stage's fds and return
+// an exit code. A builtin that feeds a pipe runs on a pipeline worker like a
+// Python stage does, so a large write can't stall the stages after it.
+
+typedef int (*BuiltinFunc)(char **argv, int input_fd, int output_fd);
+
+typedef struct Builtin {
+  const char *name;
+  BuiltinFunc run;
+  const char *usage;
+  int (*accepts)(char **argv); // Optional: 0 leaves this argv to the command on PATH
+  // Optional: runs instead of `run` when the builtin is part of a pipeline or
+  // a background job. Those are subshells, so changes to the shell's state
+  // (directory, variables) must not happen there.
+  BuiltinFunc isolated;
+} Builtin;
+
+// Keeps the order of anything Python printed before a builtin writes to `fd`
+static void builtin_flush_stdout(int fd) {
+  if (fd != STDOUT_FILENO) return;
+
+  PyObject *out = PySys_GetObject("stdout"); // Borrowed
+  PyObject *flushed = out && out != Py_None ? PyObject_CallMethod(out, "flush", NULL) : NULL;
+  Py_XDECREF(flushed);
+  PyErr_Clear();
+}
+
+// Writes all of `data` to `fd` without the GIL. Returns 0, or -1 on error
+// (EPIPE from a reader that already exited is not reported).
+static int builtin_write(int fd, const char *data, size_t len, const char *name) {
+  builtin_flush_stdout(fd);
+
+  int err = 0;
+  Py_BEGIN_ALLOW_THREADS
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      err = n < 0 ? errno : EIO;
+      break;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+  Py_END_ALLOW_THREADS
+
+  if (err == 0) return 0;
+  if (err != EPIPE) fprintf(stderr, "%s: write error: %s\n", name, strerror(err));
+  return -1;
+}
+
+// echo [-n] [args...]
+static int builtin_echo(char **argv, int input_fd, int output_fd) {
+  int newline = 1;
+  int i = 1;
+  if (argv[i] && strcmp(argv[i], "-n") == 0) {
+    newline = 0;
+    i++;
+  }
+
+  StrBuf out;
+  sb_init(&out);
+  for (int first = i; argv[i]; i++) {
+    if (i > first) sb_append(&out, " ", 1);
+    sb_append(&out, argv[i], strlen(argv[i]));
+  }
+  if (newline) sb_append(&out, "\n", 1);
+
+  int rc = builtin_write(output_fd, out.data, out.len, argv[0]);
+  free(out.data);
+  return rc == 0 ? 0 : 1;
+}
+
+// env: prints the exported variables
+static int builtin_env(char **argv, int input_fd, int output_fd) {
+  if (argv[1]) {
+    fprintf(stderr, "%s: running a command with a modified environment is not supported\n", argv[0]);
+    return 2;
+  }
+
+  char **envp = exported_envp();
+  StrBuf out;
+  sb_init(&out);
+  for (char **entry = envp; entry && *entry; entry++) {
+    sb_append(&out, *entry, strlen(*entry));
+    sb_append(&out, "\n", 1);
+  }
+
+  int rc = builtin_write(output_fd, out.data, out.len, argv[0]);
+  free(out.data);
+  return rc == 0 ? 0 : 1;
+}
+
+// export [NAME[=VALUE]...]: with no names, lists the exported variables
+// `apply` = 0 only checks the names (in a subshell nothing is exported).
+static int export_vars(char **argv, int output_fd, int apply) {
+  if (!argv[1]) {
+    char **envp = exported_envp();
+    StrBuf out;
+    sb_init(&out);
+    for (char **entry = envp; entry && *entry; entry++) {
+      sb_append(&out, "export ", 7);
+      sb_append(&out, *entry, strlen(*entry));
+      sb_append(&out, "\n", 1);
+    }
+    int rc = builtin_write(output_fd, out.data, out.len, argv[0]);
+    free(out.data);
+    return rc == 0 ? 0 : 1;
+  }
+
+  int exit_code = 0;
+  for (int i = 1; argv[i]; i++) {
+    char *equals = strchr(argv[i], '=');
+    size_t name_len = equals ? (size_t)(equals - argv[i]) : strlen(argv[i]);
+    char *name = malloc(name_len + 1);
+    if (name) {
+      memcpy(name, argv[i], name_len);
+      name[name_len] = '\0';
+    }
+    if (!name || !valid_var_name(name)) {
+      fprintf(stderr, "%s: `%s': not a valid identifier\n", argv[0], argv[i]);
+      exit_code = 1;
+    } else if (apply && var_set(name, equals ? equals + 1 : NULL, 1) != 0) {
+      fprintf(stderr, "%s: out of memory\n", argv[0]);
+      exit_code = 1;
+    }
+    free(name);
+  }
+  return exit_code;
+}
+
+static int builtin_export(char **argv, int input_fd, int output_fd) {
+  return export_vars(argv, output_fd, 1);
+}
+
+static int builtin_export_isolated(char **argv, int input_fd, int output_fd) {
+  return export_vars(argv, output_fd, 0);
+}
+
+// unset NAME...
+static int builtin_unset(char **argv, int input_fd, int output_fd) {
+  for (int i = 1; argv[i]; i++) var_unset(argv[i]);
+  return 0;
+}
+
+static int builtin_unset_isolated(char **argv, int input_fd, int output_fd) {
+  return 0;
+}
+
+// Does PATH have entries that depend on the current directory?
+static int path_is_relative(void) {
+  const char *path = var_get("PATH");
+  if (!path) return 0;
+  for (const char *dir = path; ; ) {
+    if (*dir != '/') return 1; // Includes empty entries, which mean "."
+    const char *end = strchr(dir, ':');
+    if (!end) return 0;
+    dir = end + 1;
+  }
+}
+
+// cd [dir | -]: no argument means $HOME, "-" means $OLDPWD.
+// `apply` = 0 only checks that the directory could be entered.
+static int change_directory(char **argv, int output_fd, int apply) {
+  const char *target = argv[1];
+  int announce = 0;
+  if (target && argv[2]) {
+    fprintf(stderr, "%s: too many arguments\n", argv[0]);
+    return 1;
+  }
+  if (!target) {
+    target = var_get("HOME");
+    if (!target) {
+      fprintf(stderr, "%s: HOME not set\n", argv[0]);
+      return 1;
+    }
+  } else if (strcmp(target, "-") == 0) {
+    target = var_get("OLDPWD");
+    if (!target) {
+      fprintf(stderr, "%s: OLDPWD not set\n", argv[0]);
+      return 1;
+    }
+    announce = 1;
+  }
+
+  if (!apply) {
+    struct stat st;
+    int err = 0;
+    if (stat(target, &st) != 0) err = errno;
+    else if (!S_ISDIR(st.st_mode)) err = ENOTDIR;
+    else if (access(target, X_OK) != 0) err = errno;
+    if (err) {
+      fprintf(stderr, "%s: %s: %s\n", argv[0], target, strerror(err));
+      return 1;
+    }
+    if (announce) {
+      builtin_write(output_fd, target, strlen(target), argv[0]);
+      builtin_write(output_fd, "\n", 1, argv[0]);
+    }
+    return 0;
+  }
+
+  char *destination = strdup(target); // var_set below may free `target`
+  char previous[4096];
+  int have_previous = getcwd(previous, sizeof(previous)) != NULL;
+  if (!destination || chdir(destination) != 0) {
+    fprintf(stderr, "%s: %s: %s\n", argv[0], destination ? destination : target, strerror(errno));
+    free(destination);
+    return 1;
+  }
+  free(destination);
+
+  char current[4096];
+  if (have_previous) var_set("OLDPWD", previous, -1);
+  if (getcwd(current, sizeof(current))) {
+    var_set("PWD", current, -1);
+    if (announce) {
+      size_t n = strlen(current);
+      current[n] = '\n';
+      builtin_write(output_fd, current, n + 1, argv[0]);
+    }
+  }
+
+  // Relative PATH entries now point somewhere else
+  if (path_is_relative()) clear_path_cache();
+  return 0;
+}
+
+static int builtin_cd(char **argv, int input_fd, int output_fd) {
+  return change_directory(argv, output_fd, 1);
+}
+
+static int builtin_cd_isolated(char **argv, int input_fd, int output_fd) {
+  return change_directory(argv, output_fd, 0);
+}
+
+// `time` is handled by launch_pipeline when it starts a pipeline; anywhere else it's misplaced
+static int builtin_time(char **argv, int input_fd, int output_fd) {
+  fprintf(stderr, "%s: must come first in a pipeline\n", argv[0]);
+  return 2;
+}
+
+// cat [FILE...]: copies the files ("-" or none: the input) to the output
+// with copy_fd, so the bytes skip user space wherever the kernel allows it.
+static int builtin_cat(char **argv, int input_fd, int output_fd) {
+  static char *stdin_only[] = {"-", NULL};
+  char **files = argv[1] ? argv + 1 : stdin_only;
+  int status = 0;
+
+  builtin_flush_stdout(output_fd);
+  for (int i = 0; files[i]; i++) {
+    int from_input = strcmp(files[i], "-") == 0;
+    int fd = from_input ? input_fd : open(files[i], O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      fprintf(stderr, "%s: %s: %s\n", argv[0], files[i], strerror(errno));
+      status = 1;
+      continue;
+    }
+
+    long long copied = 0;
+    int rc, err;
+    Py_BEGIN_ALLOW_THREADS
+    rc = copy_fd(fd, output_fd, &copied);
+    err = errno;
+    Py_END_ALLOW_THREADS
+    if (!from_input) close(fd);
+
+    if (rc < 0) {
+      if (err == EINTR) return 130; // Ctrl-C; Python's handler still sees the signal afterwards
+      if (err == EPIPE) return 1; // The reader is gone; the other files have nowhere to go either
+      fprintf(stderr, "%s: %s: %s\n", argv[0], files[i], strerror(err));
+      status = 1;
+    }
+  }
+  return status;
+}
+
+// Only plain file lists; options like -n are left to the cat on PATH
+static int builtin_cat_accepts(char **argv) {
+  for (int i = 1; argv[i]; i++) {
+    if (argv[i][0] == '-' && argv[i][1] != '\0') return 0;
+  }
+  return 1;
+}
+
+static int builtin_true(char **argv, int input_fd, int output_fd) { return 0; }
+static int builtin_false(char **argv, int input_fd, int output_fd) { return 1; }
+
+// Parses a whole decimal integer for test's numeric comparisons.
+static int test_integer(const char *text, long long *value, const char *name) {
+  char *end;
+  errno = 0;
+  *value = strtoll(text, &end, 10);
+  if (end == text || *end != '\0' || errno != 0) {
+    fprintf(stderr, "%s: %s: integer expression expected\n", name, text);
+    return -1;
+  }
+  return 0;
+}
+
+// One primary of test: 0 = true, 1 = false, 2 = error.
+static int test_unary(const char *op, const char *operand, const char *name) {
+  struct stat st;
+  if (strcmp(op, "-n") == 0) return operand[0] ? 0 : 1;
+  if (strcmp(op, "-z") == 0) return operand[0] ? 1 : 0;
+  if (strcmp(op, "-e") == 0) return stat(operand, &st) == 0 ? 0 : 1;
+  if (strcmp(op, "-f") == 0) return stat(operand, &st) == 0 && S_ISREG(st.st_mode) ? 0 : 1;
+  if (strcmp(op, "-d") == 0) return stat(operand, &st) == 0 && S_ISDIR(st.st_mode) ? 0 : 1;
+  if (strcmp(op, "-s") == 0) return stat(operand, &st) == 0 && st.st_size > 0 ? 0 : 1;
+  if (strcmp(op, "-r") == 0) return access(operand, R_OK) == 0 ? 0 : 1;
+  if (strcmp(op, "-w") == 0) return access(operand, W_OK) == 0 ? 0 : 1;
+  if (strcmp(op, "-x") == 0) return access(operand, X_OK) == 0 ? 0 : 1;
+  if (strcmp(op, "-L") == 0 || strcmp(op, "-h") == 0) {
+#ifdef _WIN32
+    return 1;
+#else
+    return lstat(operand, &st) == 0 && S_ISLNK(st.st_mode) ? 0 : 1;
+#endif
+  }
+  fprintf(stderr, "%s: %s: unary operator expected\n", name, op);
+  return 2;
+}
+
+static const char *test_binary_ops[] = {"=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL};
+
+static int is_test_binary_op(const char *op) {
+  for (const char **known = test_binary_ops; *known; known++) {
+    if (strcmp(op, *known) == 0) return 1;
+  }
+  return 0;
+}
+
+static int test_binary(const char *left, const char *op, const char *right, const char *name) {
+  if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(left, right) == 0 ? 0 : 1;
+  if (strcmp(op, "!=") == 0) return strcmp(left, right) != 0 ? 0 : 1;
+
+  static const char *numeric[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+  for (int k = 0; k < 6; k++) {
+    if (strcmp(op, numeric[k]) != 0) continue;
+    long long a, b;
+    if (test_integer(left, &a, name) != 0 || test_integer(right, &b, name) != 0) return 2;
+    int result;
+    switch (k) {
+      case 0: result = a == b; break;
+      case 1: result = a != b; break;
+      case 2: result = a < b; break;
+      case 3: result = a <= b; break;
+      case 4: result = a > b; break;
+      default: result = a >= b; break;
+    }
+    return result ? 0 : 1;
+  }
+  fprintf(stderr, "%s: %s: binary operator expected\n", name, op);
+  return 2;
+}
+
+// Evaluates n test arguments the way POSIX decides by their count: a leading
+// "!" negates the rest unless the middle word is a binary operator.
+static int test_expr(char **args, int n, const char *name) {
+  int negated = n >= 2 && strcmp(args[0], "!") == 0;
+  int result;
+
+  switch (n) {
+    case 0: return 1;
+    case 1: return args[0][0] ? 0 : 1;
+    case 2:
+      if (negated) break;
+      return test_unary(args[0], args[1], name);
+    case 3:
+      if (is_test_binary_op(args[1])) return test_binary(args[0], args[1], args[2], name);
+      if (negated) break;
+      return test_binary(args[0], args[1], args[2], name); // Reports the bad operator
+    case 4:
+      if (negated) break;
+      /* fall through */
+    default:
+      fprintf(stderr, "%s: too many arguments\n", name);
+      return 2;
+  }
+
+  result = test_expr(args + 1, n - 1, name);
+  return result == 2 ? 2 : !result;
+}
+
+// test EXPR / [ EXPR ]: a single string, unary file and string tests,
+// string and integer comparisons, each optionally negated with "!".
+static int builtin_test(char **argv, int input_fd, int output_fd) {
+  int argc = 0;
+  while (argv[argc]) argc++;
+
+  if (strcmp(argv[0], "[") == 0) {
+    if (strcmp(argv[argc - 1], "]") != 0) {
+      fprintf(stderr, "[: missing `]'\n");
+      return 2;
+    }
+    argc--;
+  }
+  return test_expr(argv + 1, argc - 1, argv[0]);
+}
+
+static const Builtin builtin_table[] = {
+  {"echo",   builtin_echo,   "echo [-n] [args...]\n  Prints its arguments separated by spaces (-n: without the trailing newline)."},
+  {"cat",    builtin_cat,    "cat [FILE...]\n  Copies the files (or stdin, also for -) to stdout. With any options, the cat on PATH runs instead.", builtin_cat_accepts},
+  {"env",    builtin_env,    "env\n  Prints the exported variables."},
+  {"export", builtin_export, "export [NAME[=VALUE]...]\n  Passes variables on to the commands the shell starts. Lists them when given no names.", NULL, builtin_export_isolated},
+  {"unset",  builtin_unset,  "unset NAME...\n  Removes shell variables.", NULL, builtin_unset_isolated},
+  {"cd",     builtin_cd,     "cd [DIR | -]\n  Changes the working directory ($HOME by default, $OLDPWD for -).", NULL, builtin_cd_isolated},
+  {"time",   builtin_time,   "time PIPELINE\n  Runs PIPELINE, then reports the wall and CPU time (and peak memory of external commands) of each stage on stderr."},
+  {"true",   builtin_true,   "true\n  Exits with 0."},
+  {"false",  builtin_false,  "false\n  Exits with 1."},
+  {"test",   builtin_test,   "test EXPR\n  Exits with 0 if EXPR is true: STRING, -n/-z STRING, -e/-f/-d/-s/-r/-w/-x/-L FILE,\n  S1 = S2, S1 != S2, N1 -eq/-ne/-lt/-le/-gt/-ge N2, optionally preceded by !."},
+  {"[",      builtin_test,   "[ EXPR ]\n  Same as test, with a closing ]."},
+  {NULL, NULL, NULL}
+};
+
+const Builtin* find_builtin(const char *name) {
+  for (const Builtin *b = builtin_table; b->name; b++) {
+    if (b->name[0] == name[0] && strcmp(b->name, name) == 0) return b;
+  }
+  return NULL;
+}
+
+static int is_builtin_name(const char *name) {
+  return find_builtin(name) != NULL;
+}
+
+// Python calls this: shell_core.get_builtins() -> {"echo": "echo [-n] [args...]\n  ...", ...}
+static PyObject* shell_get_builtins(PyObject *self, PyObject *args) {
+  PyObject *dict = PyDict_New();
+  if (!dict) return NULL;
+
+  for (const Builtin *b = builtin_table; b->name; b++) {
+    PyObject *usage = PyUnicode_FromString(b->usage);
+    if (!usage || PyDict_SetItemString(dict, b->name, usage) != 0) {
+      Py_XDECREF(usage);
+      Py_DECREF(dict);
+      return NULL;
+    }
+    Py_DECREF(usage);
+  }
+  return dict;
+}
+
+// --- PIPELINE SCHEDULER ---
+// A Python stage that feeds a pipe runs on its own thread so it overlaps with
+// the stages after it; running it to completion first would deadlock as soon
+// as its output outgrew the kernel pipe buffer. The thread takes the GIL like
+// any other Python thread and gives it up whenever it blocks on pipe I/O.
+
+typedef struct PythonStage {
+  PyCommand cmd;            // Snapshot of the registry entry; holds its own func reference
+  BuiltinFunc builtin;      // Set instead of cmd for a builtin stage
+  StageStats *stats;        // Filled in by the worker when the pipeline is traced (may be NULL)
+  char **argv;
+  int owns_argv;            // argv is a copy_argv() block freed with the stage
+  int input_fd;
+  int output_fd;
+  int close_in;             // Worker closes input_fd when done
+  int close_out;            // Worker closes output_fd when done (so readers see EOF)
+  int exit_code;
+  StageIO io;               // Object handover from the previous stage (references held)
+  PyThread_type_lock done;  // Held until the worker finishes
+} PythonStage;
+
+static void python_stage_main(void *arg) {
+  PythonStage *stage = arg;
+
+  PyGILState_STATE gil = PyGILState_Ensure();
+  double user0 = 0, sys0 = 0;
+  if (stage->stats) thread_cpu_seconds(&user0, &sys0);
+  if (stage->builtin) stage->exit_code = stage->builtin(stage->argv, stage->input_fd, stage->output_fd);
+  else stage->exit_code = run_python_command(&stage->cmd, stage->argv, stage->input_fd, stage->output_fd, &stage->io);
+  if (stage->stats) stage_stats_finish(stage->stats, user0, sys0, stage->exit_code);
+  Py_CLEAR(stage->cmd.func);
+  Py_CLEAR(stage->cmd.name_obj);
+  Py_CLEAR(stage->io.input);
+  Py_CLEAR(stage->io.upstream);
+  PyGILState_Release(gil);
+
+  if (stage->close_in) close(stage->input_fd);
+  if (stage->close_out) close(stage->output_fd);
+  PyThread_release_lock(stage->done);
+}
+
+static PythonStage* new_stage(char **argv, int input_fd, int output_fd, int close_in, int close_out, StageStats *stats) {
+  PythonStage *stage = calloc(1, sizeof(PythonStage));
+  if (!stage) return NULL;
+  stage->stats = stats;
+  stage->argv = argv;
+  stage->input_fd = input_fd;
+  stage->output_fd = output_fd;
+  stage->close_in = close_in;
+  stage->close_out = close_out;
+  return stage;
+}
+
+// Starts the worker thread for a filled-in stage, or frees it, dropping its references.
+static PythonStage* start_stage_thread(PythonStage *stage) {
+  stage->done = PyThread_allocate_lock();
+
+  if (stage->done) {
+    PyThread_acquire_lock(stage->done, WAIT_LOCK);
+    if (PyThread_start_new_thread(python_stage_main, stage) != PYTHREAD_INVALID_THREAD_ID) {
+      return stage;
+    }
+    PyThread_free_lock(stage->done);
+  }
+
+  Py_XDECREF(stage->cmd.func);
+  Py_XDECREF(stage->cmd.name_obj);
+  Py_XDECREF(stage->io.input);
+  Py_XDECREF(stage->io.upstream);
+  free(stage);
+  return NULL;
+}
+
+// Starts `cmd` on a worker thread. On success the worker takes ownership of
+// the fds flagged in close_in/close_out. `handover` (may be NULL) is the
+// previous stage's output in object mode, `stats` (may be NULL) where its timings
+// go. Returns NULL if no thread could be started.
+PythonStage* start_python_stage(PyCommand *cmd, char **argv, int input_fd, int output_fd, int close_in, int close_out,
+                                const StageIO *handover, StageStats *stats) {
+  PythonStage *stage = new_stage(argv, input_fd, output_fd, close_in, close_out, stats);
+  if (!stage) return NULL;
+
+  stage->cmd = *cmd;
+  Py_INCREF(stage->cmd.func);
+  Py_INCREF(stage->cmd.name_obj);
+  if (handover) {
+    stage->io.input = handover->input;
+    stage->io.upstream = handover->upstream;
+    Py_XINCREF(stage->io.input);
+    Py_XINCREF(stage->io.upstream);
+  }
+  return start_stage_thread(stage);
+}
+
+// Same for a builtin.
+PythonStage* start_builtin_stage(BuiltinFunc builtin, char **argv, int input_fd, int output_fd, int close_in, int close_out,
+                                 StageStats *stats) {
+  PythonStage *stage = new_stage(argv, input_fd, output_fd, close_in, close_out, stats);
+  if (!stage) return NULL;
+
+  stage->builtin = builtin;
+  return start_stage_thread(stage);
+}
+
+// Waits for the worker (the caller must have released the GIL) and frees it.
+int join_python_stage(PythonStage *stage) {
+  PyThread_acquire_lock(stage->done, WAIT_LOCK);
+  PyThread_release_lock(stage->done);
+  PyThread_free_lock(stage->done);
+
+  int exit_code = stage->exit_code;
+  if (stage->owns_argv) free(stage->argv);
+  free(stage);
+  return exit_code;
+}
+
+// True once the worker is done; never blocks.
+int python_stage_finished(PythonStage *stage) {
+  if (!PyThread_acquire_lock(stage->done, NOWAIT_LOCK)) return 0;
+  PyThread_release_lock(stage->done);
+  return 1;
+}
+
+// Copies an argv into a single malloc'd block, for stages that outlive the line.
+char** copy_argv(char **argv) {
+  int argc = 0;
+  size_t text_size = 0;
+  while (argv[argc]) text_size += strlen(argv[argc++]) + 1;
+
+  char **copy = malloc(sizeof(char*) * (argc + 1) + text_size);
+  if (!copy) return NULL;
+
+  char *text = (char*)(copy + argc + 1);
+  for (int i = 0; i < argc; i++) {
+    size_t n = strlen(argv[i]) + 1;
+    memcpy(text, argv[i], n);
+    copy[i] = text;
+    text += n;
+  }
+  copy[argc] = NULL;
+  return copy;
+}
+
+// Everything a launched pipeline leaves behind to wait for.
+typedef struct PipelineRun {
+  pid_t *pids;
+  int pid_count;
+  PythonStage **workers;
+  int worker_count;
+  pid_t pgid;               // Background only: process group of the external stages
+  pid_t last_stage_pid;     // Only the last stage decides the pipeline's exit code
+  PythonStage *last_worker; // Background only: the last stage runs on a worker too
+  int last_exit_code;
+  int timed;                // Started with `time`: report on stderr when done
+  StageStats *stats;        // Per-stage timings when traced (foreground only), else NULL
+  int stats_count;
+  double start;
+} PipelineRun;
+
+// Claims the next stats record for a stage about to start; NULL when untraced.
+static StageStats* begin_stage_stats(PipelineRun *run, char **argv, StageKind kind, Arena *arena) {
+  if (!run->stats) return NULL;
+
+  StageStats *st = &run->stats[run->stats_count++];
+  memset(st, 0, sizeof(*st));
+  st->kind = kind;
+  st->max_rss_kb = -1;
+
+  StrBuf command;
+  sb_init_arena(&command, arena);
+  for (int k = 0; argv[k]; k++) {
+    if (k > 0) sb_append(&command, " ", 1);
+    sb_append(&command, argv[k], strlen(argv[k]));
+  }
+  st->command = sb_detach(&command);
+  st->start = monotonic_seconds();
+  return st;
+}
+
+static StageStats* find_pid_stats(PipelineRun *run, pid_t pid) {
+  for (int k = 0; k < run->stats_count; k++) {
+    if (run->stats[k].kind == STAGE_EXTERNAL && run->stats[k].pid == pid) return &run->stats[k];
+  }
+  return NULL;
+}
+
+// `time` output: the totals, then one line per stage.
+static void print_time_report(PipelineRun *run, double end) {
+  double user = 0, sys = 0, python_cpu = 0, external_cpu = 0;
+  for (int k = 0; k < run->stats_count; k++) {
+    StageStats *st = &run->stats[k];
+    user += st->user;
+    sys += st->sys;
+    if (st->kind == STAGE_EXTERNAL) external_cpu += st->user + st->sys;
+    else python_cpu += st->user + st->sys;
+  }
+
+  fprintf(stderr, "real %.3fs  user %.3fs  sys %.3fs  (in-process %.3fs, external %.3fs CPU)\n",
+          end - run->start, user, sys, python_cpu, external_cpu);
+  for (int k = 0; k < run->stats_count; k++) {
+    StageStats *st = &run->stats[k];
+    char rss[32] = "-";
+    if (st->max_rss_kb >= 0) snprintf(rss, sizeof(rss), "%ldkB", st->max_rss_kb);
+    fprintf(stderr, "  %8.3fs %8.3fs %8.3fs %10s  %-8s  %s\n", st->end - st->start, st->user, st->sys,
+            rss, stage_kind_names[st->kind], st->command);
+  }
+}
+
+// Hands the pipeline's record to the trace hook:
+// {"command", "wall", "exit_code", "stages": [{"command", "kind", "pid", "wall",
+//  "user", "sys", "max_rss_kb", "exit_code"}, ...]}
+static void call_trace_hook(PipelineRun *run, double end, int exit_code) {
+  PyObject *stages = PyList_New(run->stats_count);
+  if (!stages) {
+    PyErr_WriteUnraisable(trace_hook);
+    return;
+  }
+
+  StrBuf command;
+  sb_init(&command);
+  for (int k = 0; k < run->stats_count; k++) {
+    StageStats *st = &run->stats[k];
+    if (k > 0) sb_append(&command, " | ", 3);
+    sb_append(&command, st->command, strlen(st->command));
+
+    PyObject *pid = st->pid > 0 ? PyLong_FromLong((long)st->pid) : Py_BuildValue("");
+    PyObject *rss = st->max_rss_kb >= 0 ? PyLong_FromLong(st->max_rss_kb) : Py_BuildValue("");
+    PyObject *stage = Py_BuildValue("{s:N,s:s,s:N,s:d,s:d,s:d,s:N,s:i}",
+                                    "command", PyUnicode_DecodeFSDefault(st->command),
+                                    "kind", stage_kind_names[st->kind],
+                                    "pid", pid,
+                                    "wall", st->end - st->start,
+                                    "user", st->user,
+                                    "sys", st->sys,
+                                    "max_rss_kb", rss,
+                                    "exit_code", st->exit_code);
+    if (!stage) {
+      free(command.data);
+      Py_DECREF(stages);
+      PyErr_WriteUnraisable(trace_hook);
+      return;
+    }
+    PyList_SET_ITEM(stages, k, stage);
+  }
+
+  PyObject *record = Py_BuildValue("{s:N,s:d,s:i,s:N}",
+                                   "command", PyUnicode_DecodeFSDefaultAndSize(command.data ? command.data : "", command.len),
+                                   "wall", end - run->start,
+                                   "exit_code", exit_code,
+                                   "stages", stages);
+  free(command.data);
+  if (!record) {
+    PyErr_WriteUnraisable(trace_hook);
+    return;
+  }
+
+  // Hold our own reference: the hook may replace itself
+  PyObject *hook = trace_hook;
+  Py_INCREF(hook);
+  in_trace_hook = 1;
+  PyObject *result = PyObject_CallFunctionObjArgs(hook, record, NULL);
+  in_trace_hook = 0;
+  if (result) Py_DECREF(result);
+  else PyErr_WriteUnraisable(hook);
+  Py_DECREF(hook);
+  Py_DECREF(record);
+}
+
+// First word of the stage after the pipe at tokens[pipe_index], skipping redirections.
+static const char* next_stage_name(const Token *tokens, int pipe_index, int count, const char *text) {
+  for (int j = pipe_index + 1; j < count && tokens[j].kind != TOK_PIPE; j++) {
+    if (tokens[j].kind == TOK_WORD) return text + tokens[j].offset;
+    j++; // A redirection: skip its file name as well
+  }
+  return NULL;
+}
+
+// Starts every stage of a slice of tokens that only contains commands, pipes
+// (|) and redirections. A foreground pipeline keeps its bookkeeping in the
+// arena; a background one (background = 1) outlives the line, so it mallocs
+// it and every Python stage runs on a worker with its own copies of argv and fds.
+static void launch_pipeline(const Token *tokens, int count, const char *text, int default_in, int default_out,
+                            Arena *arena, int background, PipelineRun *run) {
+  int i = 0;
+  int prev_fd = default_in;
+  int pipe_fds[2];
+
+  memset(run, 0, sizeof(*run));
+
+  // `time` in front of a pipeline is a keyword, not a command
+  if (count > 0 && tokens[0].kind == TOK_WORD && strcmp(text + tokens[0].offset, "time") == 0) {
+    run->timed = !background;
+    i = 1;
+  }
+
+  // One slot per stage
+  int stage_count = 1;
+  for (int j = 0; j < count; j++) {
+    if (tokens[j].kind == TOK_PIPE) stage_count++;
+  }
+  if (background) {
+    run->pids = calloc(stage_count, sizeof(pid_t));
+    run->workers = calloc(stage_count, sizeof(PythonStage*));
+  } else {
+    run->pids = arena_alloc(arena, sizeof(pid_t) * stage_count);
+    run->workers = arena_alloc(arena, sizeof(PythonStage*) * stage_count);
+    if (run->timed || (trace_hook && !in_trace_hook)) {
+      run->stats = arena_alloc(arena, sizeof(StageStats) * stage_count);
+      run->start = monotonic_seconds();
+    }
+  }
+  if (!run->pids || !run->workers) {
+    fprintf(stderr, "shell: out of memory\n");
+    run->last_exit_code = 1;
+    return;
+  }
+  pid_t pgroup = background ? 0 : -1;
+  StageIO handover = {0}; // Object mode: what the previous stage left for the next one
+
+  while (i < count) {
+    // No stage can have more arguments than the pipeline has tokens
+    char **cmd_argv = arena_alloc(arena, sizeof(char*) * (count + 1));
+    int cmd_argc = 0;
+
+    int redirect_in_fd = -1;
+    int redirect_out_fd = -1;
+
+    // Extract arguments and handle redirection until we hit a pipe or the end
+    while (i < count && tokens[i].kind != TOK_PIPE) {
+      const char *token_text = text + tokens[i].offset;
+
+      switch (tokens[i].kind) {
+        case TOK_REDIR_IN:
+        case TOK_REDIR_OUT:
+        case TOK_REDIR_APPEND: {
+          if (i + 1 < count && tokens[i+1].kind == TOK_WORD) {
+            const char *file = text + tokens[i+1].offset;
+            if (tokens[i].kind == TOK_REDIR_IN) {
+              redirect_in_fd = open(file, O_RDONLY | O_CLOEXEC);
+              if (redirect_in_fd < 0) perror(file);
+            } else {
+              int mode = (tokens[i].kind == TOK_REDIR_OUT) ? O_TRUNC : O_APPEND;
+              redirect_out_fd = open(file, O_WRONLY | O_CREAT | mode | O_CLOEXEC, FILE_MODE);
+              if (redirect_out_fd < 0) perror(file);
+            }
+            i += 2; // Skip operator and filename
+          } else {
+            fprintf(stderr, "syntax error near unexpected token `%s'\n", token_text);
+            i++;
+          }
+          break;
+        }
+
+        default:
+          // Normal argument
+          cmd_argv[cmd_argc++] = (char*)token_text;
+          i++;
+          break;
+      }
+    }
+    cmd_argv[cmd_argc] = NULL;
+
+    // Skip execution if no command was given (e.g., just "> file.txt")
+    if (cmd_argc == 0) {
+      if (redirect_in_fd != -1) close(redirect_in_fd);
+      if (redirect_out_fd != -1) close(redirect_out_fd);
+      if (i < count && tokens[i].kind == TOK_PIPE) i++;
+      continue;
+    }
+
+    // --- PIPELINE SETUP ---
+    int input_fd = prev_fd;
+    int output_fd = default_out;
+    int has_next = (i < count && tokens[i].kind == TOK_PIPE);
+    const Builtin *builtin = find_builtin(cmd_argv[0]);
+    if (builtin && builtin->accepts && !builtin->accepts(cmd_argv)) builtin = NULL;
+    BuiltinFunc builtin_run = NULL;
+    if (builtin) builtin_run = (builtin->isolated && (background || stage_count > 1)) ? builtin->isolated : builtin->run;
+    PyCommand *py_cmd = builtin ? NULL : find_python_command(cmd_argv[0]);
+
+    // Object mode: a Python stage feeding another Python stage skips the pipe
+    int object_out = 0;
+    if (opt_object_pipes && !background && py_cmd && has_next && redirect_out_fd == -1) {
+      const char *next = next_stage_name(tokens, i, count, text);
+      object_out = next && !find_builtin(next) && find_python_command(next) && init_call_cache() == 0;
+    }
+    int piped = has_next && !object_out;
+
+    if (piped) {
+      if (make_pipe(pipe_fds) == -1) { perror("pipe"); exit(1); }
+      output_fd = pipe_fds[1]; // By default, write to the pipe
+    }
+
+    // --- REDIRECTION OVERRIDES ---
+    // If the user specified a file, it overrides the pipe or default streams
+    if (redirect_in_fd != -1) {
+      input_fd = redirect_in_fd;
+    }
+    if (redirect_out_fd != -1) {
+      // If there's a pipe AND file output (cmd > file | cmd2),
+      // we still open the pipe for the next command, but THIS command writes to the file.
+      output_fd = redirect_out_fd;
+    }
+
+    // --- EXECUTION ---
+    int close_in = (input_fd != default_in);
+    int close_out = (output_fd != default_out);
+
+    // Input handed over by the previous stage; an explicit < file still wins for stdin
+    StageIO incoming = {0};
+    StageIO *stage_io = NULL;
+    if (handover.input) {
+      incoming.input = redirect_in_fd == -1 ? handover.input : NULL;
+      incoming.upstream = handover.upstream;
+      stage_io = &incoming;
+    }
+
+    if (object_out) {
+      // Run it now, capturing its text and keeping its return value for the next stage
+      StageIO io = incoming;
+      io.output = PyObject_CallObject(io_stringio, NULL);
+      io.keep_result = 1;
+      StageStats *st = begin_stage_stats(run, cmd_argv, STAGE_PYTHON, arena);
+      double user0 = 0, sys0 = 0;
+      if (st) thread_cpu_seconds(&user0, &sys0);
+      if (io.output) {
+        run->last_exit_code = run_python_command(py_cmd, cmd_argv, input_fd, output_fd, &io);
+        PyObject *rewound = PyObject_CallMethod(io.output, "seek", "i", 0);
+        if (rewound) Py_DECREF(rewound);
+        else PyErr_Clear();
+      } else {
+        PyErr_Print();
+        run->last_exit_code = 1;
+      }
+      if (st) stage_stats_finish(st, user0, sys0, run->last_exit_code);
+      run->last_stage_pid = 0;
+
+      Py_XSETREF(handover.input, io.output);
+      Py_XSETREF(handover.upstream, io.result);
+      if (handover.upstream == Py_None) Py_CLEAR(handover.upstream);
+      if (!handover.input) Py_CLEAR(handover.upstream);
+      stage_io = NULL; // Already passed on
+    } else if ((py_cmd || builtin) && (has_next || background)) {
+      // Feeds another stage (or nobody waits for it): run it alongside the
+      // rest of the pipeline. A foreground stage's argv lives in the arena,
+      // which outlasts the worker; a background stage gets copies of
+      // everything it uses, since the line is gone before it finishes.
+      char **stage_argv = background ? copy_argv(cmd_argv) : cmd_argv;
+      if (background && !close_in) { input_fd = dup_cloexec(input_fd); close_in = 1; }
+      if (background && !close_out) { output_fd = dup_cloexec(output_fd); close_out = 1; }
+
+      if (run->worker_count == 0) install_stream_routers();
+      StageStats *st = begin_stage_stats(run, cmd_argv, builtin ? STAGE_BUILTIN : STAGE_PYTHON, arena);
+      PythonStage *stage = NULL;
+      if (stage_argv && builtin) stage = start_builtin_stage(builtin_run, stage_argv, input_fd, output_fd, close_in, close_out, st);
+      else if (stage_argv) stage = start_python_stage(py_cmd, stage_argv, input_fd, output_fd, close_in, close_out, stage_io, st);
+      if (stage) {
+        stage->owns_argv = background;
+        run->workers[run->worker_count++] = stage;
+        run->last_worker = has_next ? NULL : stage;
+        run->last_stage_pid = 0;
+        close_in = close_out = 0; // Now owned by the worker
+      } else {
+        if (run->worker_count == 0) uninstall_stream_routers();
+        if (background) free(stage_argv);
+        fprintf(stderr, "%s: could not start pipeline thread\n", cmd_argv[0]);
+        if (st) stage_stats_finish(st, 0, 0, 1);
+      }
+    } else if (builtin || py_cmd) {
+      StageStats *st = begin_stage_stats(run, cmd_argv, builtin ? STAGE_BUILTIN : STAGE_PYTHON, arena);
+      double user0 = 0, sys0 = 0;
+      if (st) thread_cpu_seconds(&user0, &sys0);
+      if (builtin) run->last_exit_code = builtin_run(cmd_argv, input_fd, output_fd);
+      else run->last_exit_code = run_python_command(py_cmd, cmd_argv, input_fd, output_fd, stage_io);
+      if (st) stage_stats_finish(st, user0, sys0, run->last_exit_code);
+      run->last_stage_pid = 0;
+    } else {
+      StageStats *st = begin_stage_stats(run, cmd_argv, STAGE_EXTERNAL, arena);
+      pid_t pid = spawn_command(cmd_argv, input_fd, output_fd, pgroup);
+      if (st) {
+        st->pid = pid;
+        if (pid <= 0) {
+          st->end = monotonic_seconds();
+          st->exit_code = 127;
+        }
+      }
+      if (pid > 0) {
+        run->pids[run->pid_count++] = pid;
+        run->last_stage_pid = pid;
+        run->last_worker = NULL;
+        if (pgroup == 0) pgroup = run->pgid = pid; // The rest of the pipeline joins the first stage
+      } else {
+        run->last_exit_code = 127; // Command not found / not executable
+        run->last_stage_pid = 0;
+        run->last_worker = NULL;
+      }
+    }
+
+    // --- CLEANUP FDs IN PARENT ---
+    // Close whatever this stage used that wasn't handed to a worker
+    if (close_in) close(input_fd);
+    if (close_out) close(output_fd);
+
+    // Pipe ends that lost to a file redirection are never used
+    if (prev_fd != default_in && prev_fd != input_fd) close(prev_fd);
+    if (piped && pipe_fds[1] != output_fd) close(pipe_fds[1]);
+    if (stage_io) {
+      Py_CLEAR(handover.input); // Consumed (the worker holds its own references)
+      Py_CLEAR(handover.upstream);
+    }
+
+    // --- ADVANCE TO NEXT PIPELINE STAGE ---
+    if (has_next) {
+      prev_fd = piped ? pipe_fds[0] : default_in; // Next command reads from the pipe
+      i++; // Skip the "|" token
+    }
+  }
+
+  Py_CLEAR(handover.input);
+  Py_CLEAR(handover.upstream);
+
+}
+
+// Waits for external stage `j` (which may already have exited), records its
+// stats when traced, and updates `last_exit_code` if it's the last stage.
+static void reap_external_stage(PipelineRun *run, int j, int *last_exit_code) {
+  pid_t pid = run->pids[j];
+  StageStats *st = run->stats ? find_pid_stats(run, pid) : NULL;
+#ifdef _WIN32
+  int status;
+  _cwait(&status, pid, 0);
+  if (pid == run->last_stage_pid) *last_exit_code = status;
+  if (st) {
+    st->end = monotonic_seconds();
+    st->exit_code = status;
+    // The "pid" _spawnvpe returns is the process handle
+    FILETIME created, exited, kernel, user, now;
+    if (GetProcessTimes((HANDLE)pid, &created, &exited, &kernel, &user)) {
+      st->user = (((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime) / 1e7;
+      st->sys = (((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) / 1e7;
+      // When it really exited, not when we got around to it
+      GetSystemTimeAsFileTime(&now);
+      uint64_t exit_time = ((uint64_t)exited.dwHighDateTime << 32) | exited.dwLowDateTime;
+      uint64_t now_time = ((uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime;
+      if (now_time > exit_time) st->end -= (now_time - exit_time) / 1e7;
+    }
+  }
+#else
+  int status = 0;
+  struct rusage usage;
+  int code = 0;
+  while (wait4(pid, &status, 0, &usage) == -1 && errno == EINTR);
+  if (WIFEXITED(status)) code = WEXITSTATUS(status);
+  else if (WIFSIGNALED(status)) code = 128 + WTERMSIG(status);
+  if (pid == run->last_stage_pid) *last_exit_code = code;
+  if (st) {
+    st->end = monotonic_seconds();
+    st->user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    st->sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#if defined(__APPLE__)
+    st->max_rss_kb = usage.ru_maxrss / 1024; // Bytes on macOS
+#elif !defined(__linux__)
+    st->max_rss_kb = usage.ru_maxrss;
+#endif
+    st->exit_code = code;
+  }
+#endif
+  run->pids[j] = 0;
+}
+
+#if defined(__linux__) && defined(SYS_pidfd_open)
+// Reaps a traced pipeline's external stages in the order they exit, so a
+// stage that finishes early isn't stamped with the end of a slower one
+// before it. Whatever can't be watched is left for the in-order pass.
+static void reap_stages_in_exit_order(PipelineRun *run, int *last_exit_code) {
+  struct pollfd *fds = malloc(sizeof(struct pollfd) * run->pid_count);
+  int *stage = malloc(sizeof(int) * run->pid_count);
+  int watched = 0;
+  for (int j = 0; fds && stage && j < run->pid_count; j++) {
+    if (run->pids[j] <= 0) continue;
+    int fd = (int)syscall(SYS_pidfd_open, run->pids[j], 0);
+    if (fd < 0) break; // Not supported by this kernel
+    fds[watched].fd = fd;
+    fds[watched].events = POLLIN;
+    stage[watched++] = j;
+  }
+
+  int pending = watched;
+  while (pending > 0) {
+    if (poll(fds, (nfds_t)watched, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    for (int k = 0; k < watched; k++) {
+      if (fds[k].fd < 0 || !(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+      reap_external_stage(run, stage[k], last_exit_code);
+      close(fds[k].fd);
+      fds[k].fd = -1; // poll() ignores it from now on
+      pending--;
+    }
+  }
+  for (int k = 0; k < watched; k++) if (fds[k].fd >= 0) close(fds[k].fd);
+  free(fds);
+  free(stage);
+}
+#endif
+
+// Waits for a foreground pipeline and returns its exit code.
+static int wait_pipeline(PipelineRun *run) {
+  int pid_count = run->pid_count;
+  PythonStage **workers = run->workers;
+  int worker_count = run->worker_count;
+  int last_exit_code = run->last_exit_code;
+
+  // Wait for all children and capture the exit code of the last command.
+  // Give up the GIL while blocking: Python workers need it to make progress,
+  // and background Python threads shouldn't stall behind an external command.
+  PyThreadState *saved_state = PyEval_SaveThread();
+
+#if defined(__linux__) && defined(SYS_pidfd_open)
+  if (run->stats && pid_count > 1) reap_stages_in_exit_order(run, &last_exit_code);
+#endif
+  for (int j = 0; j < pid_count; j++) {
+    if (run->pids[j] > 0) reap_external_stage(run, j, &last_exit_code);
+  }
+
+  for (int j = 0; j < worker_count; j++) {
+    join_python_stage(workers[j]); // Never the last stage, so its code isn't $?
+  }
+
+  PyEval_RestoreThread(saved_state);
+  if (worker_count > 0) uninstall_stream_routers();
+
+  if (run->stats) {
+    double end = monotonic_seconds();
+    if (run->timed) print_time_report(run, end);
+    if (trace_hook && !in_trace_hook) call_trace_hook(run, end, last_exit_code);
+  }
+  return last_exit_code;
+}
+
+// Python calls this: shell_core.set_trace_hook(fn) (None removes it)
+// fn receives one dict per foreground pipeline once it has finished.
+static PyObject* shell_set_trace_hook(PyObject *self, PyObject *args) {
+  PyObject *hook;
+
+  if (!PyArg_ParseTuple(args, "O", &hook)) {
+    return NULL;
+  }
+  if (hook != Py_None && !PyCallable_Check(hook)) {
+    PyErr_SetString(PyExc_TypeError, "trace hook must be callable or None");
+    return NULL;
+  }
+
+  Py_XINCREF(hook == Py_None ? NULL : hook);
+  Py_XSETREF(trace_hook, hook == Py_None ? NULL : hook);
+  Py_RETURN_NONE;
+}
+
+// Helper: Executes a slice of tokens that only contains commands and pipes (|)
+int execute_simple_pipeline(const Token *tokens, int count, const char *text, int default_in, int default_out, Arena *arena) {
+  PipelineRun run;
+  launch_pipeline(tokens, count, text, default_in, default_out, arena, 0, &run);
+  return wait_pipeline(&run);
+}
+
+
+// --- BACKGROUND JOBS ---
+// A pipeline followed by "&" is launched without waiting and parked in the
+// job table. Finished stages are collected without blocking before each
+// prompt (and by jobs/wait/fg): external commands only once SIGCHLD says a
+// child exited, Python workers by polling their done locks.
+
+typedef struct Job {
+  int id;
+  char *command;     // Shown by `jobs`
+  PipelineRun run;
+  int running;       // Stages not collected yet
+  int workers_left;  // Python workers among them
+  int exit_code;
+} Job;
+
+static Job **job_table = NULL;
+static int job_count = 0;
+static int job_capacity = 0;
+static int shell_interactive = 0; // Inside shell_core.start(): report job starts and completions
+static volatile sig_atomic_t child_exited = 0;
+
+#ifndef _WIN32
+static struct sigaction previous_sigchld;
+static int sigchld_installed = 0;
+
+static void sigchld_handler(int signo, siginfo_t *info, void *context) {
+  child_exited = 1;
+
+  // Whoever handled SIGCHLD before us still gets told
+  if (previous_sigchld.sa_flags & SA_SIGINFO) {
+    if (previous_sigchld.sa_sigaction) previous_sigchld.sa_sigaction(signo, info, context);
+  } else if (previous_sigchld.sa_handler != SIG_DFL && previous_sigchld.sa_handler != SIG_IGN) {
+    previous_sigchld.sa_handler(signo);
+  }
+}
+
+static void install_sigchld_handler(void) {
+  if (sigchld_installed) return;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = sigchld_handler;
+  action.sa_flags = SA_SIGINFO | SA_RESTART | SA_NOCLDSTOP;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGCHLD, &action, &previous_sigchld) == 0) sigchld_installed = 1;
+}
+#endif
+
+static void free_job(Job *job) {
+  free(job->command);
+  free(job->run.pids);
+  free(job->run.workers);
+  free(job);
+}
+
+// Joins the token texts back into something readable for `jobs`.
+static char* job_command_text(const Token *tokens, int count, const char *text) {
+  StrBuf command;
+  sb_init(&command);
+  for (int i = 0; i < count; i++) {
+    if (i > 0) sb_append(&command, " ", 1);
+    sb_append(&command, text + tokens[i].offset, tokens[i].length);
+  }
+  return sb_detach(&command);
+}
+
+// Starts a pipeline in the background and adds it to the job table.
+// Returns the exit status for $? (0 unless the job could not be started).
+int start_background_job(const Token *tokens, int count, const char *text, int default_out, Arena *arena) {
+  for (int i = 0; i < count; i++) {
+    if (tokens[i].kind == TOK_AND || tokens[i].kind == TOK_OR) {
+      fprintf(stderr, "shell: only a single pipeline can run in the background\n");
+      return 2;
+    }
+  }
+
+  if (job_count == job_capacity) {
+    int new_capacity = job_capacity ? job_capacity * 2 : 8;
+    Job **grown = realloc(job_table, sizeof(Job*) * new_capacity);
+    if (!grown) return 1;
+    job_table = grown;
+    job_capacity = new_capacity;
+  }
+
+  Job *job = calloc(1, sizeof(Job));
+  if (!job) return 1;
+
+#ifndef _WIN32
+  install_sigchld_handler();
+#endif
+
+  // Like a non-interactive sh, background jobs don't read the terminal
+#ifdef _WIN32
+  int null_in = open("NUL", O_RDONLY | O_CLOEXEC);
+#else
+  int null_in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+#endif
+  launch_pipeline(tokens, count, text, null_in, default_out, arena, 1, &job->run);
+  if (null_in >= 0) close(null_in);
+
+  job->running = job->run.pid_count + job->run.worker_count;
+  job->workers_left = job->run.worker_count;
+  job->exit_code = job->run.last_exit_code;
+  if (job->running == 0) {
+    // Nothing actually started (e.g. command not found)
+    int exit_code = job->exit_code;
+    free_job(job);
+    return exit_code;
+  }
+
+  job->id = job_count ? job_table[job_count - 1]->id + 1 : 1;
+  job->command = job_command_text(tokens, count, text);
+  job_table[job_count++] = job;
+
+  if (shell_interactive) {
+    if (job->run.last_stage_pid > 0) fprintf(stderr, "[%d] %ld\n", job->id, (long)job->run.last_stage_pid);
+    else fprintf(stderr, "[%d]\n", job->id);
+  }
+  return 0;
+}
+
+// Collects the job's finished stages. With `block`, waits for all of them
+// with the GIL released, stopping early if a signal interrupts the wait.
+static void collect_job(Job *job, int block) {
+  PipelineRun *run = &job->run;
+  PyThreadState *saved_state = block ? PyEval_SaveThread() : NULL;
+
+  for (int j = 0; j < run->pid_count; j++) {
+    if (run->pids[j] == 0) continue;
+
+    int exit_code;
+#ifdef _WIN32
+    int status;
+    if (!block && WaitForSingleObject((HANDLE)(intptr_t)run->pids[j], 0) != WAIT_OBJECT_0) continue;
+    _cwait(&status, run->pids[j], 0);
+    exit_code = status;
+#else
+    int status = 0;
+    pid_t got = waitpid(run->pids[j], &status, block ? 0 : WNOHANG);
+    if (got == 0) continue; // Still running
+    if (got < 0 && errno == EINTR) break;
+
+    exit_code = 0;
+    if (got < 0) exit_code = 127; // Somebody else reaped it; the status is lost
+    else if (WIFEXITED(status)) exit_code = WEXITSTATUS(status);
+    else if (WIFSIGNALED(status)) exit_code = 128 + WTERMSIG(status);
+#endif
+
+    if (run->pids[j] == run->last_stage_pid) job->exit_code = exit_code;
+    run->pids[j] = 0;
+    job->running--;
+  }
+
+  for (int j = 0; j < run->worker_count; j++) {
+    PythonStage *stage = run->workers[j];
+    if (stage == NULL) continue;
+    if (!block && !python_stage_finished(stage)) continue;
+
+    int is_last = (stage == run->last_worker);
+    int exit_code = join_python_stage(stage);
+    if (is_last) job->exit_code = exit_code;
+    run->workers[j] = NULL;
+    job->running--;
+    job->workers_left--;
+  }
+
+  if (block) PyEval_RestoreThread(saved_state);
+  if (run->worker_count > 0 && job->workers_left == 0) {
+    uninstall_stream_routers();
+    run->worker_count = 0; // Released once
+  }
+}
+
+// Non-blocking sweep over every running job. Needs the GIL.
+static void reap_jobs(void) {
+#ifdef _WIN32
+  int children = 1; // No SIGCHLD; poll the process handles
+#else
+  int children = child_exited;
+  child_exited = 0;
+#endif
+
+  for (int i = 0; i < job_count; i++) {
+    Job *job = job_table[i];
+    if (job->running > 0 && (children || job->workers_left > 0)) collect_job(job, 0);
+  }
+}
+
+static void remove_job(int index) {
+  free_job(job_table[index]);
+  memmove(&job_table[index], &job_table[index + 1], sizeof(Job*) * (job_count - index - 1));
+  job_count--;
+}
+
+// Reports finished jobs at the prompt, like bash's "[1]+  Done".
+static void notify_jobs(void) {
+  reap_jobs();
+  for (int i = 0; i < job_count;) {
+    Job *job = job_table[i];
+    if (job->running > 0) {
+      i++;
+      continue;
+    }
+    if (job->exit_code == 0) fprintf(stderr, "[%d]  Done\t%s\n", job->id, job->command);
+    else fprintf(stderr, "[%d]  Exit %d\t%s\n", job->id, job->exit_code, job->command);
+    remove_job(i);
+  }
+}
+
+// Blocks until the job is done. Returns -1 (with a Python exception set) if
+// a signal handler raised first; the job then stays in the table.
+static int wait_for_job(Job *job) {
+  while (job->running > 0) {
+    collect_job(job, 1);
+    if (job->running > 0 && PyErr_CheckSignals() < 0) return -1;
+  }
+  return 0;
+}
+
+static int find_job_index(PyObject *job_id) {
+  if (job_id == Py_None) {
+    if (job_count == 0) {
+      PyErr_SetString(PyExc_KeyError, "no current job");
+      return -1;
+    }
+    return job_count - 1; // The most recent one
+  }
+
+  long id = PyLong_AsLong(job_id);
+  if (id == -1 && PyErr_Occurred()) return -1;
+  for (int i = 0; i < job_count; i++) {
+    if (job_table[i]->id == id) return i;
+  }
+  PyErr_Format(PyExc_KeyError, "no such job: %ld", id);
+  return -1;
+}
+
+// --- PARSE CACHE ---
+// Scripts re-run the same lines over and over (loop bodies, repeated calls),
+// so the tokenized form of each line is kept in a small direct-mapped cache
+// keyed by the fully expanded line. Entries are reference counted: a line that
+// is still executing keeps its tokens alive even if its slot gets reused.
+
+#define PARSE_CACHE_SIZE 256 // Must be a power of two
+
+typedef struct ParsedLine {
+  char *line;       // Expanded line the tokens came from
+  uint32_t hash;
+  Token *tokens;
+  int count;
+  char *text;       // Backing buffer the tokens point into
+  int refcount;     // One for the cache slot, one per execute_logic_line using it
+} ParsedLine;       // Allocated as one block together with its tokens and text
+
+static ParsedLine *parse_cache[PARSE_CACHE_SIZE];
+
+void release_parsed_line(ParsedLine *parsed) {
+  if (--parsed->refcount > 0) return;
+  free(parsed);
+}
+
+// Copies a token list out of the arena into a single self-contained block for the cache.
+static ParsedLine* pack_parsed_line(const char *input, uint32_t hash, const TokenList *list) {
+  size_t line_len = strlen(input) + 1;
+  size_t header = ARENA_ROUND(sizeof(ParsedLine));
+  size_t tokens_size = sizeof(Token) * list->count;
+
+  ParsedLine *parsed = malloc(header + tokens_size + list->text_len + line_len);
+  if (!parsed) return NULL;
+
+  char *block = (char*)parsed + header;
+  parsed->tokens = (Token*)block;
+  memcpy(parsed->tokens, list->tokens, tokens_size);
+  parsed->text = block + tokens_size;
+  memcpy(parsed->text, list->text, list->text_len);
+  parsed->line = parsed->text + list->text_len;
+  memcpy(parsed->line, input, line_len);
+
+  parsed->hash = hash;
+  parsed->count = list->count;
+  parsed->refcount = 1;
+  return parsed;
+}
+
+// Returns a referenced ParsedLine for `input`, tokenizing it (into `arena`,
+// as scratch space) only on a cache miss.
+// Returns NULL if the line has no tokens or could not be tokenized.
+ParsedLine* acquire_parsed_line(char *input, Arena *arena) {
+  uint32_t hash = hash_name(input);
+  size_t slot = hash & (PARSE_CACHE_SIZE - 1);
+
+  ParsedLine *cached = parse_cache[slot];
+  if (cached && cached->hash == hash && strcmp(cached->line, input) == 0) {
+    cached->refcount++;
+    return cached;
+  }
+
+  TokenList list;
+  if (tokenize_command(input, &list, arena) <= 0) return NULL;
+
+  ParsedLine *parsed = pack_parsed_line(input, hash, &list);
+  if (!parsed) return NULL;
+  parsed->refcount++; // The caller and the cache slot
+
+  if (cached) release_parsed_line(cached);
+  parse_cache[slot] = parsed;
+  return parsed;
+}
+
+// Top-Level
+int execute_logic_line(char *input, int default_in, int default_out, Arena *arena) {
+  ParsedLine *parsed = acquire_parsed_line(input, arena);
+  if (parsed == NULL) return 0;
+
+  const Token *tokens = parsed->tokens;
+  int total_tokens = parsed->count;
+
+  int i = 0;
+  int last_exit_code = 0;
+
+  while (i < total_tokens) {
+    // A list runs up to an "&" (in the background) or to the end of the line
+    int list_end = i;
+    while (list_end < total_tokens && tokens[list_end].kind != TOK_BACKGROUND) list_end++;
+
+    if (list_end < total_tokens) {
+      if (list_end == i) {
+        fprintf(stderr, "syntax error near unexpected token `&'\n");
+        last_exit_code = 2;
+      } else {
+        last_exit_code = start_background_job(&tokens[i], list_end - i, parsed->text, default_out, arena);
+      }
+      i = list_end + 1;
+      continue;
+    }
+
+    int skip_next = 0; // 0 = execute, 1 = skip
+
+    while (i < list_end) {
+      int start = i;
+
+      // Fast-forward until we hit a logical operator
+      while (i < list_end && tokens[i].kind != TOK_AND && tokens[i].kind != TOK_OR) {
+        i++;
+      }
+
+      // Execute this chunk if we aren't skipping it
+      if (!skip_next && (i > start)) {
+        last_exit_code = execute_simple_pipeline(&tokens[start], i - start, parsed->text, default_in, default_out, arena);
+      }
+
+      // Evaluate the logical operator to decide what to do with the NEXT chunk
+      if (i < list_end) {
+        switch (tokens[i].kind) {
+          case TOK_AND:
+            // AND: Skip next if the current command failed (non-zero)
+            skip_next = (last_exit_code != 0);
+            break;
+          case TOK_OR:
+            // OR: Skip next if the current command succeeded (zero)
+            skip_next = (last_exit_code == 0);
+            break;
+        }
+        i++; // Skip the operator token itself
+      }
+    }
+  }
+
+  // Tokens stay in the parse cache for the next time this line comes around
+  release_parsed_line(parsed);
+
+  return last_exit_code;
+}
+
+
+
+// --- COMPLETION ---
+// Tab completes the word before the cursor. In command position, candidates
+// are registered commands, builtins and executables on PATH; after a Python
+// command, a word starting with "-" completes to that Command's option flags.
+// Registered names live in a prefix trie that register/unregister keep
+// current. PATH is scanned on a background thread; the scan does no Python
+// work and publishes one sorted array, so a Tab never waits on a slow
+// filesystem. A new scan starts once PATH has changed or the last one is
+// older than PATH_INDEX_MAX_AGE seconds, and the previous results keep
+// answering until it's done.
+
+#define PATH_INDEX_MAX_AGE 60.0
+#define COMPLETION_LIST_LIMIT 100 // Candidates shown on a double Tab
+
+typedef struct TrieNode {
+  struct TrieNode *child;    // First child; siblings are kept in byte order
+  struct TrieNode *sibling;
+  unsigned char byte;
+  int terminal;              // A name ends here
+} TrieNode;
+
+typedef struct NameList {
+  char **names;
+  size_t count;
+  size_t capacity;
+} NameList;
+
+static TrieNode command_trie;                    // Root; its byte is unused
+static char **path_names = NULL;                 // Sorted executables found on PATH
+static size_t path_names_count = 0;
+static PyThread_type_lock path_index_lock = NULL; // Guards path_names and path_scan_running
+static int path_scan_running = 0;
+static double path_index_time = 0;               // When the last scan started
+
+static void completion_command_added(const char *name) {
+  TrieNode *node = &command_trie;
+  for (const unsigned char *p = (const unsigned char*)name; *p; p++) {
+    TrieNode **link = &node->child;
+    while (*link && (*link)->byte < *p) link = &(*link)->sibling;
+    if (!*link || (*link)->byte != *p) {
+      TrieNode *fresh = calloc(1, sizeof(TrieNode));
+      if (!fresh) return;
+      fresh->byte = *p;
+      fresh->sibling = *link;
+      *link = fresh;
+    }
+    node = *link;
+  }
+  node->terminal = 1;
+}
+
+// Unmarks `name` below `node`, freeing branches that no longer lead anywhere.
+// Returns 1 if `node` itself is now empty.
+static int trie_remove(TrieNode *node, const unsigned char *name) {
+  if (*name == '\0') {
+    node->terminal = 0;
+  } else {
+    TrieNode **link = &node->child;
+    while (*link && (*link)->byte < *name) link = &(*link)->sibling;
+    if (*link && (*link)->byte == *name && trie_remove(*link, name + 1)) {
+      TrieNode *empty = *link;
+      *link = empty->sibling;
+      free(empty);
+    }
+  }
+  return !node->terminal && node->child == NULL;
+}
+
+static void completion_command_removed(const char *name) {
+  trie_remove(&command_trie, (const unsigned char*)name);
+}
+
+static void name_list_add(NameList *list, const char *name, size_t len) {
+  if (list->count == list->capacity) {
+    size_t new_capacity = list->capacity ? list->capacity * 2 : 64;
+    char **grown = realloc(list->names, sizeof(char*) * new_capacity);
+    if (!grown) return;
+    list->names = grown;
+    list->capacity = new_capacity;
+  }
+  char *copy = malloc(len + 1);
+  if (!copy) return;
+  memcpy(copy, name, len);
+  copy[len] = '\0';
+  list->names[list->count++] = copy;
+}
+
+static void name_list_free(NameList *list) {
+  for (size_t i = 0; i < list->count; i++) free(list->names[i]);
+  free(list->names);
+  list->names = NULL;
+  list->count = list->capacity = 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Sorts the list and drops duplicates.
+static void name_list_sort(NameList *list) {
+  if (list->count == 0) return;
+  qsort(list->names, list->count, sizeof(char*), compare_names);
+  size_t kept = 1;
+  for (size_t i = 1; i < list->count; i++) {
+    if (strcmp(list->names[i], list->names[kept - 1]) == 0) free(list->names[i]);
+    else list->names[kept++] = list->names[i];
+  }
+  list->count = kept;
+}
+
+// Adds every name in the subtree of `node`; `prefix` holds the bytes leading to it.
+static void trie_collect(const TrieNode *node, StrBuf *prefix, NameList *out) {
+  if (node->terminal) name_list_add(out, prefix->data, prefix->len);
+  for (const TrieNode *child = node->child; child; child = child->sibling) {
+    char byte = (char)child->byte;
+    sb_append(prefix, &byte, 1);
+    trie_collect(child, prefix, out);
+    prefix->len--;
+  }
+}
+
+// Adds the executables in `dir` to `out`.
+static void scan_path_directory(const char *dir, NameList *out) {
+#ifdef _WIN32
+  char pattern[MAX_PATH];
+  snprintf(pattern, sizeof(pattern), "%s\\*", dir);
+  struct _finddata_t entry;
+  intptr_t handle = _findfirst(pattern, &entry);
+  if (handle == -1) return;
+  do {
+    if (entry.attrib & _A_SUBDIR) continue;
+    const char *ext = strrchr(entry.name, '.');
+    if (!ext || (_stricmp(ext, ".exe") && _stricmp(ext, ".bat") && _stricmp(ext, ".cmd") && _stricmp(ext, ".com"))) continue;
+    name_list_add(out, entry.name, (size_t)(ext - entry.name)); // Typed without the extension
+  } while (_findnext(handle, &entry) == 0);
+  _findclose(handle);
+#else
+  DIR *d = opendir(dir);
+  if (!d) return;
+  char full[4096];
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (entry->d_name[0] == '.') continue;
+#ifdef DT_DIR
+    if (entry->d_type == DT_DIR) continue;
+#endif
+    struct stat st;
+    snprintf(full, sizeof(full), "%s/%s", dir[0] ? dir : ".", entry->d_name);
+    if (stat(full, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111)) {
+      name_list_add(out, entry->d_name, strlen(entry->d_name));
+    }
+  }
+  closedir(d);
+#endif
+}
+
+// Background thread: scans the PATH copy it was given and publishes the result.
+static void path_scan_main(void *arg) {
+  char *path = arg;
+#ifdef _WIN32
+  const char separator = ';';
+#else
+  const char separator = ':';
+#endif
+
+  NameList found = {NULL, 0, 0};
+  for (char *dir = path; dir; ) {
+    char *end = strchr(dir, separator);
+    if (end) *end = '\0';
+    scan_path_directory(dir, &found);
+    dir = end ? end + 1 : NULL;
+  }
+  name_list_sort(&found);
+  free(path);
+
+  PyThread_acquire_lock(path_index_lock, WAIT_LOCK);
+  NameList old = {path_names, path_names_count, path_names_count};
+  path_names = found.names;
+  path_names_count = found.count;
+  path_scan_running = 0;
+  PyThread_release_lock(path_index_lock);
+
+  name_list_free(&old);
+}
+
+// Starts a background PATH scan if the index is stale. Needs the GIL.
+static void path_index_refresh(void) {
+  if (!path_index_lock) {
+    path_index_lock = PyThread_allocate_lock();
+    if (!path_index_lock) return;
+  }
+  double now = monotonic_seconds();
+  if (!path_index_stale && now - path_index_time < PATH_INDEX_MAX_AGE) return;
+
+  PyThread_acquire_lock(path_index_lock, WAIT_LOCK);
+  int busy = path_scan_running;
+  if (!busy) path_scan_running = 1;
+  PyThread_release_lock(path_index_lock);
+  if (busy) return; // Stays stale if PATH changed meanwhile, so the next Tab rescans
+
+  const char *value = var_get("PATH");
+  char *path = strdup(value ? value : "");
+  path_index_stale = 0;
+  path_index_time = now;
+  if (!path || PyThread_start_new_thread(path_scan_main, path) == PYTHREAD_INVALID_THREAD_ID) {
+    free(path);
+    PyThread_acquire_lock(path_index_lock, WAIT_LOCK);
+    path_scan_running = 0;
+    PyThread_release_lock(path_index_lock);
+  }
+}
+
+// Adds the names in sorted `names` that start with `prefix`.
+static void add_prefixed(NameList *out, char **names, size_t count, const char *prefix, size_t len) {
+  size_t lo = 0, hi = count;
+  while (lo < hi) { // First name >= prefix
+    size_t mid = lo + (hi - lo) / 2;
+    if (strcmp(names[mid], prefix) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  for (size_t i = lo; i < count && strncmp(names[i], prefix, len) == 0; i++) {
+    name_list_add(out, names[i], strlen(names[i]));
+  }
+}
+
+static void complete_command_name(const char *prefix, size_t len, NameList *out) {
+  // Registered commands: walk down to the prefix, then take the whole subtree
+  const TrieNode *node = &command_trie;
+  for (size_t i = 0; i < len && node; i++) {
+    node = node->child;
+    while (node && node->byte < (unsigned char)prefix[i]) node = node->sibling;
+    if (node && node->byte != (unsigned char)prefix[i]) node = NULL;
+  }
+  if (node) {
+    StrBuf path;
+    sb_init(&path);
+    sb_append(&path, prefix, len);
+    trie_collect(node, &path, out);
+    free(path.data);
+  }
+
+  for (const Builtin *b = builtin_table; b->name; b++) {
+    if (strncmp(b->name, prefix, len) == 0) name_list_add(out, b->name, strlen(b->name));
+  }
+
+  path_index_refresh();
+  if (!path_index_lock) return;
+  PyThread_acquire_lock(path_index_lock, WAIT_LOCK);
+  add_prefixed(out, path_names, path_names_count, prefix, len);
+  PyThread_release_lock(path_index_lock);
+}
+
+// Option flags of the Python command `command` (the keys of a Command's
+// optional_arguments) that start with `prefix`.
+static void complete_option(const char *command, const char *prefix, size_t len, NameList *out) {
+  PyCommand *cmd = find_python_command(command);
+  if (!cmd) return;
+
+  PyObject *options = PyObject_GetAttrString(cmd->func, "optional_arguments");
+  if (options && PyDict_Check(options)) {
+    PyObject *flag, *value;
+    Py_ssize_t pos = 0;
+    while (PyDict_Next(options, &pos, &flag, &value)) {
+      Py_ssize_t flag_len;
+      const char *text = PyUnicode_Check(flag) ? PyUnicode_AsUTF8AndSize(flag, &flag_len) : NULL;
+      if (text && strncmp(text, prefix, len) == 0) name_list_add(out, text, (size_t)flag_len);
+    }
+  }
+  Py_XDECREF(options);
+  PyErr_Clear();
+}
+
+// Candidates for the word that ends at `len` in `line`, sorted. Sets *word to
+// where that word starts.
+static void complete_line(const char *line, size_t len, NameList *out, size_t *word) {
+  // The current command starts after the last operator
+  size_t start = len;
+  while (start > 0 && !strchr("|&;(", line[start - 1])) start--;
+
+  size_t w = len;
+  while (w > start && line[w - 1] != ' ' && line[w - 1] != '\t') w--;
+  *word = w;
+
+  size_t first = start;
+  while (first < w && (line[first] == ' ' || line[first] == '\t')) first++;
+
+  const char *prefix = line + w;
+  size_t prefix_len = len - w;
+  char *text = malloc(prefix_len + 1);
+  if (!text) return;
+  memcpy(text, prefix, prefix_len);
+  text[prefix_len] = '\0';
+
+  if (first == w) {
+    if (!memchr(text, '/', prefix_len)) complete_command_name(text, prefix_len, out); // Paths aren't looked up
+  } else if (text[0] == '-') {
+    size_t name_len = 0;
+    while (first + name_len < w && line[first + name_len] != ' ' && line[first + name_len] != '\t') name_len++;
+    char *command = malloc(name_len + 1);
+    if (command) {
+      memcpy(command, line + first, name_len);
+      command[name_len] = '\0';
+      complete_option(command, text, prefix_len, out);
+      free(command);
+    }
+  }
+  free(text);
+  name_list_sort(out);
+}
+
+// Python Usage: shell_core.complete("gi") -> ["git", "gitk", ...]
+// Completion candidates for the last word of `line`, as Tab would see them.
+static PyObject* shell_complete(PyObject *self, PyObject *args) {
+  const char *line;
+  Py_ssize_t len;
+  if (!PyArg_ParseTuple(args, "s#", &line, &len)) {
+    return NULL;
+  }
+
+  NameList found = {NULL, 0, 0};
+  size_t word;
+  complete_line(line, (size_t)len, &found, &word);
+
+  PyObject *list = PyList_New((Py_ssize_t)found.count);
+  for (size_t i = 0; list && i < found.count; i++) {
+    PyObject *name = PyUnicode_DecodeFSDefault(found.names[i]); // File names needn't be UTF-8
+    if (!name) {
+      Py_CLEAR(list);
+      break;
+    }
+    PyList_SET_ITEM(list, (Py_ssize_t)i, name);
+  }
+  name_list_free(&found);
+  return list;
+}
+
+// --- LINE EDITOR ---
+// The editor reads whatever input is waiting in one call and queues all of its
+// terminal output, which goes out in a single write just before the editor
+// blocks for more input. A pasted block therefore costs a handful of syscalls
+// instead of several per byte, and runs of plain characters are inserted (and
+// redrawn) in one step. Key handling never reads by itself: editor_feed works
+// through whatever input has been queued and keeps its place in between, so
+// the same editor serves the blocking console loop and the server's event loop.
+
+#define EDITOR_LINE_SIZE 1024 // Initial size; the line buffer doubles as needed
+#define EDITOR_INPUT_SIZE 4096
+
+enum {
+  EDITOR_KEY_NORMAL,
+  EDITOR_KEY_ESCAPE,   // Saw ESC
+  EDITOR_KEY_CSI,      // Inside ESC [ ... (or ESC O ...)
+  EDITOR_KEY_PASTE,    // Inside a bracketed paste
+  EDITOR_KEY_SPECIAL,  // Saw a Windows 0 / 0xE0 prefix
+};
+
+typedef struct Editor {
+  int in_fd;
+  int out_fd;
+  const char *prompt;
+  char *buffer;          // Line being edited
+  size_t bufsize;
+  size_t length;
+  size_t cursor;
+  unsigned char input[EDITOR_INPUT_SIZE]; // Read but not yet handled; kept between lines for typeahead
+  size_t input_pos;
+  size_t input_len;
+  StrBuf out;            // Terminal output waiting for the next flush
+  int bracketed_paste;   // Terminal was asked to bracket pastes
+  int eof;               // Input is closed (a read returned 0)
+  int key_state;         // EDITOR_KEY_*: where a key split across reads left off
+  char params[16];       // CSI parameters so far
+  size_t params_len;
+  StrBuf paste;          // Bracketed paste collected so far
+  size_t paste_matched;  // Bytes of the paste end marker seen
+  int searching;         // Inside Ctrl-R
+  char pattern[256];     // Ctrl-R search pattern
+  size_t pattern_len;
+  long match;            // History index of the current match, -1 for none
+  int failed;            // The pattern matches nothing older
+  int tabs;              // Tabs pressed in a row
+} Editor;
+
+static Editor console_editor = {STDIN_FILENO, STDOUT_FILENO};
+
+static void editor_emit(Editor *ed, const char *text, size_t n) {
+  sb_append(&ed->out, text, n);
+}
+
+static void editor_puts(Editor *ed, const char *text) {
+  editor_emit(ed, text, strlen(text));
+}
+
+static void editor_flush(Editor *ed) {
+  size_t done = 0;
+  while (done < ed->out.len) {
+    int n = (int)write(ed->out_fd, ed->out.data + done, (unsigned)(ed->out.len - done));
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) continue;
+      break; // Terminal went away; drop the redraw
+    }
+    done += n;
+  }
+  ed->out.len = 0;
+}
+
+static void editor_cursor_left(Editor *ed, size_t n) {
+  if (n == 0) return;
+#ifdef _WIN32
+  for (size_t i = 0; i < n; i++) editor_emit(ed, "\b", 1);
+#else
+  char seq[32];
+  editor_emit(ed, seq, snprintf(seq, sizeof(seq), "\033[%zuD", n));
+#endif
+}
+
+static void editor_cursor_right(Editor *ed, size_t n) {
+  if (n == 0) return;
+#ifdef _WIN32
+  editor_emit(ed, ed->buffer + ed->cursor - n, n); // Reprinting moves the console cursor forward
+#else
+  char seq[32];
+  editor_emit(ed, seq, snprintf(seq, sizeof(seq), "\033[%zuC", n));
+#endif
+}
+
+// Makes room for `extra` more bytes plus the terminator. Returns 0 on success.
+static int editor_reserve(Editor *ed, size_t extra) {
+  size_t needed = ed->length + extra + 1;
+  if (needed <= ed->bufsize) return 0;
+
+  size_t new_size = ed->bufsize;
+  while (new_size < needed) new_size *= 2;
+  char *grown = realloc(ed->buffer, new_size);
+  if (!grown) return -1;
+  ed->buffer = grown;
+  ed->bufsize = new_size;
+  return 0;
+}
+
+// Inserts `n` bytes at the cursor and redraws the tail once.
+static void editor_insert(Editor *ed, const char *text, size_t n) {
+  if (n == 0 || editor_reserve(ed, n) != 0) return;
+
+  memmove(ed->buffer + ed->cursor + n, ed->buffer + ed->cursor, ed->length - ed->cursor + 1);
+  memcpy(ed->buffer + ed->cursor, text, n);
+  ed->length += n;
+
+  editor_emit(ed, ed->buffer + ed->cursor, ed->length - ed->cursor); // New text plus the shifted tail
+  ed->cursor += n;
+  editor_cursor_left(ed, ed->length - ed->cursor);
+}
+
+static void editor_backspace(Editor *ed) {
+  if (ed->cursor == 0) return;
+
+  memmove(ed->buffer + ed->cursor - 1, ed->buffer + ed->cursor, ed->length - ed->cursor + 1);
+  ed->cursor--;
+  ed->length--;
+
+  editor_cursor_left(ed, 1);
+  editor_emit(ed, ed->buffer + ed->cursor, ed->length - ed->cursor); // Print the tail
+  editor_emit(ed, " ", 1);                                           // Erase ghost char
+  editor_cursor_left(ed, ed->length - ed->cursor + 1);
+}
+
+// Replaces the whole line (history browsing, search results) with one redraw.
+static void editor_replace(Editor *ed, const char *new_text) {
+  size_t new_len = strlen(new_text);
+  if (new_text != ed->buffer) {
+    ed->length = 0;
+    if (editor_reserve(ed, new_len) != 0) new_len = 0;
+    memcpy(ed->buffer, new_text, new_len);
+  }
+  ed->buffer[new_len] = '\0';
+  ed->length = new_len;
+  ed->cursor = new_len; // Set cursor to end of line
+
+  editor_puts(ed, "\r\x1b[K"); // Line start, clear the line
+  editor_puts(ed, ed->prompt);
+  editor_emit(ed, ed->buffer, ed->length);
+}
+
+static void editor_history_up(Editor *ed) {
+  if (history_view_idx > 0) {
+    history_view_idx--; // Move backwards
+    editor_replace(ed, history_entry(history_view_idx));
+  }
+}
+
+static void editor_history_down(Editor *ed) {
+  if (history_view_idx < history.count) {
+    history_view_idx++; // Move fowards
+    // Past the last history item means back to an empty line
+    editor_replace(ed, history_view_idx == history.count ? "" : history_entry(history_view_idx));
+  }
+}
+
+// Collects a bracketed paste (everything up to ESC [ 201 ~) and inserts it as
+// one block once the end marker arrives. Line breaks and tabs become spaces;
+// other control bytes are dropped.
+static void editor_paste_byte(Editor *ed, int c) {
+  static const char end_marker[] = "\033[201~";
+
+  if (c == end_marker[ed->paste_matched]) {
+    if (++ed->paste_matched == sizeof(end_marker) - 1) {
+      editor_insert(ed, ed->paste.data, ed->paste.len);
+      ed->paste.len = 0;
+      ed->key_state = EDITOR_KEY_NORMAL;
+    }
+    return;
+  }
+  ed->paste_matched = (c == '\033');
+  if (ed->paste_matched) return;
+
+  char ch = (char)c;
+  if (c == '\r' || c == '\n' || c == '\t') ch = ' ';
+  else if (c < 32 || c == 127) return;
+  sb_append(&ed->paste, &ch, 1);
+}
+
+// One byte of a CSI sequence: numeric parameters, then a final byte that
+// selects the key (arrows and paste markers).
+static void editor_csi_byte(Editor *ed, int c) {
+  if (isdigit(c) || c == ';') {
+    if (ed->params_len + 1 < sizeof(ed->params)) ed->params[ed->params_len++] = (char)c;
+    return;
+  }
+  ed->params[ed->params_len] = '\0';
+  ed->key_state = EDITOR_KEY_NORMAL;
+
+  switch (c) {
+    case 'A': editor_history_up(ed); break;    // UP ARROW
+    case 'B': editor_history_down(ed); break;  // DOWN ARROW
+    case 'D': // LEFT ARROW
+      if (ed->cursor > 0) {
+        ed->cursor--;
+        editor_cursor_left(ed, 1);
+      }
+      break;
+    case 'C': // RIGHT ARROW
+      if (ed->cursor < ed->length) {
+        ed->cursor++;
+        editor_cursor_right(ed, 1);
+      }
+      break;
+    case '~':
+      if (strcmp(ed->params, "200") == 0) {
+        ed->key_state = EDITOR_KEY_PASTE;
+        ed->paste_matched = 0;
+        ed->paste.len = 0;
+      }
+      break;
+  }
+}
+
+#ifdef _WIN32
+// Scan code following a 0 or 0xE0 prefix byte
+static void editor_special_key(Editor *ed, int c) {
+  ed->key_state = EDITOR_KEY_NORMAL;
+  switch (c) {
+    case 72: editor_history_up(ed); break;    // UP ARROW
+    case 80: editor_history_down(ed); break;  // DOWN ARROW
+    case 75: // LEFT ARROW (K)
+      if (ed->cursor > 0) {
+        ed->cursor--;
+        editor_cursor_left(ed, 1);
+      }
+      break;
+    case 77: // RIGHT ARROW (M)
+      if (ed->cursor < ed->length) {
+        ed->cursor++;
+        editor_cursor_right(ed, 1);
+      }
+      break;
+  }
+}
+#endif
+
+static void editor_search_redraw(Editor *ed) {
+  editor_puts(ed, ed->failed ? "\r\x1b[K(failed reverse-i-search)`" : "\r\x1b[K(reverse-i-search)`");
+  editor_puts(ed, ed->pattern);
+  editor_puts(ed, "': ");
+  if (ed->match >= 0) editor_puts(ed, history_entry((size_t)ed->match));
+}
+
+// Ctrl-R: bash-style incremental reverse search. Typing extends the pattern,
+// Ctrl-R again steps to older matches, Backspace shortens the pattern and
+// Ctrl-G cancels. Any other key accepts the match into the line buffer and is
+// returned so the editor can handle it (Enter runs the line); 0 means the key
+// was consumed by the search.
+static int editor_search_key(Editor *ed, int c) {
+  if (c == 18) { // Ctrl-R: next older match
+    if (ed->pattern_len > 0) {
+      long older = history_search(ed->pattern, ed->match >= 0 ? (size_t)ed->match : history.count);
+      if (older >= 0) ed->match = older;
+      ed->failed = (older < 0);
+    }
+  }
+  else if (c == 127 || c == 8) { // Backspace: shorter pattern, search again from the newest
+    if (ed->pattern_len > 0) {
+      ed->pattern[--ed->pattern_len] = '\0';
+      ed->match = ed->pattern_len ? history_search(ed->pattern, history.count) : -1;
+      ed->failed = (ed->pattern_len && ed->match < 0);
+    }
+  }
+  else if (c == 7) { // Ctrl-G: give up, keep the original line
+    ed->searching = 0;
+    editor_replace(ed, ed->buffer);
+    return 0;
+  }
+  else if (c >= 32 && c < 127 && ed->pattern_len + 1 < sizeof(ed->pattern)) {
+    // The current match still qualifies if it contains the longer pattern
+    ed->pattern[ed->pattern_len++] = (char)c;
+    ed->pattern[ed->pattern_len] = '\0';
+    long found = history_search(ed->pattern, ed->match >= 0 ? (size_t)ed->match + 1 : history.count);
+    if (found >= 0) ed->match = found;
+    ed->failed = (found < 0);
+  }
+  else {
+    ed->searching = 0;
+    editor_replace(ed, ed->match >= 0 ? history_entry((size_t)ed->match) : ed->buffer);
+    if (ed->match >= 0) history_view_idx = (size_t)ed->match;
+    return c;
+  }
+
+  editor_search_redraw(ed);
+  return 0;
+}
+
+// [TAB] Completes the word before the cursor: a single candidate in full
+// (plus a space), otherwise as far as all candidates agree. A second Tab in a
+// row lists them.
+static void editor_complete(Editor *ed) {
+  NameList found = {NULL, 0, 0};
+  size_t word;
+  complete_line(ed->buffer, ed->cursor, &found, &word);
+  ed->tabs++;
+
+  if (found.count > 0) {
+    size_t typed = ed->cursor - word;
+    size_t common = strlen(found.names[0]);
+    for (size_t i = 1; i < found.count; i++) {
+      size_t k = 0;
+      while (k < common && found.names[i][k] == found.names[0][k]) k++;
+      common = k;
+    }
+
+    if (common > typed) editor_insert(ed, found.names[0] + typed, common - typed);
+    if (found.count == 1) {
+      if (ed->buffer[ed->cursor] != ' ') editor_insert(ed, " ", 1);
+    } else if (common <= typed && ed->tabs >= 2) {
+      editor_puts(ed, "\r\n");
+      size_t column = 0;
+      size_t shown = found.count < COMPLETION_LIST_LIMIT ? found.count : COMPLETION_LIST_LIMIT;
+      for (size_t i = 0; i < shown; i++) {
+        size_t len = strlen(found.names[i]);
+        if (column > 0 && column + 2 + len > 80) {
+          editor_puts(ed, "\r\n");
+          column = 0;
+        } else if (column > 0) {
+          editor_puts(ed, "  ");
+          column += 2;
+        }
+        editor_emit(ed, found.names[i], len);
+        column += len;
+      }
+      if (shown < found.count) {
+        char more[64];
+        editor_emit(ed, more, snprintf(more, sizeof(more), "\r\n... and %zu more", found.count - shown));
+      }
+      // Redraw the line underneath
+      editor_puts(ed, "\r\n");
+      editor_puts(ed, ed->prompt);
+      editor_emit(ed, ed->buffer, ed->length);
+      editor_cursor_left(ed, ed->length - ed->cursor);
+    }
+  }
+  name_list_free(&found);
+}
+
+// Starts a new line: resets the editor and queues the prompt.
+// Returns -1 if out of memory.
+static int editor_begin(Editor *ed, const char *prompt) {
+  ed->prompt = prompt;
+  ed->bufsize = EDITOR_LINE_SIZE;
+  ed->length = 0;
+  ed->cursor = 0;
+  ed->key_state = EDITOR_KEY_NORMAL;
+  ed->searching = 0;
+  ed->tabs = 0;
+  ed->buffer = calloc(ed->bufsize, sizeof(char));
+  if (!ed->buffer) return -1;
+
+  ed->bracketed_paste = isatty(ed->in_fd) && isatty(ed->out_fd);
+  if (ed->bracketed_paste) editor_puts(ed, "\033[?2004h");
+  editor_puts(ed, prompt);
+  return 0;
+}
+
+// Handles the input waiting in ed->input. Returns 1 as soon as Enter ends the
+// line (anything after it stays queued for the next line), or 0 once the
+// input is used up. Keys split across reads pick up where they left off, so
+// the caller decides when and how to wait for more input.
+static int editor_feed(Editor *ed) {
+  while (ed->input_pos < ed->input_len) {
+    int c = ed->input[ed->input_pos++];
+
+    switch (ed->key_state) {
+      case EDITOR_KEY_ESCAPE:
+        ed->key_state = (c == '[' || c == 'O') ? EDITOR_KEY_CSI : EDITOR_KEY_NORMAL;
+        ed->params_len = 0;
+        continue;
+      case EDITOR_KEY_CSI:
+        editor_csi_byte(ed, c);
+        continue;
+      case EDITOR_KEY_PASTE:
+        editor_paste_byte(ed, c);
+        continue;
+#ifdef _WIN32
+      case EDITOR_KEY_SPECIAL:
+        editor_special_key(ed, c);
+        continue;
+#endif
+    }
+
+    if (ed->searching) {
+      c = editor_search_key(ed, c);
+      if (c == 0) continue;
+    }
+    if (c != '\t') ed->tabs = 0;
+
+    // [TAB] Completion
+    if (c == '\t') {
+      editor_complete(ed);
+    }
+
+    // [CTRL-R] Reverse history search
+    else if (c == 18) {
+      ed->searching = 1;
+      ed->pattern[0] = '\0';
+      ed->pattern_len = 0;
+      ed->match = -1;
+      ed->failed = 0;
+      editor_search_redraw(ed);
+    }
+
+    // [NORMAL TYPING]
+    // Take the whole run of plain characters that arrived together.
+    else if (c >= 32 && c <= 126) {
+      size_t start = ed->input_pos - 1;
+      while (ed->input_pos < ed->input_len && ed->input[ed->input_pos] >= 32 && ed->input[ed->input_pos] <= 126) {
+        ed->input_pos++;
+      }
+      editor_insert(ed, (const char*)ed->input + start, ed->input_pos - start);
+    }
+
+    // [ENTER] Windows sends \r, terminals in raw mode \r or \n
+    else if (c == '\r' || c == '\n') {
+      editor_puts(ed, "\r\n"); // Move to next line visually
+      return 1;
+    }
+
+    // [BACKSPACE] 127 on most terminals, 8 on Windows
+    else if (c == 127 || c == 8) {
+      editor_backspace(ed);
+    }
+
+#ifdef _WIN32
+    // [SPECIAL KEYS] Windows sends 0 or 0xE0 (224) first, then the scan code
+    else if (c == 0 || c == 0xE0) {
+      ed->key_state = EDITOR_KEY_SPECIAL;
+    }
+#else
+    // [ESCAPE SEQUENCES] Arrows and bracketed paste
+    else if (c == '\033') {
+      ed->key_state = EDITOR_KEY_ESCAPE;
+    }
+#endif
+  }
+  return 0;
+}
+
+// Ends the line started by editor_begin. Returns it as a malloc'd string, or
+// NULL at EOF on an empty line.
+static char* editor_finish(Editor *ed) {
+  if (ed->key_state == EDITOR_KEY_PASTE) editor_insert(ed, ed->paste.data, ed->paste.len); // Input ended mid-paste
+  ed->key_state = EDITOR_KEY_NORMAL;
+  ed->searching = 0;
+
+  if (ed->bracketed_paste) editor_puts(ed, "\033[?2004l"); // Don't leave it on for child programs
+  editor_flush(ed);
+
+  if (ed->eof && ed->length == 0) {
+    free(ed->buffer);
+    ed->buffer = NULL;
+    return NULL;
+  }
+
+  char *line = ed->buffer;
+  ed->buffer = NULL;
+  return line;
+}
+
+// Reads one line, blocking for input. Returns a malloc'd string, or NULL at
+// EOF on an empty line.
+char* editor_read_line(Editor *ed, const char *prompt) {
+  if (editor_begin(ed, prompt) != 0) return NULL;
+
+  while (!editor_feed(ed)) {
+    editor_flush(ed); // Pending output goes out before we block
+    int n = read_input(ed->in_fd, ed->input, sizeof(ed->input));
+    if (n == 0) ed->eof = 1;
+    if (n <= 0) break;
+    ed->input_pos = 0;
+    ed->input_len = (size_t)n;
+  }
+
+  return editor_finish(ed);
+}
+
+// Exported function callable from Python
+char* get_input(const char* prompt) {
+  fflush(stdout); // Anything printed through stdio goes out before the prompt
+
+  enable_raw_mode_guarded(); // Turn off buffering/echo
+  history_load();
+
+  char *line = editor_read_line(&console_editor, prompt);
+
+  disableRawMode(); // Restore terminal for Python
+  if (line) add_history(line);
+  return line; // Return the pointer to Python
+}
+
+// --- EXPANSION HELPERS ---
+
+// VARIABLE EXPANSION ($VAR -> Value)
+// The result is allocated from `arena`.
+char* expand_variables(const char* input, Arena *arena) {
+  StrBuf result;
+  sb_init_arena(&result, arena);
+  sb_reserve(&result, strlen(input));
+  const char *p = input;
+
+  while (*p) {
+    if (*p == '$' && *(p+1) != '(') { // Found $, but not $(
+      p++; // Skip $
+
+      // Extract Var Name
+      const char *name_start = p;
+      while (isalnum((unsigned char)*p) || *p == '_') p++;
+      char *var_name = arena_strndup(arena, name_start, p - name_start);
+
+      // Get Value
+      const char *val = var_get(var_name);
+      if (val) sb_append(&result, val, strlen(val));
+    } else {
+      // Copy plain text up to the next '$' in one go
+      const char *next = strchr(p + 1, '$');
+      size_t run = next ? (size_t)(next - p) : strlen(p);
+      sb_append(&result, p, run);
+      p += run;
+    }
+  }
+  return sb_detach(&result);
+}
+
+// CAPTURE OUTPUT (Runs a command and returns its stdout)
+// Forward declarations for mutual recursion
+char* expand_variables(const char* input, Arena *arena);
+char* expand_subshells(const char* input, Arena *arena);
+
+// Drains a capture pipe on its own thread (no GIL needed) so the command
+// writing into it never blocks on a full pipe while we wait for it.
+typedef struct CaptureReader {
+  int fd;
+  StrBuf output;
+  PyThread_type_lock done;
+} CaptureReader;
+
+#define CAPTURE_CHUNK 65536
+
+static void capture_reader_main(void *arg) {
+  CaptureReader *reader = arg;
+
+  while (1) {
+    // Read straight into the buffer's spare capacity, growing it geometrically
+    if (sb_reserve(&reader->output, CAPTURE_CHUNK) != 0) break;
+    ssize_t n = read(reader->fd, reader->output.data + reader->output.len, CAPTURE_CHUNK);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    reader->output.len += (size_t)n;
+  }
+
+  close(reader->fd);
+  PyThread_release_lock(reader->done);
+}
+
+// $(< file) is the file's contents. Reads it straight into `out`, with no
+// pipe, reader thread or pipeline in between. Returns 0 if cmd is something else.
+static int capture_file_contents(char *cmd, StrBuf *out, Arena *arena) {
+  ParsedLine *parsed = acquire_parsed_line(cmd, arena);
+  if (!parsed) return 0;
+  if (parsed->count != 2 || parsed->tokens[0].kind != TOK_REDIR_IN || parsed->tokens[1].kind != TOK_WORD) {
+    release_parsed_line(parsed);
+    return 0;
+  }
+
+  const char *file = parsed->text + parsed->tokens[1].offset;
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror(file);
+    release_parsed_line(parsed);
+    return 1;
+  }
+
+  struct stat st;
+  size_t expected = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) ? (size_t)st.st_size : 0;
+  Py_BEGIN_ALLOW_THREADS
+  while (1) {
+    // One read for the whole file when its size is known, one more to see EOF
+    size_t want = out->len < expected ? expected - out->len : CAPTURE_CHUNK;
+    if (sb_reserve(out, want) != 0) break;
+    ssize_t n = read(fd, out->data + out->len, want);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    out->len += (size_t)n;
+  }
+  Py_END_ALLOW_THREADS
+
+  close(fd);
+  release_parsed_line(parsed);
+  return 1;
+}
+
+// The returned string is malloc'd; temporaries come from `arena`.
+char* capture_command_output(char *cmd, Arena *arena) {
+  char *expanded_vars = expand_variables(cmd, arena);
+  char *final_cmd = expand_subshells(expanded_vars, arena);
+
+  StrBuf contents;
+  sb_init(&contents);
+  if (capture_file_contents(final_cmd, &contents, arena)) {
+    if (contents.len > 0 && contents.data[contents.len - 1] == '\n') contents.len--; // Same as below
+    return sb_detach(&contents);
+  }
+
+  int fds[2];
+  if (make_pipe(fds) == -1) {
+    perror("pipe");
+    return strdup("");
+  }
+
+  CaptureReader reader;
+  reader.fd = fds[0];
+  sb_init(&reader.output);
+  reader.done = PyThread_allocate_lock();
+
+  if (!reader.done) {
+    close(fds[0]);
+    close(fds[1]);
+    return strdup("");
+  }
+  PyThread_acquire_lock(reader.done, WAIT_LOCK);
+
+  if (PyThread_start_new_thread(capture_reader_main, &reader) == PYTHREAD_INVALID_THREAD_ID) {
+    fprintf(stderr, "command substitution: could not start reader thread\n");
+    PyThread_release_lock(reader.done);
+    PyThread_free_lock(reader.done);
+    close(fds[0]);
+    close(fds[1]);
+    return strdup("");
+  }
+
+  // Pass the pipe's write end directly into the pipeline
+  execute_logic_line(final_cmd, STDIN_FILENO, fds[1], arena);
+
+  // Closing our write end lets the reader see EOF once every child has exited
+  close(fds[1]);
+
+  Py_BEGIN_ALLOW_THREADS
+  PyThread_acquire_lock(reader.done, WAIT_LOCK);
+  Py_END_ALLOW_THREADS
+  PyThread_release_lock(reader.done);
+  PyThread_free_lock(reader.done);
+
+  // Like sh, drop the trailing newline from the output
+  if (reader.output.len > 0 && reader.output.data[reader.output.len - 1] == '\n') {
+    reader.output.len--;
+  }
+
+  return sb_detach(&reader.output);
+}
+
+
+// One top-level $(...) on a line
+typedef struct Substitution {
+  const char *start;        // Points at the '$'
+  const char *end;          // Just past the closing ')'
+  char *cmd;                // Inner command text
+  char *output;             // Captured output (NULL until evaluated)
+  PyThread_type_lock done;  // Set while it is being evaluated on a worker thread
+} Substitution;
+
+// Does any stage of `cmd` run a registered Python command that isn't async?
+// Async ones only hold the GIL briefly and spend their time waiting on the loop.
+int line_uses_python(char *cmd, Arena *arena) {
+  ParsedLine *parsed = acquire_parsed_line(cmd, arena);
+  if (!parsed) return 0;
+
+  int uses_python = 0;
+  int command_position = 1;
+  for (int i = 0; i < parsed->count && !uses_python; i++) {
+    switch (parsed->tokens[i].kind) {
+      case TOK_PIPE:
+      case TOK_AND:
+      case TOK_OR:
+      case TOK_BACKGROUND:
+        command_position = 1;
+        break;
+      case TOK_REDIR_IN:
+      case TOK_REDIR_OUT:
+      case TOK_REDIR_APPEND:
+        i++; // Skip the file name
+        break;
+      default:
+        if (command_position) {
+          PyCommand *py_cmd = find_python_command(parsed->text + parsed->tokens[i].offset);
+          uses_python = (py_cmd != NULL && !py_cmd->is_async);
+          command_position = 0;
+        }
+        break;
+    }
+  }
+
+  release_parsed_line(parsed);
+  return uses_python;
+}
+
+static void substitution_main(void *arg) {
+  Substitution *sub = arg;
+
+  PyGILState_STATE gil = PyGILState_Ensure();
+  Arena *arena = acquire_arena(); // Arenas aren't shared between threads
+  sub->output = capture_command_output(sub->cmd, arena);
+  release_arena(arena);
+  PyGILState_Release(gil);
+
+  PyThread_release_lock(sub->done);
+}
+
+// Runs every substitution in `subs`. External and async ones each get their
+// own thread (their children, or their coroutines on the shell's loop, then
+// run side by side); the ones that call into plain Python run here one after
+// another, since they would only take turns on the GIL anyway.
+void evaluate_substitutions_parallel(Substitution *subs, int count, Arena *arena) {
+  install_stream_routers(); // Keep each thread's sys.stdout binding to itself
+
+  for (int k = 0; k < count; k++) {
+    if (line_uses_python(subs[k].cmd, arena)) continue;
+
+    subs[k].done = PyThread_allocate_lock();
+    if (!subs[k].done) continue;
+    PyThread_acquire_lock(subs[k].done, WAIT_LOCK);
+
+    if (PyThread_start_new_thread(substitution_main, &subs[k]) == PYTHREAD_INVALID_THREAD_ID) {
+      PyThread_release_lock(subs[k].done);
+      PyThread_free_lock(subs[k].done);
+      subs[k].done = NULL;
+    }
+  }
+
+  // Python substitutions (and any that couldn't get a thread) run inline
+  for (int k = 0; k < count; k++) {
+    if (!subs[k].done) subs[k].output = capture_command_output(subs[k].cmd, arena);
   }
 
-  // Import sys
-  PyObject *sys = PyImport_ImportModule("sys");
-  PyObject *py_in = NULL;
-  PyObject *py_out = NULL;
+  for (int k = 0; k < count; k++) {
+    if (!subs[k].done) continue;
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(subs[k].done, WAIT_LOCK);
+    Py_END_ALLOW_THREADS
+    PyThread_release_lock(subs[k].done);
+    PyThread_free_lock(subs[k].done);
+    subs[k].done = NULL;
+  }
+
+  uninstall_stream_routers();
+}
+
+// SUBSHELL EXPANSION ($(cmd) -> Output)
+// The result is allocated from `arena`.
+char* expand_subshells(const char* input, Arena *arena) {
+  // [#1] Find every top-level substitution
+  Substitution *subs = NULL;
+  int sub_count = 0;
+  int sub_capacity = 0;
+  const char *p = input;
 
-  // Redirect STDIN (if needed)
-  if (input_fd != STDIN_FILENO) {
-    // closefd=0 means: Python will NOT close input_fd when py_in is destroyed
-    py_in = PyFile_FromFd(input_fd, "<stdin>", "r", -1, NULL, NULL, NULL, 0);
-    PyObject_SetAttrString(sys, "stdin", py_in);
+  while ((p = strstr(p, "$(")) != NULL) {
+    const char *start = p;
+    p += 2; // Skip $(
+
+    // Extract Inner Command
+    const char *sub_start = p;
+    int paren_depth = 1;
+
+    while (*p) {
+      if (*p == '(') paren_depth++;
+      if (*p == ')') paren_depth--;
+      if (paren_depth == 0) break;
+      p++;
+    }
+
+    size_t sub_len = (size_t)(p - sub_start);
+    if (*p == ')') p++; // Skip closing )
+
+    if (sub_count == sub_capacity) {
+      int new_capacity = sub_capacity ? sub_capacity * 2 : 4;
+      subs = arena_realloc(arena, subs, sizeof(Substitution) * sub_capacity, sizeof(Substitution) * new_capacity);
+      sub_capacity = new_capacity;
+    }
+
+    Substitution *sub = &subs[sub_count++];
+    sub->start = start;
+    sub->end = p;
+    sub->cmd = arena_strndup(arena, sub_start, sub_len);
+    sub->output = NULL;
+    sub->done = NULL;
   }
 
-  // Redirect STDOUT (if needed)
-  if (output_fd != STDOUT_FILENO) {
-    // closefd=0 means: Python will NOT close output_fd when py_out is destroyed
-    py_out = PyFile_FromFd(output_fd, "<stdout>", "w", -1, NULL, NULL, NULL, 0);
-    PyObject_SetAttrString(sys, "stdout", py_out);
+  if (sub_count == 0) return arena_strndup(arena, input, strlen(input));
+
+  // [#2] Execute: side by side when enabled, otherwise in order
+  if (opt_parallel_subshells && sub_count > 1) {
+    evaluate_substitutions_parallel(subs, sub_count, arena);
+  } else {
+    for (int k = 0; k < sub_count; k++) subs[k].output = capture_command_output(subs[k].cmd, arena);
   }
 
-  // CALL THE FUNCTION
-  PyObject *result = PyObject_CallObject(cmd->func, pArgs);
+  // [#3] Substitute the outputs back in their original order
+  StrBuf result;
+  sb_init_arena(&result, arena);
+  p = input;
 
-  // FLUSH STDOUT
-  // Even though we manage the FD, Python has its own buffer we must empty.
-  if (py_out) {
-    PyObject_CallMethod(py_out, "flush", NULL);
+  for (int k = 0; k < sub_count; k++) {
+    sb_append(&result, p, (size_t)(subs[k].start - p));
+    if (subs[k].output) {
+      sb_append(&result, subs[k].output, strlen(subs[k].output));
+      free(subs[k].output);
+    }
+    p = subs[k].end;
   }
+  sb_append(&result, p, strlen(p));
 
-  // RESTORE STREAMS & CLEANUP
-  // Reset sys.stdout to standard output so we don't hold a ref to the pipe
-  PyObject_SetAttrString(sys, "stdin", PySys_GetObject("__stdin__"));
-  PyObject_SetAttrString(sys, "stdout", PySys_GetObject("__stdout__"));
+  return sb_detach(&result);
+}
 
-  // Cleanup our wrapper objects
-  if (py_in) Py_DECREF(py_in);
-  if (py_out) Py_DECREF(py_out);
-  Py_DECREF(pArgs);
-  Py_DECREF(sys);
+// ASSIGNMENT HANDLING (VAR=VAL)
+int handle_assignment(char *input) {
+  // Check for '=' before any space
+  char *equals = strchr(input, '=');
+  char *space = strchr(input, ' ');
 
-  // Handle Errors
-  if (result == NULL) {
-    PyErr_Print(); // Print traceback if Python crashed
+  // If '=' exists and is before any space (e.g. "A=B" not "ls --option=B")
+  if (equals && (!space || equals < space)) {
+    *equals = '\0'; // Split Key and Value
+    char *key = input;
+    char *val = equals + 1;
+
+    // Shell variable; only reaches the environment of children once exported
+    if (var_set(key, val, -1) != 0) {
+      fprintf(stderr, "shell: %s: out of memory\n", key);
+    }
+    return 1; // Handled
+  }
+  return 0; // Not an assignment
+}
+
+// Runs one command line: expansion, assignment or execution. Returns its exit code.
+int process_line(const char *line, int default_in, int default_out) {
+  // Every allocation for this line comes from one arena, released at the end
+  Arena *arena = acquire_arena();
+  if (!arena) {
+    fprintf(stderr, "Error: out of memory\n");
     return 1;
   }
-  Py_DECREF(result);
+  int exit_code = 0;
 
-  return 0;
-}
+  // Expand Variables ($VAR -> VAL)
+  char *expanded_vars = expand_variables(line, arena);
 
-int tokenize_command(char *input_str, char ***argv_ptr) {
-  // Initialize output
-  *argv_ptr = NULL;
-  int argc = 0;
+  // Expand Subshells ($(cmd) -> output)
+  char *final_cmd = expand_subshells(expanded_vars, arena);
 
-  const size_t input_size = strlen(input_str);
-  size_t buff_position = 0;
-  int subshell_depth = 0;
-  char arg_buffer[MAX_CMD_LEN];
-  char current_char;
+  // Handle Assignment (VAR=VAL)
+  // We do this on raw input so expansions don't mess up the assignment syntax
+  if (!handle_assignment(final_cmd)) {
+    // Execute Pipeline
+    exit_code = execute_logic_line(final_cmd, default_in, default_out, arena);
+  }
 
-  // Boolean values for tracking state.
-  bool single_quote = false;
-  bool double_quote = false;
-  bool char_escaped = false;
+  release_arena(arena);
+  return exit_code;
+}
 
-  for (size_t i = 0; i < input_size; i++) {
-    current_char = input_str[i];
+// Runs a script held in `text` (modified in place), one line at a time.
+// Blank lines and lines starting with '#' are skipped, a trailing backslash
+// continues a line and "exit" stops the script.
+// Returns the exit code of the last command, or -1 if a Python signal handler raised.
+int run_script(char *text) {
+  int last_exit_code = 0;
+  char *p = text;
 
-    // [#0] Buffer Overflow Check
-    if (buff_position >= MAX_CMD_LEN - 1) {
-      fprintf(stderr, "Error: Argument exceeds maximum buffer size.\n");
-      return -1;
+  while (*p) {
+    // Find the end of this logical line, joining "\<newline>" continuations
+    char *start = p;
+    char *d = p;
+    while (*p && *p != '\n') {
+      if (*p == '\\' && p[1] == '\n') { p += 2; continue; }
+      if (*p == '\\' && p[1] == '\r' && p[2] == '\n') { p += 3; continue; }
+      *d++ = *p++;
     }
+    if (*p == '\n') p++;
+    if (d > start && d[-1] == '\r') d--; // CRLF scripts
+    *d = '\0';
 
-    // [#1] Escaped Character
-    if (char_escaped) {
-      arg_buffer[buff_position++] = current_char;
-      char_escaped = false;
-    }
+    char *line = start;
+    while (*line == ' ' || *line == '\t') line++;
+    if (*line == '\0' || *line == '#') continue;
+    if (strcmp(line, "exit") == 0) break;
 
-    // [#2] Unquoted Operators (|, <, >, (, ), &)
-    else if (!single_quote && !double_quote && !char_escaped &&
-         (current_char == '|' || current_char == '<' ||
-          current_char == '>' || current_char == '(' || current_char == ')' ||
-          current_char == '&')) {
+    last_exit_code = process_line(line, STDIN_FILENO, STDOUT_FILENO);
 
-      // A. Substitution Start "$("
-      if (current_char == '(' && buff_position > 0 && arg_buffer[buff_position-1] == '$') {
-        subshell_depth++;
-        arg_buffer[buff_position++] = current_char;
-        continue;
-      }
+    // Let Ctrl-C (or any other Python signal handler) stop a long script
+    if (PyErr_CheckSignals() < 0) return -1;
+  }
+  return last_exit_code;
+}
 
-      // B. Substitution End ")"
-      if (current_char == ')' && subshell_depth > 0) {
-        subshell_depth--;
-        arg_buffer[buff_position++] = current_char;
-        continue;
-      }
+// Python Usage: shell_core.run("ls | wc -l") -> exit code
+// Runs one or more lines without touching the terminal or the history.
+static PyObject* shell_run(PyObject *self, PyObject *args) {
+  const char *line;
 
-      // C. Inside Substitution -> Literal
-      if (subshell_depth > 0) {
-        arg_buffer[buff_position++] = current_char;
-        continue;
-      }
+  if (!PyArg_ParseTuple(args, "s", &line)) {
+    return NULL;
+  }
 
-      // --- Delimiter Logic ---
+  char *text = strdup(line);
+  if (!text) return PyErr_NoMemory();
 
-      // 1. Flush current word if exists
-      if (buff_position > 0) {
-        arg_buffer[buff_position] = '\0';
-        add_arg(argv_ptr, &argc, arg_buffer);
-        buff_position = 0;
-      }
+  int exit_code = run_script(text);
+  free(text);
 
-      // 2. Handle Operators as separate args
-      if (current_char == '&' && input_str[i+1] == '&') {
-        add_arg(argv_ptr, &argc, "&&");
-        i++; // Skip the second '&'
-      } else if (current_char == '|' && input_str[i+1] == '|') {
-        add_arg(argv_ptr, &argc, "||");
-        i++; // Skip the second '|'
-      } else if (current_char == '>' && input_str[i+1] == '>') {
-        add_arg(argv_ptr, &argc, ">>");
-        i++; // Skip the second '>'
-      } else {
-        // Catch-all for single operators: >, <, |
-        char op_str[2] = {current_char, '\0'};
-        add_arg(argv_ptr, &argc, op_str);
-      }
-    }
-    // [#3] Whitespace
-    else if (current_char == ' ' || current_char == '\n') {
-      if (single_quote || double_quote || subshell_depth > 0) {
-        arg_buffer[buff_position++] = current_char;
-      } else {
-        if (buff_position > 0) {
-          arg_buffer[buff_position] = '\0';
-          add_arg(argv_ptr, &argc, arg_buffer);
-          buff_position = 0;
-        }
-      }
-    }
+  if (exit_code < 0) return NULL;
+  return PyLong_FromLong(exit_code);
+}
 
-    // [#4] Quotes
-    // Note: We generally DO NOT want to include the quote characters themselves
-    // in the final arg, unless you want the python script to see them.
-    else if (current_char == '\'' && !double_quote) {
-      single_quote = !single_quote;
-    }
-    else if (current_char == '\"' && !single_quote) {
-      double_quote = !double_quote;
-    }
+// Python Usage: shell_core.run_file("script.sh") -> exit code of the last command
+static PyObject* shell_run_file(PyObject *self, PyObject *args) {
+  PyObject *path_obj;
 
-    // [#5] Backslash Start
-    else if (current_char == '\\' && !double_quote && !single_quote) {
-      char_escaped = true;
-    }
+  if (!PyArg_ParseTuple(args, "O&", PyUnicode_FSConverter, &path_obj)) {
+    return NULL;
+  }
+  const char *path = PyBytes_AS_STRING(path_obj);
 
-    // [Final] Regular Char
-    else {
-      arg_buffer[buff_position++] = current_char;
-    }
+  FILE *script = fopen(path, "rb");
+  if (!script) {
+    PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    Py_DECREF(path_obj);
+    return NULL;
   }
 
-  // [CLEAN UP] Flush remaining buffer
-  if (buff_position > 0) {
-    arg_buffer[buff_position] = '\0';
-    add_arg(argv_ptr, &argc, arg_buffer);
+  // Slurp the whole file so run_script can work on it in place
+  size_t capacity = 8192;
+  size_t length = 0;
+  char *text = malloc(capacity);
+  size_t n;
+  while (text && (n = fread(text + length, 1, capacity - length - 1, script)) > 0) {
+    length += n;
+    if (capacity - length - 1 == 0) {
+      capacity *= 2;
+      char *grown = realloc(text, capacity);
+      if (!grown) { free(text); text = NULL; }
+      else text = grown;
+    }
   }
+  fclose(script);
+  Py_DECREF(path_obj);
 
-  return argc;
-}
+  if (!text) return PyErr_NoMemory();
+  text[length] = '\0';
 
+  int exit_code = run_script(text);
+  free(text);
 
-// Helper: Executes a slice of tokens that only contains commands and pipes (|)
-int execute_simple_pipeline(char **tokens, int count, int default_in, int default_out) {
-  int i = 0;
-  int prev_fd = default_in;
-  int pipe_fds[2];
-  pid_t pids[16];
-  int pid_count = 0;
-  int last_exit_code = 0;
+  if (exit_code < 0) return NULL;
+  return PyLong_FromLong(exit_code);
+}
 
-  while (i < count) {
-    char *cmd_argv[64];
-    int cmd_argc = 0;
+// --- THE ENTRY POINT ---
+// Python Usage: shell_core.start(["myshell", "-v"])
+static PyObject* shell_start(PyObject *self, PyObject *args) {
+  PyObject *py_argv;
+  char *prompt = "shell> ";
 
-    int redirect_in_fd = -1;
-    int redirect_out_fd = -1;
+  // Parse the arguments: we expect a List (O!)
+  if (!PyArg_ParseTuple(args, "O!|s", &PyList_Type, &py_argv, &prompt)) {
+    return NULL; // Error if not a list
+  }
 
-    // Extract arguments and handle redirection until we hit a pipe or the end
-    while (i < count && strcmp(tokens[i], "|") != 0) {
+  // Convert Python List -> C argv
+  // This allows you to pass flags to your shell if you want to support them later
+  int argc = (int)PyList_Size(py_argv);
+  char **argv = malloc((argc + 1) * sizeof(char*));
 
-      if (strcmp(tokens[i], "<") == 0) {
-        if (i + 1 < count) {
-          redirect_in_fd = open(tokens[i+1], O_RDONLY);
-          if (redirect_in_fd < 0) perror(tokens[i+1]);
-          i += 2; // Skip operator and filename
-        } else {
-          fprintf(stderr, "syntax error near unexpected token `<'\n");
-          i++;
-        }
-      }
-      else if (strcmp(tokens[i], ">") == 0) {
-        if (i + 1 < count) {
-          redirect_out_fd = open(tokens[i+1], O_WRONLY | O_CREAT | O_TRUNC, FILE_MODE);
-          if (redirect_out_fd < 0) perror(tokens[i+1]);
-          i += 2;
-        } else {
-          fprintf(stderr, "syntax error near unexpected token `>'\n");
-          i++;
-        }
-      }
-      else if (strcmp(tokens[i], ">>") == 0) {
-        if (i + 1 < count) {
-          redirect_out_fd = open(tokens[i+1], O_WRONLY | O_CREAT | O_APPEND, FILE_MODE);
-          if (redirect_out_fd < 0) perror(tokens[i+1]);
-          i += 2;
-        } else {
-          fprintf(stderr, "syntax error near unexpected token `>>'\n");
-          i++;
-        }
-      }
-      else {
-        // Normal argument
-        cmd_argv[cmd_argc++] = tokens[i++];
-      }
+  for (int i = 0; i < argc; i++) {
+    PyObject *item = PyList_GetItem(py_argv, i);
+    if (!PyUnicode_Check(item)) {
+      free(argv);
+      PyErr_SetString(PyExc_TypeError, "shell arguments must be strings");
+      return NULL;
     }
-    cmd_argv[cmd_argc] = NULL;
+    // PyUnicode_AsUTF8 returns a pointer to the internal buffer; do not free it
+    argv[i] = (char*)PyUnicode_AsUTF8(item);
+  }
+  argv[argc] = NULL;
 
-    // Skip execution if no command was given (e.g., just "> file.txt")
-    if (cmd_argc == 0) {
-      if (redirect_in_fd != -1) close(redirect_in_fd);
-      if (redirect_out_fd != -1) close(redirect_out_fd);
-      if (i < count && strcmp(tokens[i], "|") == 0) i++;
+  // We hold the GIL by default here. get_input() releases it while waiting
+  // for keys, and pipelines release it while waiting on their children.
+
+  shell_interactive = 1;
+  path_index_refresh(); // Scan PATH for tab completion while the user starts typing
+  while (1) {
+    notify_jobs();
+    char *raw_input = get_input(prompt);
+    if (raw_input == NULL) break;
+    if (strcmp(raw_input, "exit") == 0) {
+      free(raw_input);
+      break;
+    }
+    if (strlen(raw_input) == 0) {
+      free(raw_input);
       continue;
     }
 
-    // --- PIPELINE SETUP ---
-    int input_fd = prev_fd;
-    int output_fd = default_out;
-    int has_next = (i < count && strcmp(tokens[i], "|") == 0);
+    process_line(raw_input, STDIN_FILENO, STDOUT_FILENO);
+    free(raw_input);
+  }
+  return PyLong_FromLong(0);
+}
 
-    if (has_next) {
-      if (pipe(pipe_fds) == -1) { perror("pipe"); exit(1); }
-      output_fd = pipe_fds[1]; // By default, write to the pipe
-    }
+// Python calls this: shell_core.jobs() -> [{"id": 1, "command": "sleep 5", ...}]
+static PyObject* shell_jobs(PyObject *self, PyObject *args) {
+  reap_jobs();
 
-    // --- REDIRECTION OVERRIDES ---
-    // If the user specified a file, it overrides the pipe or default streams
-    if (redirect_in_fd != -1) {
-      input_fd = redirect_in_fd;
+  PyObject *list = PyList_New(0);
+  if (!list) return NULL;
+
+  for (int i = 0; i < job_count; i++) {
+    Job *job = job_table[i];
+    PyObject *entry = Py_BuildValue("{s:i,s:s,s:O,s:O,s:O}",
+                                    "id", job->id,
+                                    "command", job->command,
+                                    "pid", Py_None,
+                                    "running", job->running > 0 ? Py_True : Py_False,
+                                    "exit_code", Py_None);
+    if (entry && job->run.pgid > 0) {
+      PyObject *pid = PyLong_FromLong((long)job->run.pgid);
+      if (!pid || PyDict_SetItemString(entry, "pid", pid) < 0) Py_CLEAR(entry);
+      Py_XDECREF(pid);
     }
-    if (redirect_out_fd != -1) {
-      // If there's a pipe AND file output (cmd > file | cmd2),
-      // we still open the pipe for the next command, but THIS command writes to the file.
-      output_fd = redirect_out_fd;
+    if (entry && job->running == 0) {
+      PyObject *exit_code = PyLong_FromLong(job->exit_code);
+      if (!exit_code || PyDict_SetItemString(entry, "exit_code", exit_code) < 0) Py_CLEAR(entry);
+      Py_XDECREF(exit_code);
+    }
+    if (!entry || PyList_Append(list, entry) < 0) {
+      Py_XDECREF(entry);
+      Py_DECREF(list);
+      return NULL;
     }
+    Py_DECREF(entry);
+  }
+  return list;
+}
 
-    // --- EXECUTION ---
-    PyCommand *py_cmd = find_python_command(cmd_argv[0]);
-    if (py_cmd) {
-      last_exit_code = execute_python_command(cmd_argv[0], cmd_argv, input_fd, output_fd);
-      pids[pid_count++] = 0;
-    } else {
-      pid_t pid = spawn_command(cmd_argv, input_fd, output_fd);
-      if (pid > 0) pids[pid_count++] = pid;
+// Python calls this: shell_core.wait(job_id=None)
+// Waits for one job (and returns its exit code) or, without an id, for all of them.
+static PyObject* shell_wait(PyObject *self, PyObject *args) {
+  PyObject *job_id = Py_None;
+  if (!PyArg_ParseTuple(args, "|O", &job_id)) {
+    return NULL;
+  }
+
+  if (job_id == Py_None) {
+    while (job_count > 0) {
+      if (wait_for_job(job_table[0]) < 0) return NULL;
+      remove_job(0);
     }
+    return PyLong_FromLong(0);
+  }
 
-    // --- CLEANUP FDs IN PARENT ---
-    // Close pipe ends handed to the child
-    if (input_fd != default_in && input_fd != redirect_in_fd) close(input_fd);
-    if (output_fd != default_out && output_fd != redirect_out_fd) close(output_fd);
+  int index = find_job_index(job_id);
+  if (index < 0) return NULL;
 
-    // Close the opened files
-    if (redirect_in_fd != -1) close(redirect_in_fd);
-    if (redirect_out_fd != -1) close(redirect_out_fd);
+  Job *job = job_table[index];
+  if (wait_for_job(job) < 0) return NULL;
+  int exit_code = job->exit_code;
+  remove_job(index);
+  return PyLong_FromLong(exit_code);
+}
 
-    // --- ADVANCE TO NEXT PIPELINE STAGE ---
-    if (has_next) {
-      prev_fd = pipe_fds[0]; // Next command reads from the pipe
-      i++; // Skip the "|" token
-    }
+// Python calls this: shell_core.fg(job_id=None)
+// Brings a job (the most recent one by default) to the foreground and waits for it.
+static PyObject* shell_fg(PyObject *self, PyObject *args) {
+  PyObject *job_id = Py_None;
+  if (!PyArg_ParseTuple(args, "|O", &job_id)) {
+    return NULL;
   }
 
-  // Wait for all children and capture the exit code of the last command
-  for (int j = 0; j < pid_count; j++) {
-    if (pids[j] > 0) {
-#ifdef _WIN32
-      int status;
-      _cwait(&status, pids[j], 0);
-      last_exit_code = status;
-#else
-      int status;
-      waitpid(pids[j], &status, 0);
-      if (WIFEXITED(status)) last_exit_code = WEXITSTATUS(status);
+  int index = find_job_index(job_id);
+  if (index < 0) return NULL;
+  Job *job = job_table[index];
+
+  fprintf(stderr, "%s\n", job->command);
+
+#ifndef _WIN32
+  // Hand the terminal to the job so Ctrl-C reaches it instead of the shell.
+  // A session's job has no business with the server's terminal.
+  int own_terminal = !shell_serving && job->running > 0 && job->run.pgid > 0 && isatty(STDIN_FILENO) &&
+                     tcsetpgrp(STDIN_FILENO, job->run.pgid) == 0;
+#endif
+
+  int result = wait_for_job(job);
+
+#ifndef _WIN32
+  if (own_terminal) {
+    // We're a background process until this succeeds, so don't get stopped by SIGTTOU
+    sigset_t block, previous;
+    sigemptyset(&block);
+    sigaddset(&block, SIGTTOU);
+    pthread_sigmask(SIG_BLOCK, &block, &previous);
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+  }
 #endif
+
+  if (result < 0) return NULL;
+  int exit_code = job->exit_code;
+  remove_job(index);
+  return PyLong_FromLong(exit_code);
+}
+
+// --- SERVER MODE ---
+// shell_core.serve() hosts many shells in one process, so operators share one
+// Python interpreter and one set of imported plugins instead of starting
+// their own. Every connection on the Unix or TCP socket gets a session with
+// its own line editor, history, variables, working directory and jobs; the
+// command registry is shared. One poll() loop feeds each session's editor
+// whatever bytes arrived. Once a line is complete, the session's state is
+// swapped into the shell's globals and the line runs right there on the loop
+// thread, with the connection as stdout and stderr (and /dev/null as stdin).
+// Other sessions wait in the meantime, so long-running work belongs in the
+// background with "&".
+
+#ifndef _WIN32
+
+// Everything that differs between sessions. While a session runs, this holds
+// the state of whoever was swapped out (the hosting shell).
+typedef struct SessionState {
+  History history;
+  size_t history_view_idx;
+  TrigramPostings *search_index;
+  size_t search_index_capacity;
+  size_t search_index_used;
+  int search_index_built;
+  ShellVar *var_table;
+  size_t var_capacity;
+  size_t var_count;
+  Job **job_table;
+  int job_count;
+  int job_capacity;
+  char *cwd;
+} SessionState;
+
+typedef struct Session {
+  int fd;
+  Editor editor;
+  SessionState state;
+} Session;
+
+static int server_stopping = 0; // Set by shell_core.stop_server()
+
+#define HANGUP_GRACE_SECONDS 5.0 // How long a hung-up job gets before SIGKILL
+
+// Jobs of closed sessions that outlived SIGHUP. The serve loop reaps them
+// without waiting, so one stubborn job can't stall the other sessions.
+typedef struct OrphanJob {
+  Job *job;
+  double deadline;
+  int killed;
+} OrphanJob;
+
+static OrphanJob *orphan_jobs = NULL;
+static size_t orphan_count = 0;
+static size_t orphan_capacity = 0;
+
+static void signal_job(Job *job, int signo) {
+  if (job->run.pgid > 0) kill(-job->run.pgid, signo);
+  else for (int j = 0; j < job->run.pid_count; j++) if (job->run.pids[j] > 0) kill(job->run.pids[j], signo);
+}
+
+// Takes ownership of a hung-up job that's still running. Returns -1 if the
+// list can't grow, in which case the caller still owns it.
+static int adopt_orphan_job(Job *job) {
+  if (orphan_count == orphan_capacity) {
+    size_t new_capacity = orphan_capacity ? orphan_capacity * 2 : 8;
+    OrphanJob *grown = realloc(orphan_jobs, sizeof(OrphanJob) * new_capacity);
+    if (!grown) return -1;
+    orphan_jobs = grown;
+    orphan_capacity = new_capacity;
+  }
+  orphan_jobs[orphan_count].job = job;
+  orphan_jobs[orphan_count].deadline = monotonic_seconds() + HANGUP_GRACE_SECONDS;
+  orphan_jobs[orphan_count].killed = 0;
+  orphan_count++;
+  return 0;
+}
+
+// Frees the orphans that have finished and kills the ones past their grace
+// period. With `force`, kills and waits for all of them (the server is exiting).
+static void reap_orphan_jobs(int force) {
+  double now = monotonic_seconds();
+  size_t kept = 0;
+  for (size_t i = 0; i < orphan_count; i++) {
+    OrphanJob *orphan = &orphan_jobs[i];
+    collect_job(orphan->job, 0);
+    if (orphan->job->running > 0 && !orphan->killed && (force || now >= orphan->deadline)) {
+      signal_job(orphan->job, SIGKILL);
+      orphan->killed = 1;
+    }
+    if (orphan->job->running > 0 && force) collect_job(orphan->job, 1);
+    if (orphan->job->running > 0) {
+      orphan_jobs[kept++] = *orphan;
+      continue;
     }
+    free_job(orphan->job);
+  }
+  orphan_count = kept;
+  if (orphan_count == 0) {
+    free(orphan_jobs);
+    orphan_jobs = NULL;
+    orphan_capacity = 0;
   }
-  return last_exit_code;
 }
 
+#define SESSION_SWAP(type, a, b) do { type swapped = (a); (a) = (b); (b) = swapped; } while (0)
+
+// Exchanges the globals with `state`. Calling it twice restores everything.
+static void session_swap(SessionState *state) {
+  char *old_path = var_get("PATH") ? strdup(var_get("PATH")) : NULL;
+
+  SESSION_SWAP(History, history, state->history);
+  SESSION_SWAP(size_t, history_view_idx, state->history_view_idx);
+  SESSION_SWAP(TrigramPostings*, search_index, state->search_index);
+  SESSION_SWAP(size_t, search_index_capacity, state->search_index_capacity);
+  SESSION_SWAP(size_t, search_index_used, state->search_index_used);
+  SESSION_SWAP(int, search_index_built, state->search_index_built);
+  SESSION_SWAP(ShellVar*, var_table, state->var_table);
+  SESSION_SWAP(size_t, var_capacity, state->var_capacity);
+  SESSION_SWAP(size_t, var_count, state->var_count);
+  SESSION_SWAP(Job**, job_table, state->job_table);
+  SESSION_SWAP(int, job_count, state->job_count);
+  SESSION_SWAP(int, job_capacity, state->job_capacity);
+
+  free(var_envp); // Built from the other table
+  var_envp = NULL;
+  const char *new_path = var_get("PATH");
+  int path_changed = (old_path == NULL) != (new_path == NULL) || (old_path && strcmp(old_path, new_path) != 0);
+  free(old_path);
+
+  char *here = getcwd(NULL, 0);
+  int moved = 0;
+  if (state->cwd && (!here || strcmp(here, state->cwd) != 0)) {
+    moved = (chdir(state->cwd) == 0); // If it was removed, stay where we are
+  }
+  free(state->cwd);
+  state->cwd = here;
 
-// Top-Level
-int execute_logic_line(char *input, int default_in, int default_out) {
-  char **tokens = NULL;
-  int total_tokens = tokenize_command(input, &tokens);
-
-  if (total_tokens <= 0 || tokens == NULL) return 0;
+  if (path_changed || (moved && path_is_relative())) clear_path_cache();
+  if (path_changed) path_index_stale = 1;
+  child_exited = 1; // Jobs may have finished while their session was swapped out
+}
 
-  int i = 0;
-  int last_exit_code = 0;
-  int skip_next = 0; // 0 = execute, 1 = skip
+// Copies the current variables, so a new session starts with the server's.
+static ShellVar* vars_copy(size_t *count) {
+  *count = 0;
+  if (var_capacity == 0) return NULL;
+  ShellVar *copy = calloc(var_capacity, sizeof(ShellVar));
+  if (!copy) return NULL;
+
+  for (size_t i = 0; i < var_capacity; i++) {
+    if (var_table[i].name == NULL) continue;
+    copy[i] = var_table[i];
+    copy[i].name = strdup(var_table[i].name);
+    copy[i].value = var_table[i].value ? strdup(var_table[i].value) : NULL;
+    (*count)++;
+  }
+  return copy;
+}
 
-  while (i < total_tokens) {
-    int start = i;
+static void session_state_free(SessionState *state) {
+  for (size_t i = 0; i < state->history.count; i++) {
+    free(state->history.entries[(state->history.start + i) % state->history.capacity]);
+  }
+  free(state->history.entries);
 
-    // Fast-forward until we hit a logical operator
-    while (i < total_tokens && strcmp(tokens[i], "&&") != 0 && strcmp(tokens[i], "||") != 0) {
-      i++;
-    }
+  for (size_t i = 0; i < state->search_index_capacity; i++) free(state->search_index[i].seqs);
+  free(state->search_index);
 
-    // Execute this chunk if we aren't skipping it
-    if (!skip_next && (i > start)) {
-      last_exit_code = execute_simple_pipeline(&tokens[start], i - start, default_in, default_out);
+  for (size_t i = 0; i < state->var_capacity; i++) {
+    free(state->var_table[i].name);
+    free(state->var_table[i].value);
+  }
+  free(state->var_table);
+
+  // Like a login shell going away: hang up on the jobs. The ones that
+  // don't exit right away are reaped later by the serve loop.
+  for (int i = 0; i < state->job_count; i++) {
+    Job *job = state->job_table[i];
+    if (job->running > 0) {
+      signal_job(job, SIGHUP);
+      collect_job(job, 0);
     }
-
-    // Evaluate the logical operator to decide what to do with the NEXT chunk
-    if (i < total_tokens) {
-      char *op = tokens[i];
-      if (strcmp(op, "&&") == 0) {
-        // AND: Skip next if the current command failed (non-zero)
-        skip_next = (last_exit_code != 0); 
-      } else if (strcmp(op, "||") == 0) {
-        // OR: Skip next if the current command succeeded (zero)
-        skip_next = (last_exit_code == 0); 
-      }
-      i++; // Skip the operator token itself
+    if (job->running > 0 && adopt_orphan_job(job) == 0) continue;
+    if (job->running > 0) {
+      signal_job(job, SIGKILL); // No room to track it, so don't let it linger
+      collect_job(job, 1);
     }
+    free_job(job);
   }
+  free(state->job_table);
+  free(state->cwd);
+}
 
-  // Clean up memory allocated by the tokenizer
-  for (int k = 0; k < total_tokens; k++) free(tokens[k]);
-  free(tokens);
+static Session* session_open(int fd, const char *prompt) {
+  Session *s = calloc(1, sizeof(Session));
+  if (!s) return NULL;
+  s->fd = fd;
+  s->editor.in_fd = fd;
+  s->editor.out_fd = fd;
+
+  s->state.history.append_fd = -1;
+  s->state.history.in_memory = 1;
+  s->state.var_table = vars_copy(&s->state.var_count);
+  s->state.var_capacity = s->state.var_table ? var_capacity : 0;
+  s->state.cwd = getcwd(NULL, 0);
+
+  if (editor_begin(&s->editor, prompt) != 0) {
+    session_state_free(&s->state);
+    free(s);
+    return NULL;
+  }
+  editor_flush(&s->editor);
+  return s;
+}
 
-  return last_exit_code;
+static void session_close(Session *s) {
+  session_state_free(&s->state);
+  free(s->editor.buffer);
+  free(s->editor.out.data);
+  free(s->editor.paste.data);
+  close(s->fd);
+  free(s);
 }
 
+// Runs one line with stderr pointed at the session. Returns 0 for "exit",
+// -1 if a Python exception (such as KeyboardInterrupt) should stop the
+// server, and 1 otherwise.
+static int session_run_line(Session *s, const char *line, int null_in) {
+  if (strcmp(line, "exit") == 0) return 0;
 
+  int saved_stderr = dup(STDERR_FILENO);
+  dup2(s->fd, STDERR_FILENO);
 
-// Exported function callable from Python
-char* get_input(const char* prompt) {
-  printf("%s", prompt);
-  fflush(stdout);
+  int exit_code = 0;
+  if (line[0]) {
+    add_history(line);
+    exit_code = process_line(line, null_in, s->fd);
+  }
+  int failed = exit_code < 0 && PyErr_Occurred();
+  if (!failed) notify_jobs();
+
+  // Tracebacks and warnings went through sys.stderr, which writes to fd 2
+  PyObject *exc_type, *exc_value, *exc_tb;
+  PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+  PyObject *err = PySys_GetObject("stderr"); // Borrowed
+  if (err && err != Py_None) {
+    PyObject *flushed = PyObject_CallMethod(err, "flush", NULL);
+    if (flushed) Py_DECREF(flushed);
+    else PyErr_Clear();
+  }
+  PyErr_Restore(exc_type, exc_value, exc_tb);
+  fflush(stderr);
 
-  enableRawMode(); // Turn off buffering/echo
+  dup2(saved_stderr, STDERR_FILENO);
+  close(saved_stderr);
+  return failed ? -1 : 1;
+}
 
-  // Allocate a buffer for the user's input
-  size_t bufsize = 1024;
-  size_t length = 0;
-  size_t cursor_idx = 0;
-  char* buffer = calloc(bufsize, sizeof(char));
+// Runs every line completed by the session's new input. Returns 1 to keep
+// the session, 0 to close it and -1 to stop the server (exception set).
+static int session_pump(Session *s, const char *prompt, int null_in) {
+  Editor *ed = &s->editor;
+  int status = 1;
 
-  int c;
-  while (1) {
-    c = read_char();
-    if (c == -1) { break; }
-
-    // ---------------------------------------------------------
-    // WINDOWS ARROW KEY LOGIC
-    // ---------------------------------------------------------
-    #ifdef _WIN32
-      // --- 1. HANDLE SPECIAL KEYS (Arrows, F-Keys, etc.) ---
-      // Windows sends 0 or 0xE0 (224) first for special keys
-      if (c == 0 || c == 0xE0) {
-        // Read the SECOND code (the actual scan code)
-        int special = read_char();
-
-        // Handle the logic, but DO NOT print 'special' or 'c'
-        switch (special) {
-          case 72: // UP ARROW
-            if (history_view_idx > 0) {
-              history_view_idx--; // Move backwards
-              replace_line(buffer, &length, &cursor_idx, history[history_view_idx], prompt);
-            }
-            break;
+  session_swap(&s->state);
+  while (status == 1 && !server_stopping) {
+    if (!editor_feed(ed) && !ed->eof) break; // Wait for more input
 
-          case 80: // DOWN ARROW
-            if (history_view_idx < history_count) {
-              history_view_idx++; // Move fowards
-
-              if (history_view_idx == history_count) {
-                // We moved past the last history item, go to empty line.
-                replace_line(buffer, &length, &cursor_idx, "", prompt);
-              }
-              else {
-                // Show next history item
-                replace_line(buffer, &length, &cursor_idx, history[history_view_idx], prompt);
-              }
-            }
-            break;
+    char *line = editor_finish(ed);
+    if (!line) {
+      status = 0; // EOF on an empty line
+      break;
+    }
+    status = session_run_line(s, line, null_in);
+    free(line);
 
-          case 75: // LEFT ARROW (K)
-            if (cursor_idx > 0) {
-              cursor_idx--;
-              printf("\b"); // Visual backspace
-              fflush(stdout);
-            }
-            break;
-          case 77: // RIGHT ARROW (M)
-            if (cursor_idx < length) {
-              cursor_idx++;
-              printf("%c", buffer[cursor_idx-1]);
-              fflush(stdout);
-              // Note: Windows console might need specific API calls for non-destructive move,
-              // but printing the existing char is a cheap hack that works.
-            }
-            break;
-          }
-          // Skip the rest of the loop
-          // Do not let 'c' (0xE0) or 'special' (75) get added to buffer.
-          continue;
-      }
+    if (status == 1 && ed->eof) status = 0;
+    if (status == 1 && editor_begin(ed, prompt) != 0) status = 0;
+  }
+  editor_flush(ed);
+  session_swap(&s->state);
+  return status;
+}
 
-      // --- 2. HANDLE ENTER ---
-      // Windows sends \r (13) for Enter
-      if (c == '\r' && buffer[length] != '\\') {
-        buffer[length] = '\0';
-        printf("\n"); // Visual newline
-        break;        // Stop reading
-      }
+// Opens the listening socket: a str/bytes path for a Unix socket, a
+// (host, port) tuple for TCP. `unix_path` receives the path to unlink later.
+static int server_listen(PyObject *address, PyObject **unix_path) {
+  *unix_path = NULL;
+
+  if (PyTuple_Check(address)) {
+    const char *host;
+    int port;
+    if (!PyArg_ParseTuple(address, "zi;address must be a path or a (host, port) tuple", &host, &port)) return -1;
+    // Sessions aren't authenticated, so only "*" listens on every interface;
+    // no host at all means IPv4 loopback, which is what clients try first
+    int wildcard = host && strcmp(host, "*") == 0;
+    if (wildcard) host = NULL;
+    else if (!host || !host[0]) host = "127.0.0.1";
+
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    struct addrinfo hints, *found = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (wildcard) hints.ai_flags = AI_PASSIVE;
+    int rc = getaddrinfo(host, service, &hints, &found);
+    if (rc != 0) {
+      PyErr_Format(PyExc_OSError, "%s:%d: %s", host ? host : "*", port, gai_strerror(rc));
+      return -1;
+    }
 
-      // --- 3. HANDLE BACKSPACE ---
-      if (c == 8) { // Windows Backspace is 8
-        if (cursor_idx > 0) {
-          // 1. Shift memory left
-          memmove(&buffer[cursor_idx - 1], &buffer[cursor_idx], length - cursor_idx);
-
-          // 2. Update stats
-          cursor_idx--;
-          length--;
-          buffer[length] = '\0'; // Null terminate
-
-          // 3. Visual Update
-          printf("\b"); // Move back
-          printf("%s", &buffer[cursor_idx]); // Print tail
-          printf(" "); // Erase ghost char
-
-          // Move cursor back to correct spot
-          int steps = length - cursor_idx + 1;
-          for(int i=0; i<steps; i++) printf("\b");
-          fflush(stdout);
-        }
+    int fd = -1;
+    int saved_errno = 0;
+    for (struct addrinfo *ai = found; ai; ai = ai->ai_next) {
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd < 0) {
+        saved_errno = errno;
         continue;
       }
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      int on = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) break;
+      saved_errno = errno;
+      close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(found);
+    if (fd < 0) {
+      errno = saved_errno;
+      PyErr_SetFromErrno(PyExc_OSError);
+    }
+    return fd;
+  }
 
-      if (c >= 32 && c <= 126) {
-        if (cursor_idx < length) {
-        // INSERT MODE LOGIC
-
-        // 1. Shift Right (Include +1 for Null Terminator!)
-        memmove(&buffer[cursor_idx + 1], &buffer[cursor_idx], length - cursor_idx + 1);
-
-        // 2. Insert Char
-        buffer[cursor_idx] = c;
-        length++;
-        buffer[length] = '\0';
+  PyObject *path_obj;
+  if (!PyUnicode_FSConverter(address, &path_obj)) return -1;
+  const char *path = PyBytes_AS_STRING(path_obj);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    PyErr_Format(PyExc_ValueError, "socket path is too long: %s", path);
+    Py_DECREF(path_obj);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0) fcntl(fd, F_SETFD, FD_CLOEXEC);
+  if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+    PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    if (fd >= 0) close(fd);
+    Py_DECREF(path_obj);
+    return -1;
+  }
+  *unix_path = path_obj;
+  return fd;
+}
 
-        // 3. Print New Char
-        printf("%c", c);
+#endif
 
-        // 4. Print the shifted tail
-        printf("%s", &buffer[cursor_idx + 1]);
+// Python Usage: shell_core.serve("/tmp/shell.sock") or shell_core.serve(("127.0.0.1", 4000))
+// Blocks until stop_server() is called or a signal handler raises.
+static PyObject* shell_serve(PyObject *self, PyObject *args, PyObject *kwargs) {
+  static char *keywords[] = {"address", "prompt", NULL};
+  PyObject *address;
+  const char *prompt = "shell> ";
 
-        // 5. Move Cursor Back
-        int steps = length - (cursor_idx + 1);
-        for(int i=0; i<steps; i++) printf("\b");
-        fflush(stdout);
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|s", keywords, &address, &prompt)) {
+    return NULL;
+  }
 
-        cursor_idx++;
-      } else {
-        // APPEND MODE
-        buffer[cursor_idx] = c;
-        length++;
-        buffer[length] = '\0';
-        cursor_idx++;
-        printf("%c", c);
-        fflush(stdout);
+#ifdef _WIN32
+  PyErr_SetString(PyExc_NotImplementedError, "serve() is not supported on Windows");
+  return NULL;
+#else
+  PyObject *unix_path;
+  int listen_fd = server_listen(address, &unix_path);
+  if (listen_fd < 0) return NULL;
+
+  int null_in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  vars_load(); // Sessions start from a copy of these
+  install_sigchld_handler();
+  int was_interactive = shell_interactive;
+  shell_interactive = 1;
+  shell_serving = 1;
+  server_stopping = 0;
+
+  Session **sessions = NULL;
+  struct pollfd *fds = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  int failed = 0;
+
+  while (!server_stopping && !failed) {
+    if (count + 1 > capacity) {
+      size_t new_capacity = capacity ? capacity * 2 : 16;
+      Session **grown = realloc(sessions, sizeof(Session*) * new_capacity);
+      if (grown) sessions = grown;
+      struct pollfd *grown_fds = realloc(fds, sizeof(struct pollfd) * (new_capacity + 1));
+      if (grown_fds) fds = grown_fds;
+      if (!grown || !grown_fds) {
+        PyErr_NoMemory();
+        break;
       }
+      capacity = new_capacity;
     }
-  }
 
-  buffer[length] = '\0'; // Ensure final string is safe
-  disableRawMode();
-  add_history(buffer);
-  return buffer;
-
-    #else
-    // ---------------------------------------------------------
-    // LINUX / MACOS LOGIC
-    // ---------------------------------------------------------
-      if (c == '\033') { // Escape sequence
-        char seq[2];
-        // Read the next two bytes immediately
-        if (read(STDIN_FILENO, &seq[0], 1) == 0) return buffer;
-        if (read(STDIN_FILENO, &seq[1], 1) == 0) return buffer;
-
-        if (seq[0] == '[') { // Its an arrow key
-          switch (seq[1]) {
-
-            case 'A': // UP ARROW
-              if (history_view_idx > 0) {
-                history_view_idx--; // Move backwards
-                replace_line(buffer, &length, &cursor_idx, history[history_view_idx], prompt);
-              }
-              break;
-
-            case 'B': // DOWN ARROW
-              if (history_view_idx < history_count) {
-                history_view_idx++; // Move fowards
-
-                if (history_view_idx == history_count) {
-                  // We moved past the last history item, go to empty line.
-                  replace_line(buffer, &length, &cursor_idx, "", prompt);
-                }
-                else {
-                  // Show next history item
-                  replace_line(buffer, &length, &cursor_idx, history[history_view_idx], prompt);
-                }
-              }
-              break;
-
-            case 'D': // LEFT ARROW
-              if (cursor_idx > 0) {
-                cursor_idx--;
-                printf("\033[D"); // ANSI code to move cursor left visually
-                fflush(stdout);
-              }
-              break;
-            case 'C': // RIGHT ARROW
-              if (cursor_idx < length) {
-                cursor_idx++;
-                printf("\033[C"); // ANSI code to move cursor right visually
-                fflush(stdout);
-              }
-              break;
-          }
-        }
-        continue; // Continue so the \033 doesn't get added to the output buffer.
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    for (size_t i = 0; i < count; i++) {
+      fds[i + 1].fd = sessions[i]->fd;
+      fds[i + 1].events = POLLIN;
     }
 
-
-      /* [UNIX ENTER]
-         Reset the cursor_idx and length, move to
-         the next line, and break the loop.
-      */
-      if ((c == '\n' || c == '\r') && buffer[length] != '\\') { // User hit Enter
-          buffer[length] = '\0';
-          printf("\r\n"); // Move to next line visually
-          break;
+    int ready;
+    Py_BEGIN_ALLOW_THREADS
+    ready = poll(fds, (nfds_t)(count + 1), orphan_count ? 250 : -1);
+    Py_END_ALLOW_THREADS
+    if (ready < 0) {
+      if (errno != EINTR) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        break;
+      }
+      if (PyErr_CheckSignals() < 0) break; // Ctrl-C on the server
+      continue;
+    }
+    if (orphan_count) reap_orphan_jobs(0);
+
+    // Newest first, so closing a session doesn't move the ones still to visit
+    for (size_t i = count; i-- > 0;) {
+      if (!(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+      Session *s = sessions[i];
+      Editor *ed = &s->editor;
+
+      ssize_t n;
+      do {
+        n = read(s->fd, ed->input, sizeof(ed->input));
+      } while (n < 0 && errno == EINTR);
+      if (n <= 0) {
+        ed->eof = 1; // Hung up (or the connection broke)
+      } else {
+        ed->input_pos = 0;
+        ed->input_len = (size_t)n;
       }
 
-      /* [UNIX BACKSPACE]
-         We do some left buffer shifting, then reprint.
-      */
-      else if (c == 127) {
-        if (cursor_idx > 0) { // Make sure we aren't at the start of the line.
-
-          if (cursor_idx < length) {
-            memmove(&buffer[cursor_idx - 1], &buffer[cursor_idx], length - cursor_idx); // Shift buffer left one
-          }
-
-
-          cursor_idx--;
-          length--;
-          buffer[length] = '\0';
-          printf("\b"); // Visual backspace
-          printf("%s", &buffer[cursor_idx]); // Print the tail
-          printf(" "); // Erase ghost char
-
-
-          size_t steps_back = (length - cursor_idx) + 1;  //
-          for (size_t i = 0; i < steps_back; i++) {       //
-            printf("\033[D");                             //  Fix cursor position
-          }                                               //
+      int status = session_pump(s, prompt, null_in);
+      if (status <= 0) {
+        session_close(s);
+        memmove(&sessions[i], &sessions[i + 1], sizeof(Session*) * (count - i - 1));
+        count--;
+      }
+      if (status < 0) {
+        failed = 1;
+        break;
+      }
+    }
 
-          fflush(stdout);
-        }
+    if (!failed && (fds[0].revents & POLLIN)) {
+      int fd = accept(listen_fd, NULL, NULL);
+      if (fd >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        Session *s = session_open(fd, prompt);
+        if (s) sessions[count++] = s;
+        else close(fd);
       }
+    }
+  }
+
+  // Hanging up on the sessions' jobs may call into Python
+  PyObject *exc_type, *exc_value, *exc_tb;
+  PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+  for (size_t i = 0; i < count; i++) session_close(sessions[i]);
+  reap_orphan_jobs(1);
+  PyErr_Restore(exc_type, exc_value, exc_tb);
+  free(sessions);
+  free(fds);
+  close(listen_fd);
+  if (null_in >= 0) close(null_in);
+  if (unix_path) {
+    unlink(PyBytes_AS_STRING(unix_path));
+    Py_DECREF(unix_path);
+  }
+  shell_interactive = was_interactive;
+  shell_serving = 0;
+  server_stopping = 0;
 
-    /* [NORMAL TYPING - MIDDLE OF STRING]
-       We do some right buffer shifting and reprinting.
-    */
-    else if (cursor_idx < length) {
-      // [#1] Shift the memory.
-      memmove(&buffer[cursor_idx + 1], &buffer[cursor_idx], length - cursor_idx);
+  if (PyErr_Occurred()) return NULL;
+  Py_RETURN_NONE;
+#endif
+}
 
-      // Insert the new char
-      buffer[cursor_idx] = c;
-      length++; // Total string got longer
+// Python Usage: shell_core.stop_server() -> serve() returns once the current line is done
+static PyObject* shell_stop_server(PyObject *self, PyObject *args) {
+#ifndef _WIN32
+  server_stopping = 1;
+#endif
+  Py_RETURN_NONE;
+}
 
+// --- PARALLEL MAP ---
+// shell_core.pmap runs one registered command over many input lines. Items
+// are cut into batches; sys.stdout is bound to a StringIO once per batch and
+// each item's output is sliced back out of it afterwards, so the per-item
+// cost is just the call. Batches run on forked workers where the GIL would
+// serialize threads, and on threads on free-threaded builds and Windows.
 
-      // [#2] Redraw the visuals.
-      printf("%c", c);
-      printf("%s", &buffer[cursor_idx + 1]);
+#if defined(_WIN32) || defined(Py_GIL_DISABLED)
+  #define PMAP_USE_THREADS 1
+#else
+  #define PMAP_USE_THREADS 0
+#endif
 
+typedef struct PmapTask {
+  PyObject *func;      // The command's callable
+  PyObject *prefix;    // (name, *args): every call gets these, then the item
+  PyObject *items;     // List of str
+  Py_ssize_t count;
+  Py_ssize_t batch_size;
+  Py_ssize_t batch_count;
+} PmapTask;
+
+// Runs one batch with sys.stdout bound to a single StringIO. Returns a list
+// with each item's output, or NULL on error. status[i] is set to 1 for items
+// whose call raised (the traceback goes to stderr) or returned a non-zero
+// status, as the same call on a command line would.
+static PyObject* pmap_run_batch(PmapTask *task, Py_ssize_t batch, char *status) {
+  Py_ssize_t start = batch * task->batch_size;
+  Py_ssize_t end = start + task->batch_size;
+  if (end > task->count) end = task->count;
+
+  PyObject *io = PyImport_ImportModule("io");
+  if (!io) return NULL;
+  PyObject *capture = PyObject_CallMethod(io, "StringIO", NULL);
+  Py_DECREF(io);
+  if (!capture) return NULL;
+
+  Py_ssize_t *ends = PyMem_Malloc(sizeof(Py_ssize_t) * (end - start));
+  if (!ends) {
+    Py_DECREF(capture);
+    return PyErr_NoMemory();
+  }
 
-      // [#3] Fix the cursor position.
-      size_t steps_back = length - (cursor_idx + 1);
-      for (size_t i = 0; i < steps_back; i++) {
-          printf("\033[D");
+  StreamBinding out_binding = {0};
+  bind_stream(&out_binding, stdout_router, capture);
+
+  Py_ssize_t prefix_len = PyTuple_GET_SIZE(task->prefix);
+  Py_ssize_t position = 0;
+  for (Py_ssize_t i = start; i < end; i++) {
+    PyObject *call_args = PyTuple_New(prefix_len + 1);
+    PyObject *result = NULL;
+    if (call_args) {
+      for (Py_ssize_t k = 0; k < prefix_len; k++) {
+        PyObject *arg = PyTuple_GET_ITEM(task->prefix, k);
+        Py_INCREF(arg);
+        PyTuple_SET_ITEM(call_args, k, arg);
       }
+      PyObject *item = PyList_GET_ITEM(task->items, i);
+      Py_INCREF(item);
+      PyTuple_SET_ITEM(call_args, prefix_len, item);
+      result = PyObject_Call(task->func, call_args, NULL);
+      Py_DECREF(call_args);
+      if (result && PyCoro_CheckExact(result)) Py_SETREF(result, await_on_loop(result));
+    }
 
-      // Increment our logical cursor position
-      cursor_idx++;
+    status[i - start] = (result == NULL || exit_status_of(result) != 0);
+    if (result) Py_DECREF(result);
+    else PyErr_Print();
 
-      // Flush stdout
-      fflush(stdout);
+    // Where this item's output ends (unchanged if the StringIO was tampered with)
+    PyObject *tell = PyObject_CallMethod(capture, "tell", NULL);
+    if (tell) {
+      Py_ssize_t now = PyLong_AsSsize_t(tell);
+      if (now >= position) position = now;
+      Py_DECREF(tell);
     }
+    PyErr_Clear();
+    ends[i - start] = position;
+  }
 
-    // [NORMAL TYPING - END OF STRING]
-    // Nothing fancy here, just append it and print it.
-    else {
-      buffer[cursor_idx] = c;
-      length++;
-      printf("%c", c); // Manual echo
-      cursor_idx++;
-      fflush(stdout);
+  unbind_stream(&out_binding);
+
+  PyObject *outputs = NULL;
+  PyObject *text = PyObject_CallMethod(capture, "getvalue", NULL);
+  if (text) {
+    outputs = PyList_New(end - start);
+    Py_ssize_t from = 0;
+    for (Py_ssize_t i = 0; outputs && i < end - start; i++) {
+      PyObject *piece = PyUnicode_Substring(text, from, ends[i]);
+      if (!piece) Py_CLEAR(outputs);
+      else PyList_SET_ITEM(outputs, i, piece);
+      from = ends[i];
     }
-
-    // TODO: Add buffer resizing logic here if position >= bufsize
+    Py_DECREF(text);
   }
 
-  disableRawMode(); // Restore terminal for Python
-  add_history(buffer);
-  return buffer; // Return the pointer to Python
-  #endif
+  PyMem_Free(ends);
+  Py_DECREF(capture);
+  return outputs;
 }
 
-// --- EXPANSION HELPERS ---
+// Writes one item's output to the shell's stdout.
+static int pmap_emit(PyObject *out, PyObject *text) {
+  if (PyUnicode_GET_LENGTH(text) == 0) return 0;
+  PyObject *written = PyObject_CallMethod(out, "write", "O", text);
+  if (!written) return -1;
+  Py_DECREF(written);
+  return 0;
+}
 
-// VARIABLE EXPANSION ($VAR -> Value)
-char* expand_variables(const char* input) {
-  char *result = malloc(MAX_CMD_LEN);
-  const char *p = input;
-  char *d = result;
+#if PMAP_USE_THREADS
 
-  while (*p) {
-    if (*p == '$' && *(p+1) != '(') { // Found $, but not $(
-      p++; // Skip $
+typedef struct PmapShared {
+  PmapTask *task;
+  PyThread_type_lock queue_lock;  // Guards next_batch
+  Py_ssize_t next_batch;
+  PyObject **outputs;             // Per batch, set by the worker that ran it
+  char *status;                   // Per item
+  PyThread_type_lock *done;       // Per batch, held until it has run
+  PyThread_type_lock finished;    // Released by the last worker to exit
+  int workers_left;               // Guarded by queue_lock
+} PmapShared;
 
-      // Extract Var Name
-      char var_name[128];
-      int i = 0;
-      while (isalnum(*p) || *p == '_') {
-        var_name[i++] = *p++;
-      }
-      var_name[i] = '\0';
+static void pmap_thread_main(void *arg) {
+  PmapShared *shared = arg;
+  PmapTask *task = shared->task;
 
-      // Get Value
-      char *val = getenv(var_name);
-      if (val) {
-        strcpy(d, val);
-        d += strlen(val);
-      }
-    } else {
-      *d++ = *p++;
-    }
+  PyGILState_STATE gil = PyGILState_Ensure();
+  while (1) {
+    PyThread_acquire_lock(shared->queue_lock, WAIT_LOCK);
+    Py_ssize_t batch = shared->next_batch++;
+    PyThread_release_lock(shared->queue_lock);
+    if (batch >= task->batch_count) break;
+
+    shared->outputs[batch] = pmap_run_batch(task, batch, shared->status + batch * task->batch_size);
+    if (!shared->outputs[batch]) PyErr_Print();
+    PyThread_release_lock(shared->done[batch]);
   }
-  *d = '\0';
-  return result;
+  PyGILState_Release(gil);
+
+  PyThread_acquire_lock(shared->queue_lock, WAIT_LOCK);
+  int last = (--shared->workers_left == 0);
+  PyThread_release_lock(shared->queue_lock);
+  if (last) PyThread_release_lock(shared->finished);
 }
 
-// CAPTURE OUTPUT (Runs a command and returns its stdout)
-// Forward declarations for mutual recursion
-char* expand_variables(const char* input);
-char* expand_subshells(const char* input);
+// Thread pool: batches are handed out from a shared counter and emitted in
+// input order as each one completes.
+static Py_ssize_t pmap_run_parallel(PmapTask *task, int jobs, int ordered, PyObject *out) {
+  (void)ordered; // Batches are always emitted in order here
+  Py_ssize_t failed = -1;
+
+  PmapShared shared = {0};
+  shared.task = task;
+  shared.queue_lock = PyThread_allocate_lock();
+  shared.finished = PyThread_allocate_lock();
+  shared.outputs = calloc(task->batch_count, sizeof(PyObject*));
+  shared.status = calloc(task->count, 1);
+  shared.done = calloc(task->batch_count, sizeof(PyThread_type_lock));
+  Py_ssize_t locks = 0;
+  if (!shared.queue_lock || !shared.finished || !shared.outputs || !shared.status || !shared.done) {
+    PyErr_NoMemory();
+    goto cleanup;
+  }
+  for (; locks < task->batch_count; locks++) {
+    shared.done[locks] = PyThread_allocate_lock();
+    if (!shared.done[locks]) {
+      PyErr_NoMemory();
+      goto cleanup;
+    }
+    PyThread_acquire_lock(shared.done[locks], WAIT_LOCK);
+  }
+
+  install_stream_routers(); // Each worker binds its own StringIO
+  PyThread_acquire_lock(shared.finished, WAIT_LOCK);
+  shared.workers_left = jobs;
+  int started = 0;
+  for (int w = 0; w < jobs; w++) {
+    if (PyThread_start_new_thread(pmap_thread_main, &shared) == PYTHREAD_INVALID_THREAD_ID) break;
+    started++;
+  }
+  PyThread_acquire_lock(shared.queue_lock, WAIT_LOCK);
+  shared.workers_left -= jobs - started;
+  int none_running = (shared.workers_left == 0);
+  PyThread_release_lock(shared.queue_lock);
+
+  if (none_running) {
+    // No thread could be started: do the work here
+    PyThread_release_lock(shared.finished);
+    for (Py_ssize_t b = 0; b < task->batch_count; b++) {
+      shared.outputs[b] = pmap_run_batch(task, b, shared.status + b * task->batch_size);
+      if (!shared.outputs[b]) PyErr_Print();
+      PyThread_release_lock(shared.done[b]);
+    }
+  }
 
-char* capture_command_output(char *cmd) {
-  FILE *tmp = tmpfile();
-  if (!tmp) return strdup("");
+  int emit_failed = 0;
+  for (Py_ssize_t b = 0; b < task->batch_count; b++) {
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(shared.done[b], WAIT_LOCK);
+    Py_END_ALLOW_THREADS
+    PyObject *outputs = shared.outputs[b];
+    for (Py_ssize_t i = 0; outputs && !emit_failed && i < PyList_GET_SIZE(outputs); i++) {
+      if (pmap_emit(out, PyList_GET_ITEM(outputs, i)) < 0) emit_failed = 1;
+    }
+    if (!outputs) {
+      // The batch itself failed: count all of its items
+      Py_ssize_t first = b * task->batch_size;
+      Py_ssize_t n = task->count - first < task->batch_size ? task->count - first : task->batch_size;
+      memset(shared.status + first, 1, n);
+    }
+  }
 
-  int tmp_fd = fileno(tmp);
+  Py_BEGIN_ALLOW_THREADS
+  PyThread_acquire_lock(shared.finished, WAIT_LOCK); // Every worker has left Python
+  Py_END_ALLOW_THREADS
+  uninstall_stream_routers();
 
-  char *expanded_vars = expand_variables(cmd);
-  char *final_cmd = expand_subshells(expanded_vars);
+  if (!emit_failed) {
+    failed = 0;
+    for (Py_ssize_t i = 0; i < task->count; i++) failed += shared.status[i];
+  }
 
-  // Pass the temporary file descriptor directly into the pipeline
-  execute_logic_line(final_cmd, STDIN_FILENO, tmp_fd);
+cleanup:
+  for (Py_ssize_t b = 0; shared.outputs && b < task->batch_count; b++) Py_XDECREF(shared.outputs[b]);
+  for (Py_ssize_t b = 0; b < locks; b++) PyThread_free_lock(shared.done[b]);
+  if (shared.queue_lock) PyThread_free_lock(shared.queue_lock);
+  if (shared.finished) PyThread_free_lock(shared.finished);
+  free(shared.outputs);
+  free(shared.status);
+  free(shared.done);
+  return failed;
+}
 
-  // Clean up allocated strings
-  free(expanded_vars);
-  free(final_cmd);
+#else
 
-  fflush(stdout);
-  rewind(tmp);
+// Frame a forked worker sends for each item: this header, then `length` bytes of UTF-8.
+typedef struct PmapFrame {
+  uint32_t index;
+  uint32_t failed;
+  uint32_t length;
+} PmapFrame;
+
+static int write_all(int fd, const char *data, size_t n) {
+  while (n > 0) {
+    ssize_t written = write(fd, data, n);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    data += written;
+    n -= written;
+  }
+  return 0;
+}
 
-  char buffer[4096];
-  memset(buffer, 0, sizeof(buffer));
-  size_t n = fread(buffer, 1, sizeof(buffer) - 1, tmp);
-  fclose(tmp);
+// Body of a forked worker: runs every jobs-th batch starting at `worker` and
+// streams framed results up the pipe. Never returns.
+static void pmap_child_main(PmapTask *task, int worker, int jobs, int fd) {
+  char *status = malloc(task->batch_size);
+  StrBuf frame;
+  sb_init(&frame);
+
+  for (Py_ssize_t b = worker; status && b < task->batch_count; b += jobs) {
+    PyObject *outputs = pmap_run_batch(task, b, status);
+    if (!outputs) {
+      PyErr_Print();
+      break;
+    }
 
-  if (n > 0 && buffer[n-1] == '\n') {
-    buffer[n-1] = '\0';
-  } else {
-    buffer[n] = '\0';
+    frame.len = 0;
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(outputs); i++) {
+      Py_ssize_t size = 0;
+      const char *utf8 = PyUnicode_AsUTF8AndSize(PyList_GET_ITEM(outputs, i), &size);
+      if (!utf8) {
+        PyErr_Clear();
+        utf8 = "";
+        size = 0;
+      }
+      PmapFrame header = {(uint32_t)(b * task->batch_size + i), (uint32_t)status[i], (uint32_t)size};
+      sb_append(&frame, (const char*)&header, sizeof(header));
+      sb_append(&frame, utf8, size);
+    }
+    Py_DECREF(outputs);
+    if (write_all(fd, frame.data, frame.len) < 0) break; // Parent is gone
   }
 
-  return strdup(buffer);
+  // Tracebacks go through Python's buffered stderr
+  PyObject *err = PySys_GetObject("stderr");
+  if (err) {
+    PyObject *flushed = PyObject_CallMethod(err, "flush", NULL);
+    Py_XDECREF(flushed);
+  }
+  _exit(0);
 }
 
+// Forked workers: each takes a fixed share of the batches and streams its
+// results back through a pipe, which the parent polls. With `ordered`,
+// outputs are held until everything before them has been written.
+static Py_ssize_t pmap_run_parallel(PmapTask *task, int jobs, int ordered, PyObject *out) {
+  Py_ssize_t failed = -1;
+  pid_t *pids = calloc(jobs, sizeof(pid_t));
+  struct pollfd *fds = calloc(jobs, sizeof(struct pollfd));
+  StrBuf *inbox = calloc(jobs, sizeof(StrBuf));
+  PyObject **results = calloc(task->count, sizeof(PyObject*));
+  char *status = malloc(task->count);
+  if (!pids || !fds || !inbox || !results || !status) {
+    PyErr_NoMemory();
+    goto cleanup;
+  }
+  memset(status, 1, task->count); // Items never reported back count as failed
+
+  // Don't let buffered output be written once per child as well
+  const char *streams[2] = {"stdout", "stderr"};
+  for (int k = 0; k < 2; k++) {
+    PyObject *stream = PySys_GetObject(streams[k]);
+    PyObject *flushed = stream ? PyObject_CallMethod(stream, "flush", NULL) : NULL;
+    if (flushed) Py_DECREF(flushed);
+    else PyErr_Clear();
+  }
 
-// SUBSHELL EXPANSION ($(cmd) -> Output)
-char* expand_subshells(const char* input) {
-  char *result = malloc(MAX_CMD_LEN);
-  const char *p = input;
-  char *d = result;
+  int started = 0;
+  for (int w = 0; w < jobs; w++) {
+    int pipe_fds[2];
+    if (make_pipe(pipe_fds) == -1) break;
 
-  while (*p) {
-    if (*p == '$' && *(p+1) == '(') {
-      // Found start of $()
-      p += 2; // Skip $(
+    PyOS_BeforeFork();
+    pid_t pid = fork();
+    if (pid == 0) {
+      PyOS_AfterFork_Child();
+      close(pipe_fds[0]);
+      pmap_child_main(task, w, jobs, pipe_fds[1]);
+    }
+    PyOS_AfterFork_Parent();
 
-      // Extract Inner Command
-      char sub_cmd[MAX_CMD_LEN];
-      int i = 0;
-      int paren_depth = 1;
+    close(pipe_fds[1]);
+    if (pid < 0) {
+      close(pipe_fds[0]);
+      break;
+    }
+    pids[started] = pid;
+    fds[started].fd = pipe_fds[0];
+    fds[started].events = POLLIN;
+    sb_init(&inbox[started]);
+    started++;
+  }
+  if (started == 0) {
+    PyErr_SetFromErrno(PyExc_OSError);
+    goto cleanup;
+  }
+  if (started < jobs) {
+    // Batches are striped across `jobs` workers; the missing ones run here
+    for (int w = started; w < jobs; w++) {
+      for (Py_ssize_t b = w; b < task->batch_count; b += jobs) {
+        PyObject *outputs = pmap_run_batch(task, b, status + b * task->batch_size);
+        if (!outputs) {
+          PyErr_Print();
+          continue;
+        }
+        for (Py_ssize_t i = 0; i < PyList_GET_SIZE(outputs); i++) {
+          PyObject *piece = PyList_GET_ITEM(outputs, i);
+          Py_INCREF(piece);
+          results[b * task->batch_size + i] = piece;
+        }
+        Py_DECREF(outputs);
+      }
+    }
+  }
 
-      while (*p && paren_depth > 0) {
-        if (*p == '(') paren_depth++;
-        if (*p == ')') paren_depth--;
+  Py_ssize_t next_emit = 0;
+  int open_pipes = started;
+  int emit_failed = 0;
+  int interrupted = 0;
+  char chunk[65536];
+
+  while (open_pipes > 0 && !emit_failed) {
+    int ready;
+    Py_BEGIN_ALLOW_THREADS
+    ready = poll(fds, started, -1);
+    Py_END_ALLOW_THREADS
+    if (ready < 0) {
+      if (errno == EINTR && PyErr_CheckSignals() == 0) continue;
+      interrupted = 1;
+      break;
+    }
 
-        if (paren_depth > 0) sub_cmd[i++] = *p++;
+    for (int w = 0; w < started; w++) {
+      if (fds[w].fd < 0 || !(fds[w].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+      ssize_t n;
+      Py_BEGIN_ALLOW_THREADS
+      n = read(fds[w].fd, chunk, sizeof(chunk));
+      Py_END_ALLOW_THREADS
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+        close(fds[w].fd);
+        fds[w].fd = -1; // poll() skips negative fds
+        open_pipes--;
+        continue;
       }
-      p++; // Skip closing )
-      sub_cmd[i] = '\0';
-
-      // Execute and Substitute
-      char *output = capture_command_output(sub_cmd);
-      if (output) {
-        strcpy(d, output);
-        d += strlen(output);
-        free(output);
+      sb_append(&inbox[w], chunk, n);
+
+      // Take every complete frame
+      size_t pos = 0;
+      while (inbox[w].len - pos >= sizeof(PmapFrame)) {
+        PmapFrame header;
+        memcpy(&header, inbox[w].data + pos, sizeof(header));
+        if (inbox[w].len - pos - sizeof(header) < header.length) break;
+
+        const char *data = inbox[w].data + pos + sizeof(header);
+        pos += sizeof(header) + header.length;
+        if (header.index >= (uint32_t)task->count) continue;
+
+        PyObject *text = PyUnicode_DecodeUTF8(data, header.length, "replace");
+        if (!text) {
+          PyErr_Clear();
+          continue;
+        }
+        status[header.index] = (char)header.failed;
+        if (ordered) {
+          Py_XSETREF(results[header.index], text);
+        } else {
+          if (pmap_emit(out, text) < 0) emit_failed = 1;
+          Py_DECREF(text);
+        }
       }
-    } else {
-      *d++ = *p++;
+      memmove(inbox[w].data, inbox[w].data + pos, inbox[w].len - pos);
+      inbox[w].len -= pos;
     }
-  }
-  *d = '\0';
-  return result;
-}
 
-// ASSIGNMENT HANDLING (VAR=VAL)
-int handle_assignment(char *input) {
-  // Check for '=' before any space
-  char *equals = strchr(input, '=');
-  char *space = strchr(input, ' ');
+    // Write out everything that is now in sequence
+    while (ordered && !emit_failed && next_emit < task->count && results[next_emit]) {
+      if (pmap_emit(out, results[next_emit]) < 0) emit_failed = 1;
+      Py_CLEAR(results[next_emit]);
+      next_emit++;
+    }
+  }
 
-  // If '=' exists and is before any space (e.g. "A=B" not "ls --option=B")
-  if (equals && (!space || equals < space)) {
-    *equals = '\0'; // Split Key and Value
-    char *key = input;
-    char *val = equals + 1;
+  // Items whose worker died never arrive; write whatever came after them
+  for (; ordered && !emit_failed && !interrupted && next_emit < task->count; next_emit++) {
+    if (results[next_emit] && pmap_emit(out, results[next_emit]) < 0) emit_failed = 1;
+  }
 
-    // Using setenv (overwrite=1)
-    if (setenv(key, val, 1) != 0) {
-      perror("setenv");
+  for (int w = 0; w < started; w++) {
+    if (fds[w].fd >= 0) {
+      kill(pids[w], SIGTERM); // Only still running if we stopped early
+      close(fds[w].fd);
     }
-    return 1; // Handled
+    Py_BEGIN_ALLOW_THREADS
+    while (waitpid(pids[w], NULL, 0) == -1 && errno == EINTR);
+    Py_END_ALLOW_THREADS
   }
-  return 0; // Not an assignment
+  for (int w = 0; w < started; w++) free(inbox[w].data);
+
+  if (!emit_failed && !interrupted) {
+    failed = 0;
+    for (Py_ssize_t i = 0; i < task->count; i++) failed += status[i];
+  }
+
+cleanup:
+  for (Py_ssize_t i = 0; results && i < task->count; i++) Py_XDECREF(results[i]);
+  free(results);
+  free(status);
+  free(inbox);
+  free(fds);
+  free(pids);
+  return failed;
 }
 
-// --- THE ENTRY POINT ---
-// Python Usage: shell_core.start(["myshell", "-v"])
-static PyObject* shell_start(PyObject *self, PyObject *args) {
-  PyObject *py_argv;
-  char *prompt = "shell> ";
+#endif
 
-  // Parse the arguments: we expect a List (O!)
-  if (!PyArg_ParseTuple(args, "O!|s", &PyList_Type, &py_argv, &prompt)) {
-    return NULL; // Error if not a list
+// Python calls this: shell_core.pmap("validate", lines, args=(), jobs=0, batch=0, ordered=True)
+// Returns the number of items whose call raised.
+static PyObject* shell_pmap(PyObject *self, PyObject *args, PyObject *kwargs) {
+  static char *keywords[] = {"name", "items", "args", "jobs", "batch", "ordered", NULL};
+  const char *name;
+  PyObject *items_arg;
+  PyObject *extra_args = NULL;
+  int jobs = 0;
+  Py_ssize_t batch_size = 0;
+  int ordered = 1;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sO|Oinp", keywords,
+                                   &name, &items_arg, &extra_args, &jobs, &batch_size, &ordered)) {
+    return NULL;
   }
 
-  // Convert Python List -> C argv
-  // This allows you to pass flags to your shell if you want to support them later
-  int argc = (int)PyList_Size(py_argv);
-  char **argv = malloc((argc + 1) * sizeof(char*));
+  PyCommand *cmd = find_python_command(name);
+  if (!cmd) {
+    PyErr_Format(PyExc_KeyError, "no such command: %s", name);
+    return NULL;
+  }
 
-  for (int i = 0; i < argc; i++) {
-    PyObject *item = PyList_GetItem(py_argv, i);
-    if (!PyUnicode_Check(item)) {
-      free(argv);
-      PyErr_SetString(PyExc_TypeError, "shell arguments must be strings");
+  PmapTask task = {0};
+  task.items = PySequence_List(items_arg);
+  if (!task.items) return NULL;
+  for (Py_ssize_t i = 0; i < PyList_GET_SIZE(task.items); i++) {
+    if (!PyUnicode_Check(PyList_GET_ITEM(task.items, i))) {
+      Py_DECREF(task.items);
+      PyErr_SetString(PyExc_TypeError, "pmap items must be strings");
       return NULL;
     }
-    // PyUnicode_AsUTF8 returns a pointer to the internal buffer; do not free it
-    argv[i] = (char*)PyUnicode_AsUTF8(item);
   }
-  argv[argc] = NULL;
-
-  // We hold the GIL by default here.
-  // Ideally, release the GIL during get_input() so background threads can run.
+  task.count = PyList_GET_SIZE(task.items);
+
+  // (name, *args)
+  PyObject *name_obj = PyUnicode_FromString(name);
+  PyObject *head = name_obj ? PyTuple_Pack(1, name_obj) : NULL;
+  Py_XDECREF(name_obj);
+  PyObject *rest = head ? (extra_args ? PySequence_Tuple(extra_args) : PyTuple_New(0)) : NULL;
+  task.prefix = rest ? PySequence_Concat(head, rest) : NULL;
+  Py_XDECREF(head);
+  Py_XDECREF(rest);
+  if (!task.prefix) {
+    Py_DECREF(task.items);
+    return NULL;
+  }
 
-  while (1) {
-    char *raw_input = get_input(prompt);
-    if (raw_input == NULL) break;
-    if (strcmp(raw_input, "exit") == 0) {
-      free(raw_input);
-      break;
-    }
-    if (strlen(raw_input) == 0) {
-      free(raw_input);
-      continue;
+  if (jobs <= 0) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    jobs = (int)info.dwNumberOfProcessors;
+#else
+    jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (jobs <= 0) jobs = 1;
+  }
+  // A few batches per worker keeps them busy even when items vary in cost
+  if (batch_size <= 0) batch_size = (task.count + jobs * 4 - 1) / (jobs * 4);
+  if (batch_size <= 0) batch_size = 1;
+  task.batch_size = batch_size;
+  task.batch_count = (task.count + batch_size - 1) / batch_size;
+  if (jobs > task.batch_count) jobs = (int)task.batch_count;
+
+  // Hold our own references: the command may be unregistered meanwhile
+  task.func = cmd->func;
+  Py_INCREF(task.func);
+
+  PyObject *out = PySys_GetObject("stdout"); // Borrowed; where the caller's output goes
+  Py_XINCREF(out);
+  Py_ssize_t failed = -1;
+
+  if (!out) {
+    PyErr_SetString(PyExc_RuntimeError, "sys.stdout is not available");
+  } else if (task.count == 0) {
+    failed = 0;
+  } else if (jobs <= 1) {
+    // Nothing to fan out; still one stream swap per batch
+    char *status = malloc(task.batch_size);
+    failed = status ? 0 : -1;
+    if (!status) PyErr_NoMemory();
+    for (Py_ssize_t b = 0; status && b < task.batch_count; b++) {
+      PyObject *outputs = pmap_run_batch(&task, b, status);
+      if (!outputs) {
+        failed = -1;
+        break;
+      }
+      for (Py_ssize_t i = 0; i < PyList_GET_SIZE(outputs); i++) {
+        failed += status[i];
+        if (failed >= 0 && pmap_emit(out, PyList_GET_ITEM(outputs, i)) < 0) failed = -1;
+      }
+      Py_DECREF(outputs);
+      if (failed < 0) break;
     }
+    free(status);
+  } else {
+    failed = pmap_run_parallel(&task, jobs, ordered, out);
+  }
 
-    // Expand Variables ($VAR -> VAL)
-    char *expanded_vars = expand_variables(raw_input);
-    free(raw_input);
+  Py_XDECREF(out);
+  Py_DECREF(task.func);
+  Py_DECREF(task.prefix);
+  Py_DECREF(task.items);
 
-    // Expand Subshells ($(cmd) -> output)
-    char *final_cmd = expand_subshells(expanded_vars);
-    free(expanded_vars);
+  if (failed < 0) return NULL;
+  return PyLong_FromSsize_t(failed);
+}
 
-    // Handle Assignment (VAR=VAL)
-    // We do this on raw input so expansions don't mess up the assignment syntax
-    if (handle_assignment(final_cmd)) {
-      free(final_cmd);
-      continue; // Skip execution
-    }
+// --- BENCHMARK HOOK ---
+// Lets benchmarks/run_benchmarks.py time the internals in a C loop, so the
+// numbers aren't dominated by the Python call around each iteration.
 
-    // Execute Pipeline
-    execute_logic_line(final_cmd, STDIN_FILENO, STDOUT_FILENO);
+// Python calls this: shell_core._benchmark("tokenize", line, iterations) -> seconds
+// Kinds: "tokenize", "expand_variables", "expand_subshells" and "lookup"
+// (registry lookup of `line` as a command name).
+static PyObject* shell_benchmark(PyObject *self, PyObject *args) {
+  const char *kind;
+  const char *line;
+  Py_ssize_t iterations;
+
+  if (!PyArg_ParseTuple(args, "ssn", &kind, &line, &iterations)) {
+    return NULL;
+  }
 
-    free(final_cmd);
+  enum { BENCH_TOKENIZE, BENCH_VARIABLES, BENCH_SUBSHELLS, BENCH_LOOKUP, BENCH_COMPLETE } which;
+  if (strcmp(kind, "tokenize") == 0) which = BENCH_TOKENIZE;
+  else if (strcmp(kind, "expand_variables") == 0) which = BENCH_VARIABLES;
+  else if (strcmp(kind, "expand_subshells") == 0) which = BENCH_SUBSHELLS;
+  else if (strcmp(kind, "lookup") == 0) which = BENCH_LOOKUP;
+  else if (strcmp(kind, "complete") == 0) which = BENCH_COMPLETE;
+  else {
+    PyErr_Format(PyExc_ValueError, "unknown benchmark '%s'", kind);
+    return NULL;
   }
-  return PyLong_FromLong(0);
+
+  Arena *arena = acquire_arena();
+  if (!arena) return PyErr_NoMemory();
+
+  volatile uintptr_t sink = 0; // Keeps the work from being optimized away
+  double start = monotonic_seconds();
+  for (Py_ssize_t n = 0; n < iterations; n++) {
+    switch (which) {
+      case BENCH_TOKENIZE: {
+        TokenList list;
+        sink += (uintptr_t)tokenize_command(line, &list, arena);
+        break;
+      }
+      case BENCH_VARIABLES:
+        sink += (uintptr_t)expand_variables(line, arena);
+        break;
+      case BENCH_SUBSHELLS:
+        sink += (uintptr_t)expand_subshells(line, arena);
+        break;
+      case BENCH_LOOKUP:
+        sink += (uintptr_t)find_python_command(line);
+        break;
+      case BENCH_COMPLETE: {
+        NameList found = {NULL, 0, 0};
+        size_t word;
+        complete_line(line, strlen(line), &found, &word);
+        sink += found.count;
+        name_list_free(&found);
+        break;
+      }
+    }
+    arena_reset(arena);
+  }
+  double elapsed = monotonic_seconds() - start;
+  (void)sink;
+
+  release_arena(arena);
+  if (PyErr_Occurred()) return NULL;
+  return PyFloat_FromDouble(elapsed);
 }
 
 // --- MODULE REGISTRATION ---
@@ -1134,9 +6902,34 @@ static PyObject* shell_start(PyObject *self, PyObject *args) {
 // Update the Method Table
 static PyMethodDef ShellMethods[] = {
   {"register",     shell_register,     METH_VARARGS, "Register a command."},
+  {"unregister",   shell_unregister,   METH_VARARGS, "Unregister a command."},
   {"start",        shell_start,        METH_VARARGS, "Start the shell loop."},
+  {"run",          shell_run,          METH_VARARGS, "Run command line(s) without the interactive prompt."},
+  {"run_file",     shell_run_file,     METH_VARARGS, "Run a script file without the interactive prompt."},
   {"get_registry", shell_get_registry, METH_NOARGS,  "List all commands."},
   {"get_command",  shell_get_command,  METH_VARARGS, "Get command function."},
+  {"complete",     shell_complete,     METH_VARARGS, "Tab completion candidates for the last word of a line."},
+  {"get_builtins", shell_get_builtins, METH_NOARGS,  "Map of builtin command names to their usage."},
+  {"get_path_cache",   shell_get_path_cache,   METH_NOARGS, "Map of cached executable locations."},
+  {"clear_path_cache", shell_clear_path_cache, METH_NOARGS, "Forget cached executable locations."},
+  {"get_var",      shell_get_var,      METH_VARARGS, "Get a shell variable."},
+  {"set_var",      (PyCFunction)(void(*)(void))shell_set_var, METH_VARARGS | METH_KEYWORDS, "Set (and optionally export) a shell variable."},
+  {"unset_var",    shell_unset_var,    METH_VARARGS, "Remove a shell variable."},
+  {"variables",    (PyCFunction)(void(*)(void))shell_variables, METH_VARARGS | METH_KEYWORDS, "Map of shell variables (only exported ones if exported=True)."},
+  {"set_option",   shell_set_option,   METH_VARARGS, "Set a shell option."},
+  {"get_option",   shell_get_option,   METH_VARARGS, "Get a shell option."},
+  {"pipe_input",   shell_pipe_input,   METH_NOARGS,  "Object returned by the previous stage of the pipeline."},
+  {"call_with_stdout", (PyCFunction)(void(*)(void))shell_call_with_stdout, METH_VARARGS | METH_KEYWORDS, "Call a function with sys.stdout bound to a stream."},
+  {"copy_fd",      shell_copy_fd,      METH_VARARGS, "Copy everything from one fd to another, in the kernel where possible."},
+  {"parse_args",   shell_parse_args,   METH_VARARGS, "Parse command line arguments with a compiled plan."},
+  {"jobs",         shell_jobs,         METH_NOARGS,  "List background jobs."},
+  {"wait",         shell_wait,         METH_VARARGS, "Wait for a background job, or all of them."},
+  {"fg",           shell_fg,           METH_VARARGS, "Wait for a background job in the foreground."},
+  {"serve",        (PyCFunction)(void(*)(void))shell_serve, METH_VARARGS | METH_KEYWORDS, "Serve shell sessions on a Unix or TCP socket."},
+  {"stop_server",  shell_stop_server,  METH_NOARGS,  "Make serve() return after the current line."},
+  {"set_trace_hook", shell_set_trace_hook, METH_VARARGS, "Call a function with timing records for every pipeline."},
+  {"_benchmark",   shell_benchmark,    METH_VARARGS, "Time an internal operation in a C loop (for benchmarks)."},
+  {"pmap",         (PyCFunction)(void(*)(void))shell_pmap, METH_VARARGS | METH_KEYWORDS, "Run a command over many input lines in parallel."},
   {NULL, NULL, 0, NULL}
 };
 
@@ -1150,5 +6943,24 @@ static struct PyModuleDef shellmodule = {
 
 // This is the ONLY function exported to the OS dynamic loader
 PyMODINIT_FUNC PyInit_shell_core(void) {
-  return PyModule_Create(&shellmodule);
+  if (PyType_Ready(&StreamRouterType) < 0) return NULL;
+  ExitStatusType.tp_base = &PyLong_Type; // Not a constant initializer on Windows
+  if (PyType_Ready(&ExitStatusType) < 0) return NULL;
+
+  stdin_router = new_stream_router("stdin", "shell_core.stdin_route");
+  stdout_router = new_stream_router("stdout", "shell_core.stdout_route");
+  if (!stdin_router || !stdout_router) return NULL;
+
+  pipe_input_var = PyContextVar_New("shell_core.pipe_input", NULL);
+  if (!pipe_input_var) return NULL;
+
+  PyObject *module = PyModule_Create(&shellmodule);
+  if (!module) return NULL;
+  Py_INCREF(&ExitStatusType);
+  if (PyModule_AddObject(module, "ExitStatus", (PyObject*)&ExitStatusType) < 0) {
+    Py_DECREF(&ExitStatusType);
+    Py_DECREF(module);
+    return NULL;
+  }
+  return module;
 }
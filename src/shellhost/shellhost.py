@@ -1,15 +1,19 @@
 # shellhost.py
 import sys
-import os
-import pydoc
-pydoc.pager = pydoc.plainpager # Disable pager for the help() command
 
 import shell_core # This imports the compiled C extension
 from .shellhost_command import Command
 
+# Return ExitStatus(n) from a command to set its exit status; other return
+# values, plain ints included, leave it at 0.
+ExitStatus = shell_core.ExitStatus
+
 def register_command(name, func):
     shell_core.register(name, func)
 
+def unregister_command(name):
+    return shell_core.unregister(name)
+
 def start(args=None, prompt="shell> "):
     """
     Starts the C-based interactive shell.
@@ -23,31 +27,155 @@ def start(args=None, prompt="shell> "):
     # Pass control to C. This blocks until the user types 'exit'.
     return shell_core.start(args, prompt)
 
-@Command.auto_command
-def echo(*args):
-  """ Prints whatever the user input is.
+def serve(address, prompt="shell> "):
+    """
+    Serves a shell session to every client that connects, from this one process.
+    Args:
+        address: A path for a Unix socket, or a (host, port) tuple for TCP. An
+            empty host listens on 127.0.0.1 only; use "*" for every interface.
+        prompt: The command prompt string.
+
+    Each session has its own history, variables, working directory and jobs;
+    registered commands are shared. Blocks until shell_core.stop_server() is
+    called or the process is interrupted.
+    """
+    return shell_core.serve(address, prompt)
+
+def run(line):
+    """
+    Runs one or more command lines without the interactive prompt.
+    Args:
+        line: The command line(s) to run, separated by newlines.
+
+    Returns:
+        The exit code of the last command.
+    """
+    return shell_core.run(line)
+
+def run_file(path):
+    """
+    Runs a script file one line at a time without the interactive prompt.
+    Args:
+        path: Path to the script.
+
+    Returns:
+        The exit code of the last command.
+    """
+    return shell_core.run_file(path)
+
+# Job control commands are registered as plain functions so that, unlike
+# Command objects, they never try to read arguments from a piped stdin.
+def _parse_job_id(cmd_name, spec):
+  try:
+    return int(spec.lstrip('%'))
+  except ValueError:
+    print(f"Error - {cmd_name}: {spec}: not a job id.")
+    return None
+
+def _jobs(cmd_name, *args):
+  """ Lists background jobs started with '&'.
+
+  Returns:
+    0
+  """
+  for job in shell_core.jobs():
+    state = "Running" if job["running"] else ("Done" if job["exit_code"] == 0 else f"Exit {job['exit_code']}")
+    print(f"[{job['id']}]  {state}\t{job['command']}")
+  return 0
+
+def _wait(cmd_name, *args):
+  """ Waits for background jobs to finish.
+
+  Args:
+    %job: The jobs to wait for (all of them if none are given).
+
+  Returns:
+    The exit code of the last job waited for, 127 if a job does not exist.
+  """
+  if not args:
+    return ExitStatus(shell_core.wait())
+
+  exit_code = 0
+  for spec in args:
+    job_id = _parse_job_id(cmd_name, spec)
+    if job_id is None:
+      return ExitStatus(2)
+    try:
+      exit_code = shell_core.wait(job_id)
+    except KeyError:
+      print(f"Error - {cmd_name}: %{job_id}: no such job.")
+      exit_code = 127
+  return ExitStatus(exit_code)
+
+def _fg(cmd_name, job=None, *args):
+  """ Waits for a background job (the most recent one by default) in the foreground.
 
   Args:
-    user_input: The input provided by the user on the command line.
+    %job: The job to bring to the foreground.
 
   Returns:
-    None
+    The exit code of the job, 1 if it does not exist.
   """
-  print(*args)
+  job_id = None
+  if job is not None:
+    job_id = _parse_job_id(cmd_name, job)
+    if job_id is None:
+      return ExitStatus(2)
+  try:
+    return ExitStatus(shell_core.fg(job_id))
+  except KeyError as e:
+    print(f"Error - {cmd_name}: {e.args[0]}.")
+    return ExitStatus(1)
 
+def _pmap(cmd_name, *args):
+  """ Runs a command once per input line, spread across parallel workers.
 
-@Command.auto_command
-def env():
-  """ Prints all currently stored environment variables.
+  Usage: pmap [-j N] [-b N] [-u] command [args...] < inputs
+
+  Each non-empty line of stdin is passed as the last argument of one call. A
+  call fails if it raises or returns a non-zero ExitStatus.
 
   Args:
-    None
+    -j: Number of workers (defaults to the number of CPUs).
+    -b: Number of lines per batch (chosen automatically by default).
+    -u: Write each output as soon as it is ready instead of in input order.
 
   Returns:
-    None
+    1: If any call failed or the arguments were invalid.
+    0: Otherwise
   """
-  for k,v in os.environ.items():
-    print(f"{k}={v}")
+  args = list(args)
+  jobs, batch, ordered = 0, 0, True
+  try:
+    while args and args[0].startswith('-'):
+      flag = args.pop(0)
+      if flag == '-u':
+        ordered = False
+      elif flag in ('-j', '-b'):
+        value = int(args.pop(0))
+        if flag == '-j': jobs = value
+        else: batch = value
+      else:
+        raise ValueError(f"unknown option {flag}")
+    if not args:
+      raise ValueError("missing command")
+  except (ValueError, IndexError) as e:
+    print(f"Error - {cmd_name}: {e or 'missing option value'}.")
+    return ExitStatus(1)
+
+  items = [line.rstrip('\r\n') for line in sys.stdin]
+  items = [item for item in items if item]
+  try:
+    failed = shell_core.pmap(args[0], items, args[1:], jobs=jobs, batch=batch, ordered=ordered)
+  except KeyError:
+    print(f"Error - {cmd_name}: Command {args[0]} not found.")
+    return ExitStatus(1)
+  return ExitStatus(1 if failed else 0)
+
+shell_core.register("jobs", _jobs)
+shell_core.register("wait", _wait)
+shell_core.register("fg", _fg)
+shell_core.register("pmap", _pmap)
 
 @Command.command # Use the non-basic decorator for _help so we can set its command name.
 def _help(cmd_name: str = None):
@@ -61,18 +189,31 @@ def _help(cmd_name: str = None):
     0: Otherwise
   """
 
+  builtins = shell_core.get_builtins()
   if cmd_name is not None:
+    if cmd_name in builtins: # Implemented in C, so there is no docstring
+      print(builtins[cmd_name])
+      return 0
+
     user_func = shell_core.get_command(cmd_name)
     if user_func is None:
       print(f"Error - help: Command {cmd_name} not found.")
-      return 1
+      return ExitStatus(1)
 
+    if isinstance(user_func, Command):
+      user_func.resolve() # A lazy command loads its function for the docstring
     target = getattr(user_func, 'func', user_func)
-    help(target)
+
+    # pydoc is slow to import and only needed here. Render the page ourselves
+    # instead of going through help(), which would page it.
+    import pydoc
+    sys.stdout.write(pydoc.render_doc(target, title="Help on %s:", renderer=pydoc.plaintext))
 
   else:
     # Ask C for the list of names
     cmds = shell_core.get_registry()
+    print("Builtins:")
+    print("  " + "\n  ".join(sorted(builtins)))
     print("Available Commands:")
     print("  " + "\n  ".join(sorted(cmds)))
 
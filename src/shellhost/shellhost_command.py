@@ -1,7 +1,14 @@
 # shellhost __init__.py
-import inspect
+import collections
+import collections.abc
+import importlib
+import io
 import shell_core
 import sys
+import threading
+import time
+# inspect and typing are only needed once a command's signature is read (see resolve()),
+# so they are imported there rather than slowing down every startup.
 
 class Command:
   def __init__(self, name, func, register=True):
@@ -21,9 +28,24 @@ class Command:
     self.func = func
     self.positional_arguments = {}
     self.optional_arguments = {}
+    self._plan = None # Compiled by _compile_plan() on first parse, dropped by add_arg.
+    self._object_plan = None # Same, minus the first positional (filled by the upstream object).
+    self.stream_index = None # Positional slot that receives stdin as a line iterator, if any.
+    self._cache = None # ResultCache when results are memoized (auto_command(cache=True)).
+    self._pending = None # (loader, stream) while the arguments are still to be read from the signature.
 
     if register: shell_core.register(self.name, self)
 
+  _resolve_lock = threading.RLock() # Stages of one pipeline may call a lazy command at the same time
+
+  def __getattr__(self, attr):
+    # Only reached for attributes that don't exist yet, i.e. the argument tables of a
+    # lazy command that nobody has used. Reading them (tab completion does) loads it.
+    if attr in ('positional_arguments', 'optional_arguments', 'stream_index') and self.__dict__.get('_pending') is not None:
+      self.resolve()
+      return getattr(self, attr)
+    raise AttributeError(f"'{type(self).__name__}' object has no attribute '{attr}'")
+
   class ParsingError(Exception):
     def __init__(self, message=''):
       final_message = "Error while parsing command line: " + message if len(message) > 0 else "Error while parsing command line arguments."
@@ -34,6 +56,44 @@ class Command:
       final_message = "Error while executing command: " + message if len(message) > 0 else "Error while executing command."
       super().__init__(final_message)
 
+  class ResultCache:
+    """ LRU map of parsed arguments to (result, printed output), with an optional time to live. """
+    def __init__(self, size=128, ttl=None):
+      self.size = size
+      self.ttl = ttl
+      self.hits = 0
+      self.misses = 0
+      self._entries = collections.OrderedDict() # key -> (expires, result, output); oldest first
+      self._lock = threading.Lock() # Pipeline stages can call the same command from several threads
+
+    def get(self, key):
+      """ Returns (result, output) for key, or None. Raises TypeError if key is unhashable. """
+      with self._lock:
+        entry = self._entries.get(key)
+        if entry is not None and entry[0] is not None and entry[0] <= time.monotonic():
+          del self._entries[key]
+          entry = None
+        if entry is None:
+          self.misses += 1
+          return None
+        self._entries.move_to_end(key)
+        self.hits += 1
+        return entry[1:]
+
+    def put(self, key, result, output):
+      with self._lock:
+        expires = time.monotonic() + self.ttl if self.ttl is not None else None
+        self._entries[key] = (expires, result, output)
+        self._entries.move_to_end(key)
+        while len(self._entries) > self.size:
+          self._entries.popitem(last=False)
+
+    def clear(self):
+      with self._lock:
+        self._entries.clear()
+        self.hits = 0
+        self.misses = 0
+
   def set_name(self, new_name: str) -> None:
     self.name = new_name
     self.__name__ = new_name
@@ -49,6 +109,7 @@ class Command:
       A dictionary of the currently establish args separated by 'positional' and 'optional' keys.
 
     """
+    self.resolve()
     return {'positional':self.positional_arguments, 'optional':self.optional_arguments}
 
 
@@ -62,8 +123,34 @@ class Command:
     Returns:
       Whatever the function for this Command returns.
     """
+    if self._pending is not None: self.resolve()
     this_command = args[0]
     cli_args = list(args[1:])
+    upstream = shell_core.pipe_input() # Set when an object_pipes pipeline hands over a value.
+
+    if self.stream_index is not None:
+      # Streaming commands get stdin (or the upstream values) lazily instead of as arguments.
+      p_args, o_args = self.parse(cli_args)
+      p_args = list(p_args) if p_args is not None else []
+      p_args.insert(self.stream_index, Command._stream_lines(sys.stdin) if upstream is None else Command._stream_objects(upstream))
+      try:
+        if o_args is not None: return self.func(*p_args, **o_args)
+        else: return self.func(*p_args)
+
+      except Exception as e:
+        raise Command.ArgumentError(str(e))
+
+    if upstream is not None:
+      # The upstream value is the first positional argument, as is.
+      p_args, o_args = self._parse_plan(self._get_object_plan(), cli_args)
+      p_args = [upstream] + (list(p_args) if p_args is not None else [])
+      try:
+        if o_args is not None: return self.func(*p_args, **o_args)
+        else: return self.func(*p_args)
+
+      except Exception as e:
+        raise Command.ArgumentError(str(e))
+
     if not cli_args and not sys.stdin.isatty():
       try:
         # Read from the C-pipe, strip newline
@@ -79,6 +166,13 @@ class Command:
         pass
 
     p_args, o_args = self.parse(cli_args)
+    if self._cache is not None:
+      return self._call_cached(p_args, o_args)
+    return self._invoke(p_args, o_args)
+
+
+  def _invoke(self, p_args, o_args):
+    """ Calls the function with the parsed arguments (either may be None). """
     try:
       if p_args is not None and o_args is not None: return self.func(*p_args, **o_args)
       elif p_args is not None: return self.func(*p_args)
@@ -88,6 +182,43 @@ class Command:
     except Exception as e:
       raise Command.ArgumentError(str(e))
 
+  def _call_cached(self, p_args, o_args):
+    """ Serves a call from the result cache, running the function on a miss. """
+    key = (tuple(p_args) if p_args is not None else (), tuple(sorted(o_args.items())) if o_args is not None else ())
+    try:
+      hit = self._cache.get(key)
+    except TypeError: # Unhashable argument values can't be memoized
+      return self._invoke(p_args, o_args)
+
+    if hit is not None:
+      result, output = hit
+      sys.stdout.write(output)
+      return result
+
+    buffer = io.StringIO()
+    try:
+      result = shell_core.call_with_stdout(buffer, self._invoke, p_args, o_args)
+    finally:
+      sys.stdout.write(buffer.getvalue()) # Failed calls still show what they printed, but aren't cached
+
+    if not isinstance(result, collections.abc.Iterator): # An iterator can only be consumed once
+      self._cache.put(key, result, buffer.getvalue())
+    return result
+
+
+  def cache_clear(self) -> None:
+    """ Drops every memoized result of this command (see auto_command(cache=True)). """
+    if self._cache is not None:
+      self._cache.clear()
+
+
+  def cache_info(self) -> dict:
+    """ Returns hits, misses, current size and limits of the result cache, or None if it has none. """
+    if self._cache is None:
+      return None
+    return {'hits': self._cache.hits, 'misses': self._cache.misses, 'size': len(self._cache._entries), 'max_size': self._cache.size, 'ttl': self._cache.ttl}
+
+
   @classmethod
   def command(self, func):
     """
@@ -105,26 +236,187 @@ class Command:
     return this_command
 
 
+  @staticmethod
+  def _stream_lines(stream):
+    """ Yields the lines of stream without their trailing newline, reading as they are consumed. """
+    for line in stream:
+      yield line[:-1] if line.endswith('\n') else line
+
+
+  @staticmethod
+  def _stream_objects(value):
+    """ Iterates the values an upstream command returned (a single value counts as one). """
+    if isinstance(value, (str, bytes)) or not hasattr(value, '__iter__'):
+      return iter((value,))
+    return iter(value)
+
+
+  @staticmethod
+  def _is_line_stream(annotation) -> bool:
+    """ Returns True for Iterable[str] / Iterator[str] annotations (or their bare forms). """
+    import typing # Deferred, see the imports at the top
+    if annotation in (collections.abc.Iterable, collections.abc.Iterator):
+      return True
+    if typing.get_origin(annotation) not in (collections.abc.Iterable, collections.abc.Iterator):
+      return False
+    return typing.get_args(annotation) in ((), (str,))
+
+
   @classmethod
-  def auto_command(self, func):
+  def auto_command(self, func=None, *, stream=False, cache=False, ttl=None, cache_size=128):
     """
     Function decorator for creating a Shell command from a python function,
     while also automatically generating its argument list and registering it.
 
+    Can be used bare (@Command.auto_command) or with options (@Command.auto_command(stream=True)).
+    The signature is only read when the command is first used (see resolve()), so
+    problems with it are reported then rather than at import time.
+
     Args:
       self: The Command class definition.
       func: The function to be decorated.
+      stream: Pass stdin to the first positional parameter as a lazy iterator of lines
+        instead of splitting it into arguments. Parameters annotated Iterable[str]
+        are streamed this way without the flag.
+      cache: Memoize the result and printed output of each call, keyed on the parsed
+        arguments, so repeat calls (in scripts and $(...) alike) don't run the function
+        again. Only for commands whose output depends on nothing but their arguments.
+      ttl: Seconds a memoized result stays valid (None keeps it until evicted).
+      cache_size: How many distinct calls are remembered; the least recently used go first.
+
+    Returns:
+      A Shell Command object.
+    """
+
+    if func is None: # Called with options, return the real decorator.
+      return lambda f: self.auto_command(f, stream=stream, cache=cache, ttl=ttl, cache_size=cache_size)
+
+    if stream and cache:
+      raise TypeError(f"{func.__name__} streams stdin, so its results can't be cached.")
+
+    this_command = self(func.__name__, func, register=False) # Create new Command object.
+    if cache: this_command._cache = Command.ResultCache(cache_size, ttl)
+    this_command._defer(None, stream) # The signature is read on first use, not at import time.
+    shell_core.register(this_command.name, this_command)
+    return this_command
+
+
+  @classmethod
+  def lazy(self, name, loader, *, stream=False, cache=False, ttl=None, cache_size=128):
+    """
+    Registers a command whose function is only imported when the command is first
+    used (called, asked for help or tab completed), so a large set of commands
+    costs next to nothing at startup.
+
+    Args:
+      self: The Command class definition.
+      name: The name of the command on the command line.
+      loader: Either a "package.module:function" string, or a callable that takes no
+        arguments and returns the function. It may also return a Command, whose
+        arguments are then used as they are.
+      stream, cache, ttl, cache_size: As for auto_command.
 
     Returns:
       A Shell Command object.
+
+    Raises:
+      TypeError: If loader is neither a string nor callable, or stream and cache are both set.
+      ValueError: If a loader string has no ':function' part, or name is a builtin's.
+    """
+    if isinstance(loader, str):
+      if ':' not in loader:
+        raise ValueError(f"Expected 'module:function' for the loader of {name}, got '{loader}'.")
+    elif not callable(loader):
+      raise TypeError(f"Expected a 'module:function' string or a callable for the loader of {name}, got {type(loader)}.")
+    if stream and cache:
+      raise TypeError(f"{name} streams stdin, so its results can't be cached.")
+
+    this_command = self(name, None, register=False)
+    if cache: this_command._cache = Command.ResultCache(cache_size, ttl)
+    this_command._defer(loader, stream)
+    shell_core.register(name, this_command)
+    return this_command
+
+
+  def _defer(self, loader, stream) -> None:
+    """ Drops the argument tables until resolve() builds them, so __getattr__ notices when they're needed. """
+    for attr in ('positional_arguments', 'optional_arguments', 'stream_index'):
+      self.__dict__.pop(attr, None)
+    self._pending = (loader, stream)
+
+
+  @staticmethod
+  def _load(loader):
+    """ Runs a lazy command's loader and returns what it produced. """
+    if not isinstance(loader, str):
+      return loader()
+    module_name, _, attr_path = loader.partition(':')
+    target = importlib.import_module(module_name)
+    for attr in attr_path.split('.'):
+      target = getattr(target, attr)
+    return target
+
+
+  def resolve(self) -> None:
+    """
+    Loads a lazy command's function and builds its arguments from the signature.
+    Nothing happens if that was already done; if it fails, the next use tries again.
+
+    Raises:
+      Whatever the loader raises (typically ImportError or AttributeError).
+      TypeError: If the function can't be used the way the command was declared.
     """
+    if self._pending is None:
+      return
+    with Command._resolve_lock:
+      if self._pending is None: # Another thread finished while we waited
+        return
+      loader, stream = self._pending
+      self.positional_arguments = {}
+      self.optional_arguments = {}
+      self.stream_index = None
+      try:
+        if loader is not None:
+          loaded = Command._load(loader)
+          if isinstance(loaded, Command):
+            loaded.resolve()
+            self.func = loaded.func
+            self.positional_arguments = loaded.positional_arguments
+            self.optional_arguments = loaded.optional_arguments
+            self.stream_index = loaded.stream_index
+            if self._cache is None: self._cache = loaded._cache
+          else:
+            self.func = loaded
+            self._add_signature_args(stream)
+          # Registering again lets shell_core see whether the function is async.
+          # The import may also have registered the loaded Command under our name.
+          if shell_core.get_command(self.name) in (self, loaded):
+            shell_core.register(self.name, self)
+        else:
+          self._add_signature_args(stream)
+      except BaseException:
+        self._defer(loader, stream)
+        raise
+      self._plan = self._compile_plan()
+      self._object_plan = None
+      self._pending = None
 
-    this_command = self(func.__name__, func) # Create new Command object.
 
-    sig = inspect.signature(func) # Get signature of decorated function.
+  def _add_signature_args(self, stream) -> None:
+    """ Adds an argument for every parameter of self.func (auto_command's argument list). """
+    import inspect # Deferred, see the imports at the top
 
+    sig = inspect.signature(self.func) # Get signature of decorated function.
+    func_name = getattr(self.func, '__name__', self.name)
 
+    position = 0 # Index of the next positional parameter.
     for name, param in sig.parameters.items():
+      if self.stream_index is None and param.kind in (param.POSITIONAL_ONLY, param.POSITIONAL_OR_KEYWORD):
+        if Command._is_line_stream(param.annotation) or (stream and param.default == inspect._empty):
+          self.stream_index = position # This parameter is fed from stdin, not parsed.
+          position += 1
+          continue
+
       optional_arg = False if param.default == inspect._empty else True # Optional args are determined from the function signature by the presence of a default value.
       boolean_arg = True if type(param.default) == bool else False
       arg_nargs = '*' if param.kind == param.VAR_POSITIONAL else None
@@ -136,13 +428,17 @@ class Command:
         arg_name = '--'+param.name
 
         # Check if there is already a shorthand of this option.
-        if this_command.optional_arguments.get('-'+param.name[0]) is None:
+        if self.optional_arguments.get('-'+param.name[0]) is None:
           arg_name = '-'+param.name[0]+'|'+arg_name # If there is not already a shorthand for this option, then add it.
 
 
-      this_command.add_arg(arg_name, nargs=arg_nargs, dtype=arg_dtype, default=arg_default, sig_name = param.name, is_bool=boolean_arg)
+      self.add_arg(arg_name, nargs=arg_nargs, dtype=arg_dtype, default=arg_default, sig_name = param.name, is_bool=boolean_arg)
+      if not optional_arg: position += 1
 
-    return this_command
+    if stream and self.stream_index is None:
+      raise TypeError(f"{func_name} has no positional parameter to stream stdin into.")
+    if self._cache is not None and self.stream_index is not None:
+      raise TypeError(f"{func_name} streams stdin, so its results can't be cached.")
 
 
   def add_arg(self, name: str, optional = False, positional = True, nargs = None, dtype = None, default = None, sig_name = None, is_bool = False) -> None:
@@ -218,6 +514,49 @@ class Command:
     for _name in name_parts_original:
       arg_dict[_name] = this_arg
 
+    self._plan = None
+    self._object_plan = None
+
+
+  def _get_object_plan(self) -> tuple:
+    """ Returns the parse plan for when the first positional argument comes from upstream. """
+    if self._object_plan is None:
+      if self._plan is None:
+        self._plan = self._compile_plan()
+      converters, has_star, options = self._plan
+      self._object_plan = (converters[1:], has_star, options)
+    return self._object_plan
+
+
+  def _compile_plan(self) -> tuple:
+    """ Compiles the current arguments into the plan that shell_core.parse_args executes.
+
+    Args:
+      self: The Command object
+
+    Returns:
+      A (converters, has_star, options) tuple. converters holds one dtype (or None) per
+      positional argument up to any *args, and options maps every flag spelling to its
+      (formatted_name, nargs) with nargs 0 for booleans and -1 for '*'.
+    """
+
+    converters = []
+    has_star = False
+    for arg in self.positional_arguments.values():
+      if arg['nargs'] == '*': # *args takes everything after the fixed positionals.
+        has_star = True
+        break
+      converters.append(arg['dtype'])
+
+    options = {}
+    for flag, arg in self.optional_arguments.items():
+      if arg['is_bool']: nargs = 0
+      elif arg['nargs'] == '*': nargs = -1
+      else: nargs = int(arg['nargs'])
+      options[flag] = (arg['formatted_name'], nargs)
+
+    return (tuple(converters), has_star, options)
+
 
 
 
@@ -235,6 +574,7 @@ class Command:
       TypeError: If input_str is not a string.
     """
 
+    self.resolve()
     if cli_args is None or len(cli_args) == 0:
       return (None, None)
 
@@ -244,54 +584,19 @@ class Command:
     if type(cli_args) != list:
       raise TypeError(f"Expected type list for cli_args, got {type(cli_args)}.")
 
-    positional_args = []
-    optional_args = {}
-
-    try:
-      for i, arg in enumerate(self.positional_arguments.values()): # Iterate over positional arguments first.
-        if arg.get('nargs') == '*':       # ┬ If any positional arg has nargs as * then it
-          positional_args = cli_args[:]   # ├ represents '*args' in the function signature, so
-          cli_args = []                   # └ give it all remaining args.
-          break
-
-        else:
-           arg_val = cli_args.pop(0)
-           if arg.get('dtype') is not None: arg_val = arg.get('dtype')(arg_val)
-           positional_args.append(arg_val)
-
-    except Exception as e:
-      raise Command.ParsingError(f"{e} | Expected {arg.get('nargs')} arguments, got {len(cli_args)}.")
-
-    if len(cli_args) > 0: # If we have any args left, they're optional args.
+    if self._plan is None:
+      self._plan = self._compile_plan()
 
-      i = 0 # Iterator integer
-      while i < len(cli_args):
-        current_option = self.optional_arguments.get(cli_args[i]) # Assume the value at cli_args[i] is a new option.
+    return self._parse_plan(self._plan, cli_args)
 
-        if current_option is None: # Handle the case where we don't have an entry for the current option.
-          raise Command.ParsingError(f"Got unexpected optional argument: {cli_args[i]}")
 
-        if current_option.get('is_bool'): # Handle boolean options
-          optional_args[current_option.get('formatted_name')] = True
-          i += 1
-          continue
-
-        if current_option.get('nargs') == 1:
-          optional_args[current_option.get('formatted_name')] = cli_args[i+1]
-
-
-        else:
-
-          if current_option.get('nargs') == "*": # Set * nargs to be the remaining length of cli_args
-            current_option['nargs'] = len(cli_args) - i
-
-          optional_args[current_option.get('formatted_name')] = cli_args[(i+1):(i+1+current_option.get('nargs'))] # ┬ Set the values of the current_option to be
-                                                                                                                # ├ a range from cli_args from the current index + 1
-                                                                                                                # └ to the current index + 1 + nargs for current option.
-
-        i += current_option.get('nargs') + 1 # Increment i by the number of arguments we've just captured.
-
-    else:
-      optional_args = None
+  @staticmethod
+  def _parse_plan(plan, cli_args) -> tuple:
+    """ Runs a compiled plan over cli_args, with parse()'s return values and errors. """
+    if len(cli_args) == 0:
+      return (None, None)
 
-    return (positional_args, optional_args)
+    try:
+      return shell_core.parse_args(plan, cli_args)
+    except Exception as e:
+      raise Command.ParsingError(str(e))
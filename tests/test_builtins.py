@@ -0,0 +1,124 @@
+""" Builtins: names that can't be registered over, empty words, the environment
+and subshell stages.
+
+Usage: PYTHONPATH=src python3 -m unittest discover -s tests
+"""
+import os
+import tempfile
+import unittest
+
+import shell_core
+import shellhost
+from shellhost import Command
+
+
+class BuiltinNameTest(unittest.TestCase):
+  def test_register_builtin_name_raises(self):
+    for name in ("test", "cat", "cd", "echo", "env", "time"):
+      with self.assertRaises(ValueError):
+        shell_core.register(name, print)
+    self.assertNotIn("test", shell_core.get_registry())
+
+  def test_command_with_builtin_name_raises(self):
+    with self.assertRaises(ValueError):
+      Command.lazy("export", "os:getcwd")
+
+
+class EmptyWordTest(unittest.TestCase):
+  """ "" and '' are words of their own, so an unset variable in quotes still counts. """
+  def setUp(self):
+    shell_core.unset_var("EMPTY_UNSET")
+    self.received = None
+    shell_core.register("args", self.record)
+
+  def tearDown(self):
+    shell_core.unregister("args")
+
+  def record(self, cmd_name, *args):
+    self.received = list(args)
+
+  def test_non_empty_test_on_unset(self):
+    self.assertEqual(shell_core.run('[ -n "$EMPTY_UNSET" ]'), 1)
+    self.assertEqual(shell_core.run("test -n ''"), 1)
+
+  def test_empty_test_on_unset(self):
+    self.assertEqual(shell_core.run('[ -z "$EMPTY_UNSET" ]'), 0)
+
+  def test_compare_unset(self):
+    self.assertEqual(shell_core.run('[ "$EMPTY_UNSET" = foo ]'), 1)
+    self.assertEqual(shell_core.run('[ "$EMPTY_UNSET" = "" ]'), 0)
+
+  def test_empty_arguments_reach_command(self):
+    shell_core.run('args a "" b \'\' "$EMPTY_UNSET"')
+    self.assertEqual(self.received, ["a", "", "b", "", ""])
+
+  def test_unquoted_unset_is_no_word(self):
+    shell_core.run("args a $EMPTY_UNSET b")
+    self.assertEqual(self.received, ["a", "b"])
+
+
+class EnvironmentTest(unittest.TestCase):
+  """ Exported variables reach os.environ for in-process commands; plain ones don't. """
+  def tearDown(self):
+    for name in ("ENV_EXPORTED", "ENV_PLAIN"):
+      shell_core.unset_var(name)
+
+  def test_export_reaches_os_environ(self):
+    shell_core.run("export ENV_EXPORTED=bar")
+    self.assertEqual(os.environ.get("ENV_EXPORTED"), "bar")
+    shell_core.run("ENV_EXPORTED=baz")
+    self.assertEqual(os.environ.get("ENV_EXPORTED"), "baz")
+
+  def test_plain_assignment_stays_private(self):
+    shell_core.run("ENV_PLAIN=1")
+    self.assertNotIn("ENV_PLAIN", os.environ)
+
+  def test_unset_removes_from_os_environ(self):
+    shell_core.run("export ENV_EXPORTED=bar")
+    shell_core.run("unset ENV_EXPORTED")
+    self.assertNotIn("ENV_EXPORTED", os.environ)
+
+  def test_unexport_removes_from_os_environ(self):
+    shell_core.set_var("ENV_EXPORTED", "1", export=True)
+    shell_core.set_var("ENV_EXPORTED", "1", export=False)
+    self.assertNotIn("ENV_EXPORTED", os.environ)
+    self.assertEqual(shell_core.get_var("ENV_EXPORTED"), "1")
+
+
+class SubshellBuiltinTest(unittest.TestCase):
+  def setUp(self):
+    self.cwd = os.getcwd()
+    self.dir = tempfile.TemporaryDirectory()
+
+  def tearDown(self):
+    os.chdir(self.cwd)
+    self.dir.cleanup()
+
+  def test_cd_in_pipeline_keeps_directory(self):
+    shell_core.run(f"cd {self.dir.name} | true")
+    self.assertEqual(os.getcwd(), self.cwd)
+
+  def test_cd_in_background_keeps_directory(self):
+    shell_core.run(f"cd {self.dir.name} &")
+    shell_core.run("wait")
+    self.assertEqual(os.getcwd(), self.cwd)
+
+  def test_cd_alone_changes_directory(self):
+    shell_core.run(f"cd {self.dir.name}")
+    self.assertEqual(os.path.realpath(os.getcwd()), os.path.realpath(self.dir.name))
+
+  def test_cd_in_pipeline_checks_directory(self):
+    self.assertEqual(shell_core.run(f"true | cd {self.dir.name}/missing"), 1)
+
+  def test_export_and_unset_in_pipeline(self):
+    out = os.path.join(self.dir.name, "out.txt")
+    shell_core.run("SUB_KEEP=kept")
+    shell_core.run("export SUB_NEW=1 | true")
+    shell_core.run("true | unset SUB_KEEP")
+    shell_core.run(f"echo [$SUB_NEW] [$SUB_KEEP] > {out}")
+    with open(out) as result:
+      self.assertEqual(result.read(), "[] [kept]\n")
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,86 @@
+""" History: history_file is appended to, read back, and never read in twice.
+
+The interactive editor needs a terminal, so each case drives a shell in a
+child process through a pty.
+
+Usage: PYTHONPATH=src python3 -m unittest discover -s tests
+"""
+import os
+import select
+import sys
+import tempfile
+import time
+import unittest
+
+UP = "\x1b[A"
+
+SHELL = '''
+import sys, shell_core
+history_file = sys.argv[1]
+def reread(cmd_name):
+  with open(history_file, "a") as out:
+    out.write("echo from-elsewhere\\n") # Another shell appending
+  shell_core.set_option("history_file", history_file)
+shell_core.register("reread", reread)
+shell_core.set_option("history_file", history_file)
+shell_core.start([], "h> ")
+'''
+
+
+@unittest.skipIf(sys.platform == "win32", "drives the shell through a pty")
+class HistoryFileTest(unittest.TestCase):
+  def setUp(self):
+    self.dir = tempfile.TemporaryDirectory()
+    self.history = os.path.join(self.dir.name, "history")
+
+  def tearDown(self):
+    self.dir.cleanup()
+
+  def shell(self, *lines):
+    """ Types each line (keys included) into a fresh shell, then exits it. """
+    import pty
+    pid, fd = pty.fork()
+    if pid == 0:
+      os.execv(sys.executable, [sys.executable, "-c", SHELL, self.history])
+    def pump(seconds):
+      deadline = time.monotonic() + seconds
+      while time.monotonic() < deadline:
+        if select.select([fd], [], [], 0.05)[0]:
+          try:
+            if not os.read(fd, 65536):
+              return
+          except OSError:
+            return # The shell exited
+    pump(1)
+    for line in lines + ("exit",):
+      os.write(fd, line.encode() + b"\r")
+      pump(0.3)
+    pump(0.5)
+    os.waitpid(pid, 0)
+    os.close(fd)
+
+  def lines(self):
+    with open(self.history) as result:
+      return result.read().splitlines()
+
+  def test_lines_are_appended(self):
+    self.shell("echo one", "echo two")
+    self.assertEqual(self.lines(), ["echo one", "echo two", "exit"])
+
+  def test_history_is_read_back(self):
+    with open(self.history, "w") as out:
+      out.write("echo remembered\n")
+    self.shell(UP) # Runs the line from the file again
+    self.assertEqual(self.lines(), ["echo remembered", "echo remembered", "exit"])
+
+  def test_reading_the_same_file_again_adds_only_new_lines(self):
+    with open(self.history, "w") as out:
+      out.write("echo one\n")
+    # The ring is now: echo one, reread, echo from-elsewhere. If the lines
+    # already loaded were read in again, three steps up would land elsewhere.
+    self.shell("reread", UP * 3)
+    self.assertEqual(self.lines(), ["echo one", "reread", "echo from-elsewhere", "echo one", "exit"])
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,73 @@
+""" Exit statuses of Python commands and of background jobs through wait/fg.
+
+Usage: PYTHONPATH=src python3 -m unittest discover -s tests
+"""
+import os
+import tempfile
+import unittest
+
+import shell_core
+import shellhost # Registers wait and fg
+
+
+def add_five(cmd_name, x):
+  return int(x) + 5 # A result, not a status
+
+
+def fail3(cmd_name):
+  return shellhost.ExitStatus(3)
+
+
+class ExitStatusTest(unittest.TestCase):
+  def setUp(self):
+    self.dir = tempfile.TemporaryDirectory()
+    self.marker = os.path.join(self.dir.name, "marker.txt")
+    shell_core.register("add_five", add_five)
+    shell_core.register("fail3", fail3)
+
+  def tearDown(self):
+    shell_core.unregister("add_five")
+    shell_core.unregister("fail3")
+    self.dir.cleanup()
+
+  def branch(self, line):
+    """ Runs `line && echo ok || echo failed` and returns which branch ran. """
+    shell_core.run(f"{line} && echo ok > {self.marker} || echo failed > {self.marker}")
+    with open(self.marker) as result:
+      return result.read().strip()
+
+  def test_int_result_is_success(self):
+    self.assertEqual(shell_core.run("add_five 10"), 0)
+    self.assertEqual(self.branch("add_five 10"), "ok")
+
+  def test_exit_status_sets_status(self):
+    self.assertEqual(shell_core.run("fail3"), 3)
+    self.assertEqual(self.branch("fail3"), "failed")
+
+  def test_wait_reports_job_status(self):
+    shell_core.run("false &")
+    job_id = shell_core.jobs()[-1]["id"]
+    self.assertEqual(shell_core.run(f"wait %{job_id}"), 1)
+
+  def test_wait_failure_reaches_or_list(self):
+    shell_core.run("false &")
+    job_id = shell_core.jobs()[-1]["id"]
+    self.assertEqual(self.branch(f"wait %{job_id}"), "failed")
+
+  def test_wait_for_python_job(self):
+    shell_core.run("fail3 &")
+    job_id = shell_core.jobs()[-1]["id"]
+    self.assertEqual(shell_core.run(f"wait %{job_id}"), 3)
+
+  def test_fg_reports_job_status(self):
+    shell_core.run("true &")
+    self.assertEqual(shell_core.run("fg"), 0)
+    shell_core.run("false &")
+    self.assertEqual(shell_core.run("fg"), 1)
+
+  def test_wait_for_missing_job(self):
+    self.assertEqual(shell_core.run("wait %999"), 127)
+
+
+if __name__ == "__main__":
+  unittest.main()
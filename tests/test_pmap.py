@@ -0,0 +1,81 @@
+""" pmap's exit status, as seen by the shell's && and || lists.
+
+Usage: PYTHONPATH=src python3 -m unittest discover -s tests
+"""
+import os
+import tempfile
+import unittest
+
+import shell_core
+import shellhost # Registers pmap
+
+
+def upper(cmd_name, item):
+  if item == "bad":
+    raise ValueError("bad item")
+  print(item.upper())
+
+
+def status(cmd_name, item):
+  return shell_core.ExitStatus(3) if item == "three" else shell_core.ExitStatus(0)
+
+
+def add_five(cmd_name, item):
+  return int(item) + 5 # A result, not a status
+
+
+class PmapStatusTest(unittest.TestCase):
+  def setUp(self):
+    self.dir = tempfile.TemporaryDirectory()
+    shell_core.register("upper", upper)
+    shell_core.register("status", status)
+    shell_core.register("add_five", add_five)
+
+  def tearDown(self):
+    shell_core.unregister("upper")
+    shell_core.unregister("status")
+    shell_core.unregister("add_five")
+    self.dir.cleanup()
+
+  def path(self, name, text=None):
+    path = os.path.join(self.dir.name, name)
+    if text is not None:
+      with open(path, "w") as out:
+        out.write(text)
+    return path
+
+  def run_line(self, line):
+    """ Runs line with its output in a file; returns (exit code, output). """
+    out = self.path("out.txt")
+    code = shell_core.run(f"{line} > {out}")
+    with open(out) as result:
+      return code, result.read()
+
+  def test_success(self):
+    items = self.path("in.txt", "a\nb\nc\n")
+    self.assertEqual(self.run_line(f"pmap -j 2 upper < {items}"), (0, "A\nB\nC\n"))
+
+  def test_raising_item_fails(self):
+    items = self.path("in.txt", "a\nbad\nc\n")
+    code, output = self.run_line(f"pmap -j 2 upper < {items}")
+    self.assertEqual(code, 1)
+    self.assertEqual(output, "A\nC\n")
+
+  def test_failure_reaches_or_list(self):
+    items = self.path("in.txt", "a\nbad\nc\n")
+    marker = self.path("marker.txt")
+    shell_core.run(f"pmap -j 2 upper < {items} > {os.devnull} || echo PMAP_FAILED > {marker}")
+    with open(marker) as result:
+      self.assertEqual(result.read(), "PMAP_FAILED\n")
+
+  def test_non_zero_status_fails(self):
+    items = self.path("in.txt", "one\nthree\n")
+    self.assertEqual(self.run_line(f"pmap -j 2 status < {items}")[0], 1)
+
+  def test_int_result_succeeds(self):
+    items = self.path("in.txt", "1\n10\n")
+    self.assertEqual(self.run_line(f"pmap -j 2 add_five < {items}")[0], 0)
+
+
+if __name__ == "__main__":
+  unittest.main()
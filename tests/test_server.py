@@ -0,0 +1,150 @@
+""" Server mode: sessions keep their own state, and TCP binds loopback by default.
+
+Usage: PYTHONPATH=src python3 -m unittest discover -s tests
+"""
+import os
+import socket
+import sys
+import tempfile
+import threading
+import time
+import unittest
+
+import shell_core
+
+PROMPT = b"test> "
+
+
+def stop_server(cmd_name):
+  shell_core.stop_server()
+
+
+class Client:
+  """ One connection to the server, read up to each prompt. """
+  def __init__(self, sock):
+    self.sock = sock
+    self.sock.settimeout(5)
+    self.read_prompt()
+
+  def read_prompt(self):
+    data = b""
+    while not data.endswith(PROMPT):
+      chunk = self.sock.recv(4096)
+      if not chunk:
+        break
+      data += chunk
+    return data
+
+  def run(self, line):
+    """ Sends a line and returns what it printed (without the echo and the prompt). """
+    self.sock.sendall(line.encode() + b"\n")
+    output = self.read_prompt()
+    output = output[:-len(PROMPT)] if output.endswith(PROMPT) else output
+    return output.split(b"\n", 1)[1].decode() if b"\n" in output else ""
+
+  def close(self):
+    self.sock.close()
+
+
+@unittest.skipIf(sys.platform == "win32", "serve() is not supported on Windows")
+class ServerTest(unittest.TestCase):
+  def setUp(self):
+    self.dir = tempfile.TemporaryDirectory()
+    self.cwd = os.getcwd()
+    self.clients = []
+    shell_core.register("test_stop_server", stop_server)
+
+  def tearDown(self):
+    if getattr(self, "thread", None) and self.thread.is_alive():
+      self.connect().run("test_stop_server")
+      self.thread.join(5)
+    for client in self.clients:
+      client.close()
+    shell_core.unregister("test_stop_server")
+    os.chdir(self.cwd)
+    self.dir.cleanup()
+
+  def serve(self, address):
+    self.address = address
+    self.errors = []
+    def target():
+      try:
+        shell_core.serve(address, prompt=PROMPT.decode())
+      except Exception as e:
+        self.errors.append(e)
+    self.thread = threading.Thread(target=target, daemon=True)
+    self.thread.start()
+    self.connect() # Waits until it listens
+
+  def connect(self):
+    deadline = time.monotonic() + 5
+    while True:
+      family = socket.AF_UNIX if isinstance(self.address, str) else socket.AF_INET
+      sock = socket.socket(family, socket.SOCK_STREAM)
+      try:
+        sock.connect(self.address if isinstance(self.address, str) else ("127.0.0.1", self.address[1]))
+        break
+      except OSError:
+        sock.close()
+        if time.monotonic() > deadline or self.errors:
+          raise
+        time.sleep(0.05)
+    client = Client(sock)
+    self.clients.append(client)
+    return client
+
+  def test_sessions_keep_separate_variables(self):
+    self.serve(os.path.join(self.dir.name, "shell.sock"))
+    first, second = self.connect(), self.connect()
+    first.run("SESSION_VAR=first")
+    second.run("SESSION_VAR=second")
+    self.assertEqual(first.run("echo $SESSION_VAR"), "first\n")
+    self.assertEqual(second.run("echo $SESSION_VAR"), "second\n")
+    self.assertIsNone(shell_core.get_var("SESSION_VAR"))
+
+  def test_sessions_keep_separate_directories(self):
+    self.serve(os.path.join(self.dir.name, "shell.sock"))
+    first, second = self.connect(), self.connect()
+    first.run(f"cd {self.dir.name}")
+    self.assertEqual(os.path.realpath(first.run("/bin/pwd").strip()), os.path.realpath(self.dir.name))
+    self.assertEqual(os.path.realpath(second.run("/bin/pwd").strip()), os.path.realpath(self.cwd))
+
+  def free_port(self):
+    probe = socket.socket()
+    probe.bind(("127.0.0.1", 0))
+    port = probe.getsockname()[1]
+    probe.close()
+    return port
+
+  def answers(self, address, port):
+    with socket.socket() as sock:
+      sock.settimeout(1)
+      return sock.connect_ex((address, port)) == 0
+
+  @unittest.skipUnless(sys.platform.startswith("linux"), "relies on all of 127/8 reaching loopback")
+  def test_empty_host_binds_loopback_only(self):
+    port = self.free_port()
+    self.serve(("", port))
+    self.assertEqual(self.clients[0].run("echo tcp"), "tcp\n")
+    # Listening on every interface would answer on 127.0.0.2 too
+    self.assertFalse(self.answers("127.0.0.2", port))
+
+  @unittest.skipUnless(sys.platform.startswith("linux"), "relies on all of 127/8 reaching loopback")
+  def test_star_binds_every_interface(self):
+    port = self.free_port()
+    self.serve(("*", port))
+    self.assertTrue(self.answers("127.0.0.2", port))
+
+  def test_hung_up_job_does_not_block_other_sessions(self):
+    self.serve(os.path.join(self.dir.name, "shell.sock"))
+    first, second = self.connect(), self.connect()
+    first.run("nohup sleep 30 > /dev/null &")
+    first.close()
+    self.clients.remove(first)
+    start = time.monotonic()
+    self.assertEqual(second.run("echo alive"), "alive\n")
+    self.assertLess(time.monotonic() - start, 2)
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,65 @@
+""" Spawning external commands: the PATH cache and scripts without #!.
+
+Usage: PYTHONPATH=src python3 -m unittest discover -s tests
+"""
+import os
+import sys
+import tempfile
+import unittest
+
+import shell_core
+
+
+@unittest.skipIf(sys.platform == "win32", "posix_spawn and the PATH cache are POSIX only")
+class SpawnTest(unittest.TestCase):
+  def setUp(self):
+    self.dir = tempfile.TemporaryDirectory()
+    self.first = self.subdir("first")
+    self.second = self.subdir("second")
+    self.path = shell_core.get_var("PATH")
+    shell_core.set_var("PATH", f"{self.first}:{self.second}:{self.path}")
+
+  def tearDown(self):
+    shell_core.set_var("PATH", self.path)
+    self.dir.cleanup()
+
+  def subdir(self, name):
+    path = os.path.join(self.dir.name, name)
+    os.mkdir(path)
+    return path
+
+  def script(self, directory, name, body):
+    path = os.path.join(directory, name)
+    with open(path, "w") as out:
+      out.write(body)
+    os.chmod(path, 0o755)
+    return path
+
+  def output(self, line):
+    out = os.path.join(self.dir.name, "out.txt")
+    code = shell_core.run(f"{line} > {out}")
+    with open(out) as result:
+      return code, result.read()
+
+  def test_moved_binary_is_found_again(self):
+    first = self.script(self.first, "spawn_tool", "#!/bin/sh\necho first\n")
+    self.script(self.second, "spawn_tool", "#!/bin/sh\necho second\n")
+    self.assertEqual(self.output("spawn_tool"), (0, "first\n"))
+    os.unlink(first)
+    self.assertEqual(self.output("spawn_tool"), (0, "second\n"))
+    self.assertEqual(shell_core.get_path_cache()["spawn_tool"], os.path.join(self.second, "spawn_tool"))
+
+  def test_removed_binary_is_forgotten(self):
+    path = self.script(self.first, "spawn_gone", "#!/bin/sh\necho here\n")
+    self.assertEqual(shell_core.run("spawn_gone"), 0)
+    os.unlink(path)
+    self.assertEqual(shell_core.run("spawn_gone"), 127)
+    self.assertNotIn("spawn_gone", shell_core.get_path_cache())
+
+  def test_script_without_shebang_runs_with_sh(self):
+    self.script(self.first, "spawn_plain", "echo from-script\n")
+    self.assertEqual(self.output("spawn_plain"), (0, "from-script\n"))
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,40 @@
+""" Per-stage records handed to the trace hook.
+
+Usage: PYTHONPATH=src python3 -m unittest discover -s tests
+"""
+import sys
+import unittest
+
+import shell_core
+
+
+class TraceHookTest(unittest.TestCase):
+  def setUp(self):
+    self.records = []
+    shell_core.set_trace_hook(self.records.append)
+
+  def tearDown(self):
+    shell_core.set_trace_hook(None)
+
+  def stages(self, line):
+    shell_core.run(line)
+    return self.records[-1]["stages"]
+
+  def test_early_stage_ends_when_it_exits(self):
+    slow, fast = self.stages("sleep 0.4 | sleep 0.05")
+    self.assertGreater(slow["wall"], 0.3)
+    self.assertLess(fast["wall"], 0.3)
+
+  @unittest.skipUnless(sys.platform.startswith("linux"), "Linux reports the shell's RSS for spawned children")
+  def test_no_rss_for_spawned_stages(self):
+    stage, = self.stages("/bin/true")
+    self.assertIsNone(stage["max_rss_kb"])
+
+  def test_exit_codes(self):
+    first, last = self.stages("/bin/false | /bin/true")
+    self.assertEqual((first["exit_code"], last["exit_code"]), (1, 0))
+    self.assertEqual(self.records[-1]["exit_code"], 0)
+
+
+if __name__ == "__main__":
+  unittest.main()